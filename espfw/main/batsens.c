@@ -3,6 +3,7 @@
 #include <esp_adc/adc_cali_scheme.h>
 #include <esp_adc/adc_oneshot.h>
 #include <esp_log.h>
+#include <time.h>
 #include "batsens.h"
 
 /* voltage divider for battery sensing is attached to GPIO8,
@@ -12,6 +13,14 @@
 static adc_cali_handle_t adc_calhan;
 static adc_oneshot_unit_handle_t bs_adchan;
 
+/* How many ADC readings we take for one measurement. One oneshot read
+ * takes only a few dozen microseconds, so this is quick. */
+#define BS_NSAMPLES 32
+
+static struct batsensdata bsdata = {
+  .idle = -9999.99, .loaded = -9999.99, .sag = 0.0, .idlets = 0, .loadedts = 0
+};
+
 void batsens_init(void)
 {
   /* Initialize the ADC for the battery sensor */
@@ -36,17 +45,57 @@ void batsens_init(void)
   ESP_ERROR_CHECK(adc_cali_create_scheme_line_fitting(&caliconfig, &adc_calhan));
 }
 
+/* Takes a burst of BS_NSAMPLES ADC readings, and returns the mean of
+ * the middle half of them (the "interquartile mean"). That throws away
+ * both spikes and dips, while still averaging over many samples. */
+static int sampleburst(int * rawres)
+{
+  int samples[BS_NSAMPLES];
+  int n = 0;
+  for (int i = 0; i < BS_NSAMPLES; i++) {
+    int adcv;
+    if (adc_oneshot_read(bs_adchan, BSGPIO, &adcv) == ESP_OK) {
+      samples[n] = adcv;
+      n++;
+    }
+  }
+  if (n < (BS_NSAMPLES / 2)) {
+    ESP_LOGE("batsens.c", "adc_oneshot_read returned error for %d of %d samples!",
+                          (BS_NSAMPLES - n), BS_NSAMPLES);
+    return 1;
+  }
+  /* Insertion sort - there are only a few values. */
+  for (int i = 1; i < n; i++) {
+    int v = samples[i];
+    int j = i - 1;
+    while ((j >= 0) && (samples[j] > v)) {
+      samples[j + 1] = samples[j];
+      j--;
+    }
+    samples[j + 1] = v;
+  }
+  int first = n / 4;
+  int last = n - (n / 4);
+  long sum = 0;
+  for (int i = first; i < last; i++) {
+    sum += samples[i];
+  }
+  *rawres = (sum + ((last - first) / 2)) / (last - first);
+  ESP_LOGD("batsens.c", "burst of %d: min %d, median %d, max %d, IQM %d",
+                        n, samples[0], samples[n / 2], samples[n - 1], *rawres);
+  return 0;
+}
+
 float batsens_read(void)
 {
   int adcv;
-  if (adc_oneshot_read(bs_adchan, BSGPIO, &adcv) != ESP_OK) {
-  ESP_LOGE("batsens.c", "adc_oneshot_read returned error!");
-    adcv = -9999.99;
+  if (sampleburst(&adcv) != 0) {
+    return -9999.99;
   }
   int v;
   if (adc_cali_raw_to_voltage(adc_calhan, adcv, &v) != ESP_OK) {
     ESP_LOGE("batsens.c", "adc_cali_raw_to_voltage returned error!");
-    v = -9999.99;
+    return -9999.99;
   }
   /* Voltage divider: 1000000 Ohm towards "+", 47000 Ohm towards "-",
    * ADC maximum: 0.75V, but we don't care - adc_cali_raw_to_voltage
@@ -56,3 +105,32 @@ float batsens_read(void)
   return res;
 }
 
+float batsens_sample(int point)
+{
+  float v = batsens_read();
+  if (v < 0.0) {
+    return v;
+  }
+  if (point == BS_LOADED) {
+    bsdata.loaded = v;
+    bsdata.loadedts = time(NULL);
+  } else {
+    bsdata.idle = v;
+    bsdata.idlets = time(NULL);
+  }
+  if ((bsdata.idlets > 0) && (bsdata.loadedts > 0)) {
+    bsdata.sag = bsdata.idle - bsdata.loaded;
+  }
+  return v;
+}
+
+void batsens_getdata(struct batsensdata * d)
+{
+  *d = bsdata;
+}
+
+void batsens_shifttimes(time_t delta)
+{
+  if (bsdata.idlets > 0) { bsdata.idlets += delta; }
+  if (bsdata.loadedts > 0) { bsdata.loadedts += delta; }
+}
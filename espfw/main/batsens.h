@@ -5,11 +5,39 @@
 /* Battery Sensor - a.k.a. an ADC pin, where we measure the voltage of
  * our big battery via an external voltage divider. */
 
+#include <time.h>
+
+/* Sampling points for batsens_sample() */
+#define BS_IDLE 0    /* while nothing big is drawing power */
+#define BS_LOADED 1  /* while the modem is transmitting */
+
+struct batsensdata {
+  float idle;      /* last voltage sampled at BS_IDLE */
+  float loaded;    /* last voltage sampled at BS_LOADED */
+  float sag;       /* idle - loaded, i.e. how much the voltage drops under load */
+  time_t idlets;   /* when idle was sampled */
+  time_t loadedts; /* when loaded was sampled */
+};
+
 void batsens_init(void);
 
 /* This returns the fully converted value, meaning the
- * battery voltage, not the voltage coming from the voltage divider. */
+ * battery voltage, not the voltage coming from the voltage divider.
+ * It takes a burst of readings and averages the middle half of them,
+ * so single outliers do not matter. */
 float batsens_read(void);
 
+/* Like batsens_read, but also records the result as the voltage at
+ * the given sampling point (BS_IDLE or BS_LOADED). Once both are
+ * known, the difference is available as the "sag". */
+float batsens_sample(int point);
+
+/* Returns the recorded values. */
+void batsens_getdata(struct batsensdata * d);
+
+/* Shifts the sampling times by delta seconds, for when the clock was
+ * stepped. */
+void batsens_shifttimes(time_t delta);
+
 #endif /* _BATSENS_H_ */
 
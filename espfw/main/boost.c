@@ -0,0 +1,164 @@
+
+/* Event triggered sampling boost */
+
+#include <esp_log.h>
+#include <math.h>
+#include "boost.h"
+
+/* A pressure drop faster than this (hPa per hour) is a trigger. Normal
+ * weather changes are well below 1 hPa/h, a passing thunderstorm or
+ * squall line is not. */
+#define BST_PRESSDROPRATE 1.0
+/* ...measured over at least this many seconds */
+#define BST_PRESSMININTERVAL 1800
+/* Gusts of Beaufort 7 or more */
+#define BST_GUSTABOVE 13.9
+/* Temperature changes of at least this many degrees within
+ * BST_TEMPWINDOW seconds */
+#define BST_TEMPSWINGABOVE 3.0
+#define BST_TEMPWINDOW 600
+/* We stay boosted until no trigger has fired for this long */
+#define BST_QUIET 1800
+
+/* History for the pressure tendency and temperature swings. We get
+ * pressure every 5 minutes (every minute while boosted), and
+ * temperature every minute (or more often). */
+#define BST_HISTLEN 16
+struct histent {
+  time_t ts;
+  float v;
+};
+static struct histent presshist[BST_HISTLEN];
+static int npresshist = 0;
+static struct histent temphist[BST_HISTLEN];
+static int ntemphist = 0;
+
+static struct bststate state = {
+  .active = 0, .since = 0, .lasttrigger = 0, .triggers = 0,
+  .pressrate = 0.0, .tempswing = 0.0, .nboosts = 0
+};
+static time_t lastrainstart = 0;
+
+/* Appends to a history, dropping the oldest entry if it is full. */
+static void histadd(struct histent * h, int * n, time_t ts, float v)
+{
+  if (*n >= BST_HISTLEN) {
+    for (int i = 1; i < BST_HISTLEN; i++) {
+      h[i - 1] = h[i];
+    }
+    *n = BST_HISTLEN - 1;
+  }
+  h[*n].ts = ts;
+  h[*n].v = v;
+  (*n)++;
+}
+
+/* Pressure tendency in hPa/h, from the oldest sample that is at most
+ * an hour old. 0.0 if we don't have enough history. */
+static float calcpressrate(time_t now)
+{
+  if (npresshist < 2) {
+    return 0.0;
+  }
+  struct histent * last = &presshist[npresshist - 1];
+  for (int i = 0; i < (npresshist - 1); i++) {
+    time_t dt = now - presshist[i].ts;
+    if ((dt <= 3600) && (dt >= BST_PRESSMININTERVAL)) {
+      return (last->v - presshist[i].v) * 3600.0 / (float)(last->ts - presshist[i].ts);
+    }
+  }
+  return 0.0;
+}
+
+/* Difference between highest and lowest temperature in the window */
+static float calctempswing(time_t now)
+{
+  float min = NAN, max = NAN;
+  for (int i = 0; i < ntemphist; i++) {
+    if ((now - temphist[i].ts) > BST_TEMPWINDOW) {
+      continue;
+    }
+    if (isnan(min) || (temphist[i].v < min)) { min = temphist[i].v; }
+    if (isnan(max) || (temphist[i].v > max)) { max = temphist[i].v; }
+  }
+  if (isnan(min)) {
+    return 0.0;
+  }
+  return max - min;
+}
+
+int bst_update(time_t now, const struct bstinput * in, int allowed)
+{
+  int fired = 0;
+  if (in->raining && (in->rainstart != lastrainstart)) {
+    lastrainstart = in->rainstart;
+    fired |= BST_RAINSTART;
+  }
+  if (in->press > 0.0) {
+    /* Only keep one value per 5 minutes, so that the history covers
+     * the last hour even while we're boosted. */
+    if ((npresshist == 0) || ((now - presshist[npresshist - 1].ts) >= 290)) {
+      histadd(presshist, &npresshist, now, in->press);
+    }
+    state.pressrate = calcpressrate(now);
+    if (state.pressrate <= -BST_PRESSDROPRATE) {
+      fired |= BST_PRESSDROP;
+    }
+  }
+  if (in->gust >= BST_GUSTABOVE) {
+    fired |= BST_GUST;
+  }
+  if (!isnan(in->temp)) {
+    histadd(temphist, &ntemphist, now, in->temp);
+    state.tempswing = calctempswing(now);
+    if (state.tempswing >= BST_TEMPSWINGABOVE) {
+      fired |= BST_TEMPSWING;
+    }
+  }
+  if (fired) {
+    ESP_LOGI("boost.c", "Triggers fired: 0x%x (pressure %.2f hPa/h, temp swing %.1f)",
+                        fired, state.pressrate, state.tempswing);
+    if (allowed) {
+      if (!state.active) {
+        state.active = 1;
+        state.since = now;
+        state.triggers = 0;
+        state.nboosts++;
+        ESP_LOGI("boost.c", "Boosting sampling and upload rates.");
+      }
+      state.triggers |= fired;
+      state.lasttrigger = now;
+    }
+  }
+  if (state.active) {
+    if (!allowed || ((now - state.lasttrigger) >= BST_QUIET)) {
+      state.active = 0;
+      ESP_LOGI("boost.c", "Back to normal rates after %lld seconds.", (long long)(now - state.since));
+    }
+  }
+  return fired;
+}
+
+int bst_active(void)
+{
+  return state.active;
+}
+
+void bst_getstate(struct bststate * st)
+{
+  *st = state;
+}
+
+void bst_shifttimes(time_t delta)
+{
+  for (int i = 0; i < npresshist; i++) {
+    presshist[i].ts += delta;
+  }
+  for (int i = 0; i < ntemphist; i++) {
+    temphist[i].ts += delta;
+  }
+  /* 0 means "never", and stays that way. */
+  if (state.since != 0) { state.since += delta; }
+  if (state.lasttrigger != 0) { state.lasttrigger += delta; }
+  if (lastrainstart != 0) { lastrainstart += delta; }
+}
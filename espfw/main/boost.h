@@ -0,0 +1,51 @@
+
+/* Event triggered sampling boost: when something interesting happens
+ * (rain starts, pressure drops quickly, strong gusts, fast temperature
+ * swings), we temporarily sample and upload more often, and fall back
+ * to the normal rates after a quiet period. */
+
+#ifndef _BOOST_H_
+#define _BOOST_H_
+
+#include <time.h>
+
+/* Triggers, as a bitmask */
+#define BST_RAINSTART 0x01
+#define BST_PRESSDROP 0x02
+#define BST_GUST      0x04
+#define BST_TEMPSWING 0x08
+
+struct bstinput {
+  int raining;      /* Is the RG15 reporting a rain event? */
+  time_t rainstart; /* ...and when did it start? */
+  float press;      /* pressure in hPa, negative if not measured */
+  float gust;       /* wind gust in m/s, negative if not measured */
+  float temp;       /* temperature in degC, NAN if not measured */
+};
+
+struct bststate {
+  int active;          /* Are we boosted right now? */
+  time_t since;        /* since when */
+  time_t lasttrigger;  /* when a trigger last fired */
+  int triggers;        /* triggers that fired during the current / last boost */
+  float pressrate;     /* current pressure tendency in hPa/h */
+  float tempswing;     /* temperature range over the last minutes */
+  unsigned int nboosts; /* number of boosts since boot */
+};
+
+/* Feeds the rules with the values of a measurement cycle. If allowed
+ * is 0 (e.g. because we are low on energy), triggers are still
+ * detected, but do not start a boost.
+ * Returns the triggers that fired in this cycle (0 if none). */
+int bst_update(time_t now, const struct bstinput * in, int allowed);
+
+/* Returns 1 if we are boosted */
+int bst_active(void);
+
+void bst_getstate(struct bststate * st);
+
+/* Shifts the histories and all remembered times by delta seconds, for
+ * when the clock was stepped. */
+void bst_shifttimes(time_t delta);
+
+#endif /* _BOOST_H_ */
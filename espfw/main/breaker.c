@@ -0,0 +1,90 @@
+
+/* Circuit breakers for sensors. */
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "breaker.h"
+
+/* After how many failures in a row the breaker opens */
+#define BRK_TRIPAFTER 2
+/* First and maximum skip interval, in seconds */
+#define BRK_MINBACKOFF 120
+#define BRK_MAXBACKOFF 3600
+
+#define BRK_MAXBREAKERS 12
+
+static struct breaker * breakers[BRK_MAXBREAKERS];
+static int nbreakers = 0;
+
+static void trip(struct breaker * b)
+{
+  if (b->backoff == 0) {
+    b->backoff = BRK_MINBACKOFF;
+  } else {
+    b->backoff *= 2;
+    if (b->backoff > BRK_MAXBACKOFF) { b->backoff = BRK_MAXBACKOFF; }
+  }
+  b->trips++;
+  b->nexttry = esp_timer_get_time() + ((int64_t)b->backoff * 1000000LL);
+  ESP_LOGW("breaker.c", "%s failed %lu times in a row, skipping it for %lu seconds",
+                        b->name, b->failsinrow, b->backoff);
+}
+
+void brk_init(struct breaker * b, const char * name, int present)
+{
+  b->name = name;
+  b->present = present;
+  b->failsinrow = 0;
+  b->backoff = 0;
+  b->nexttry = 0;
+  b->trips = 0;
+  b->skipped = 0;
+  if (nbreakers < BRK_MAXBREAKERS) {
+    breakers[nbreakers] = b;
+    nbreakers++;
+  }
+  if (!present) {
+    ESP_LOGW("breaker.c", "%s was not found during probing.", name);
+    b->failsinrow = BRK_TRIPAFTER;
+    trip(b);
+  }
+}
+
+int brk_allow(struct breaker * b)
+{
+  if (b->backoff == 0) {
+    return 1;
+  }
+  if (esp_timer_get_time() >= b->nexttry) {
+    /* The skip interval is over, allow one attempt. Its result decides
+     * whether we close the breaker or skip for even longer. */
+    return 1;
+  }
+  b->skipped++;
+  return 0;
+}
+
+void brk_success(struct breaker * b)
+{
+  if (b->backoff != 0) {
+    ESP_LOGI("breaker.c", "%s is working again.", b->name);
+  }
+  b->failsinrow = 0;
+  b->backoff = 0;
+}
+
+void brk_failure(struct breaker * b)
+{
+  b->failsinrow++;
+  if ((b->backoff != 0) || (b->failsinrow >= BRK_TRIPAFTER)) {
+    trip(b);
+  }
+}
+
+struct breaker * brk_get(int i)
+{
+  if ((i < 0) || (i >= nbreakers)) {
+    return NULL;
+  }
+  return breakers[i];
+}
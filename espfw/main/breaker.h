@@ -0,0 +1,40 @@
+
+/* Circuit breakers for sensors.
+ * If a sensor is absent or broken, every attempt to read it costs
+ * timeouts. A breaker remembers that a sensor failed, and then makes us
+ * skip it for a while, with the interval growing exponentially as long
+ * as it keeps failing. */
+
+#ifndef _BREAKER_H_
+#define _BREAKER_H_
+
+#include <stdint.h>
+
+struct breaker {
+  const char * name;
+  uint8_t present;      /* Result of the probing at startup */
+  uint32_t failsinrow;  /* Failed attempts in a row */
+  uint32_t backoff;     /* Current skip interval in seconds, 0 if closed */
+  int64_t nexttry;      /* When we may try again (esp_timer time in us) */
+  uint32_t trips;       /* How often the breaker has opened */
+  uint32_t skipped;     /* How many attempts were skipped */
+};
+
+/* Registers a breaker (for reporting), and sets the result of probing
+ * for the sensor. A sensor that was not found starts with an open
+ * breaker, so it is only tried occasionally. */
+void brk_init(struct breaker * b, const char * name, int present);
+
+/* Returns 1 if the sensor should be used now, 0 if it should be
+ * skipped. */
+int brk_allow(struct breaker * b);
+
+/* Report the result of using a sensor. */
+void brk_success(struct breaker * b);
+void brk_failure(struct breaker * b);
+
+/* For statistics: Returns the i-th registered breaker, or NULL if
+ * there are not that many. */
+struct breaker * brk_get(int i);
+
+#endif /* _BREAKER_H_ */
@@ -0,0 +1,141 @@
+
+/* The energy governor: picks an operating profile depending on the
+ * battery voltage and its trend. */
+
+#include <esp_log.h>
+#include "energy.h"
+
+/* Resting voltages of our 12V AGM battery at which we switch down to
+ * a more economical profile. For comparison: 12.8V is full, 12.2V is
+ * about half, and below 11.8V it's practically empty. */
+#define EN_SAVEBELOW 12.2
+#define EN_SURVIVALBELOW 11.9
+/* Going back up requires the voltage to be this much higher than the
+ * threshold, for EN_UPAFTER battery measurements (every 5 minutes) in a
+ * row. Otherwise we would flap between profiles whenever the voltage
+ * hovers around a threshold. */
+#define EN_HYSTERESIS 0.15
+#define EN_UPAFTER 2
+/* For going down, we also look ahead by this many hours using the
+ * trend, so that a quickly falling voltage switches earlier. */
+#define EN_LOOKAHEAD 1.0
+/* The trend is calculated over this many battery measurements (one
+ * every 5 minutes) */
+#define EN_TRENDLEN 12
+
+static const struct enprofile profiles[] = {
+  [EN_PROF_FULL]     = { "full",     1,  1 },
+  [EN_PROF_SAVE]     = { "save",     5,  1 },
+  [EN_PROF_SURVIVAL] = { "survival", 60, 0 },
+};
+
+static const float downthres[] = {
+  [EN_PROF_FULL]     = EN_SAVEBELOW,     /* leave FULL below this */
+  [EN_PROF_SAVE]     = EN_SURVIVALBELOW, /* leave SAVE below this */
+  [EN_PROF_SURVIVAL] = 0.0,
+};
+
+static struct enstate state = {
+  .profile = EN_PROF_FULL, .since = 0, .voltage = -1.0, .trend = 0.0, .transitions = 0
+};
+static float history[EN_TRENDLEN];
+static time_t historyts[EN_TRENDLEN];
+static int nhistory = 0;
+static int histpos = 0;
+static int upcount = 0;
+
+/* Least squares fit over the history, result in V per hour */
+static float calctrend(void)
+{
+  if (nhistory < 5) {
+    return 0.0;
+  }
+  double mt = 0.0, mv = 0.0;
+  for (int i = 0; i < nhistory; i++) {
+    mt += (double)(historyts[i] - historyts[0]);
+    mv += history[i];
+  }
+  mt /= nhistory;
+  mv /= nhistory;
+  double num = 0.0, den = 0.0;
+  for (int i = 0; i < nhistory; i++) {
+    double dt = (double)(historyts[i] - historyts[0]) - mt;
+    num += dt * (history[i] - mv);
+    den += dt * dt;
+  }
+  if (den <= 0.0) {
+    return 0.0;
+  }
+  return (float)((num / den) * 3600.0);
+}
+
+static void switchto(int newprof, const char * why)
+{
+  ESP_LOGW("energy.c", "Switching from profile %s to %s (%.2fV, trend %+.3fV/h): %s",
+                       profiles[state.profile].name, profiles[newprof].name,
+                       state.voltage, state.trend, why);
+  state.profile = newprof;
+  state.since = time(NULL);
+  state.transitions++;
+  upcount = 0;
+}
+
+int en_update(float batvolt)
+{
+  if (batvolt < 0.0) {
+    return state.profile;
+  }
+  time_t now = time(NULL);
+  history[histpos] = batvolt;
+  historyts[histpos] = now;
+  histpos = (histpos + 1) % EN_TRENDLEN;
+  if (nhistory < EN_TRENDLEN) {
+    nhistory++;
+  }
+  state.voltage = batvolt;
+  state.trend = calctrend();
+  float projected = batvolt;
+  if (state.trend < 0.0) {
+    projected += state.trend * EN_LOOKAHEAD;
+  }
+  /* Do we need to go down? Possibly more than one step at once. */
+  int newprof = state.profile;
+  while ((newprof < EN_PROF_SURVIVAL) && (projected < downthres[newprof])) {
+    newprof++;
+  }
+  if (newprof != state.profile) {
+    switchto(newprof, "battery low");
+    return state.profile;
+  }
+  /* Can we go up again? One step at a time. */
+  if ((state.profile > EN_PROF_FULL)
+   && (batvolt >= (downthres[state.profile - 1] + EN_HYSTERESIS))) {
+    upcount++;
+    if (upcount >= EN_UPAFTER) {
+      switchto(state.profile - 1, "battery recovered");
+    }
+  } else {
+    upcount = 0;
+  }
+  return state.profile;
+}
+
+const struct enprofile * en_getprofile(void)
+{
+  return &profiles[state.profile];
+}
+
+void en_getstate(struct enstate * st)
+{
+  *st = state;
+}
+
+void en_shifttimes(time_t delta)
+{
+  for (int i = 0; i < nhistory; i++) {
+    historyts[i] += delta;
+  }
+  if (state.since != 0) {
+    state.since += delta;
+  }
+}
@@ -0,0 +1,44 @@
+
+/* The energy governor: picks an operating profile depending on the
+ * battery voltage and its trend, so that we don't drain the battery
+ * flat on a couple of cloudy days. */
+
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+#include <time.h>
+
+#define EN_PROF_FULL     0  /* Everything at full rate */
+#define EN_PROF_SAVE     1  /* Upload only every few cycles */
+#define EN_PROF_SURVIVAL 2  /* SEN50 off, upload only once per hour */
+
+struct enprofile {
+  const char * name;
+  int uploadevery;  /* Upload every this many measurement cycles */
+  int sen50on;      /* Is the particulate matter sensor used? */
+};
+
+struct enstate {
+  int profile;         /* current profile (EN_PROF_*) */
+  time_t since;        /* when we switched to it */
+  float voltage;       /* last (idle) voltage we were fed */
+  float trend;         /* voltage trend in V per hour */
+  unsigned int transitions; /* number of profile changes since boot */
+};
+
+/* Feeds the governor with the current resting battery voltage. This
+ * needs to be called for every battery measurement. It returns the
+ * profile to use from now on. Invalid (negative) voltages are
+ * ignored. */
+int en_update(float batvolt);
+
+/* Returns the parameters of the current profile */
+const struct enprofile * en_getprofile(void);
+void en_getstate(struct enstate * st);
+
+/* Shifts the timestamps of the voltage history by delta seconds, for
+ * when the clock was stepped. Otherwise the trend across the step
+ * would be close to 0. */
+void en_shifttimes(time_t delta);
+
+#endif /* _ENERGY_H_ */
@@ -1,37 +1,253 @@
 
 #include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "driver/i2c.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "i2c.h"
 
-void i2c_port_init(void)
+/* The clock we run the buses at unless a device on it cannot handle
+ * that. All sensors on bus 0 can do fast mode (400 kHz), but the SEN50
+ * on bus 1 only supports 100 kHz. */
+#define I2C_MAXCLK 400000
+
+/* A sensor that holds SDA low blocks every other device on the bus.
+ * If we see this many failed transactions in a row on a bus (i.e. not a
+ * single successful one in between, from any device), we try to recover
+ * the bus by clocking SCL, generating a STOP and reinitializing the
+ * driver. To not do that all the time if a single device on a bus is
+ * simply dead, we do it at most every I2C_RECOVERYINTERVAL seconds. */
+#define I2C_RECOVERAFTER 3
+#define I2C_RECOVERYINTERVAL 300
+
+#define I2C_MAXDEVS 12
+
+struct i2cbus {
+  int sda;
+  int scl;
+  uint32_t clk;
+  SemaphoreHandle_t mutex;
+  uint32_t consecfails;
+  uint32_t recoveries;
+  int64_t lastrecovery; /* esp_timer timestamp, microseconds */
+};
+
+static struct i2cdev * devs[I2C_MAXDEVS];
+static int ndevs = 0;
+static const uint32_t lathistlimits[I2C_LATHISTBUCKETS - 1] = I2C_LATHISTLIMITS;
+
+static struct i2cbus buses[2] = {
+  { .sda = 10, .scl =  9, .clk = I2C_MAXCLK, .mutex = NULL },  /* GPIO10 / GPIO9 */
+  { .sda = 12, .scl = 11, .clk = I2C_MAXCLK, .mutex = NULL },  /* GPIO12 / GPIO11 */
+};
+
+static void configurebus(i2c_port_t port)
 {
-    i2c_config_t i2cp0conf = {
+    i2c_config_t i2cpconf = {
         .mode = I2C_MODE_MASTER,
-        .sda_io_num = 10,  /* GPIO10 */
-        .scl_io_num = 9,  /* GPIO9 */
+        .sda_io_num = buses[port].sda,
+        .scl_io_num = buses[port].scl,
         .sda_pullup_en = GPIO_PULLUP_ENABLE,
         .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = 100000, /* There is really no need to hurry */
+        .master.clk_speed = buses[port].clk,
     };
-    i2c_param_config(I2C_NUM_0, &i2cp0conf);
-    if (i2c_driver_install(I2C_NUM_0, i2cp0conf.mode, 0, 0, 0) != ESP_OK) {
-        ESP_LOGI("zamdach-i2c.c", "Oh dear: I2C-Init for Port 0 failed.");
-    } else {
-        ESP_LOGI("zamdach-i2c.c", "I2C master port 0 initialized");
+    i2c_param_config(port, &i2cpconf);
+}
+
+void i2c_port_init(void)
+{
+    for (i2c_port_t port = I2C_NUM_0; port <= I2C_NUM_1; port++) {
+      buses[port].mutex = xSemaphoreCreateRecursiveMutex();
+      configurebus(port);
+      if (i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0) != ESP_OK) {
+        ESP_LOGI("zamdach-i2c.c", "Oh dear: I2C-Init for Port %d failed.", port);
+      } else {
+        ESP_LOGI("zamdach-i2c.c", "I2C master port %d initialized", port);
+      }
     }
-    i2c_config_t i2cp1conf = {
-        .mode = I2C_MODE_MASTER,
-        .sda_io_num = 12,  /* GPIO12 */
-        .scl_io_num = 11,  /* GPIO11 */
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = 100000, /* There is really no need to hurry */
+}
+
+void i2c_dev_init(struct i2cdev * dev, i2c_port_t port)
+{
+    dev->port = port;
+    if (ndevs < I2C_MAXDEVS) {
+      devs[ndevs] = dev;
+      ndevs++;
+    }
+    if ((dev->maxclk > 0) && (dev->maxclk < buses[port].clk)) {
+      i2c_bus_lock(port);
+      buses[port].clk = dev->maxclk;
+      configurebus(port);
+      i2c_bus_unlock(port);
+      ESP_LOGI("zamdach-i2c.c", "I2C port %d slowed down to %lu Hz for %s",
+                                port, buses[port].clk, dev->name);
+    }
+}
+
+void i2c_bus_lock(i2c_port_t port)
+{
+    xSemaphoreTakeRecursive(buses[port].mutex, portMAX_DELAY);
+}
+
+void i2c_bus_unlock(i2c_port_t port)
+{
+    xSemaphoreGiveRecursive(buses[port].mutex);
+}
+
+struct i2cdev * i2c_getdev(int i)
+{
+    if ((i < 0) || (i >= ndevs)) {
+      return NULL;
+    }
+    return devs[i];
+}
+
+uint32_t i2c_getrecoveries(i2c_port_t port)
+{
+    return buses[port].recoveries;
+}
+
+uint32_t i2c_geterrors(void)
+{
+    uint32_t res = 0;
+    for (int i = 0; i < ndevs; i++) {
+      res += devs[i]->nerr;
+    }
+    return res;
+}
+
+/* Tries to get a bus that is stuck (usually because a device is holding
+ * SDA low, waiting for more clocks that never come) working again.
+ * Needs to be called with the bus locked. */
+static void recoverbus(i2c_port_t port)
+{
+    struct i2cbus * b = &buses[port];
+    ESP_LOGW("zamdach-i2c.c", "I2C port %d: %lu failures in a row, trying bus recovery",
+                              port, b->consecfails);
+    b->recoveries++;
+    b->lastrecovery = esp_timer_get_time();
+    b->consecfails = 0;
+    i2c_driver_delete(port);
+    /* Drive the pins manually: SCL as open-drain output, SDA as input. */
+    gpio_config_t pinconf = {
+      .pin_bit_mask = (1ULL << b->scl) | (1ULL << b->sda),
+      .mode = GPIO_MODE_INPUT_OUTPUT_OD,
+      .pull_up_en = GPIO_PULLUP_ENABLE,
+      .pull_down_en = GPIO_PULLDOWN_DISABLE,
+      .intr_type = GPIO_INTR_DISABLE,
     };
-    i2c_param_config(I2C_NUM_1, &i2cp1conf);
-    if (i2c_driver_install(I2C_NUM_1, i2cp1conf.mode, 0, 0, 0) != ESP_OK) {
-        ESP_LOGI("zamdach-i2c.c", "Oh dear: I2C-Init for Port 1 failed.");
-    } else {
-        ESP_LOGI("zamdach-i2c.c", "I2C master port 1 initialized");
+    gpio_config(&pinconf);
+    gpio_set_level(b->sda, 1);
+    gpio_set_level(b->scl, 1);
+    esp_rom_delay_us(5);
+    /* Up to 9 clocks, until the device lets go of SDA. That way it can
+     * finish whatever byte it thinks it is sending. */
+    for (int i = 0; i < 9; i++) {
+      if (gpio_get_level(b->sda) != 0) { break; }
+      gpio_set_level(b->scl, 0);
+      esp_rom_delay_us(5);
+      gpio_set_level(b->scl, 1);
+      esp_rom_delay_us(5);
+    }
+    /* Now generate a STOP condition: SDA going high while SCL is high. */
+    gpio_set_level(b->scl, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(b->sda, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(b->scl, 1);
+    esp_rom_delay_us(5);
+    gpio_set_level(b->sda, 1);
+    esp_rom_delay_us(5);
+    if (gpio_get_level(b->sda) == 0) {
+      ESP_LOGE("zamdach-i2c.c", "I2C port %d: SDA is still held low after recovery attempt", port);
+    }
+    /* And hand the pins back to the I2C driver. */
+    configurebus(port);
+    if (i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0) != ESP_OK) {
+      ESP_LOGE("zamdach-i2c.c", "Oh dear: I2C-Reinit for Port %d failed.", port);
     }
 }
 
+/* Records the result of a transaction in the statistics, and triggers
+ * bus recovery if things look stuck.
+ * Needs to be called with the bus locked. */
+static void recordresult(struct i2cdev * dev, esp_err_t res, int64_t startts)
+{
+    struct i2cbus * b = &buses[dev->port];
+    int64_t now = esp_timer_get_time();
+    int64_t lat = now - startts;
+    int bucket = 0;
+    while ((bucket < (I2C_LATHISTBUCKETS - 1)) && (lat >= lathistlimits[bucket])) {
+      bucket++;
+    }
+    dev->lathist[bucket]++;
+    dev->ntrans++;
+    if (res == ESP_OK) {
+      dev->consecfails = 0;
+      b->consecfails = 0;
+      return;
+    }
+    dev->nerr++;
+    dev->consecfails++;
+    if (res == ESP_ERR_TIMEOUT) {
+      dev->ntimeout++;
+    }
+    b->consecfails++;
+    if ((b->consecfails >= I2C_RECOVERAFTER)
+     && ((b->recoveries == 0) || ((now - b->lastrecovery) > (I2C_RECOVERYINTERVAL * 1000000LL)))) {
+      recoverbus(dev->port);
+    }
+}
+
+esp_err_t i2c_dev_probe(struct i2cdev * dev)
+{
+    esp_err_t res;
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_WRITE, true);
+    i2c_master_stop(cmd);
+    i2c_bus_lock(dev->port);
+    res = i2c_master_cmd_begin(dev->port, cmd, pdMS_TO_TICKS(dev->timeoutms));
+    i2c_bus_unlock(dev->port);
+    i2c_cmd_link_delete(cmd);
+    return res;
+}
+
+esp_err_t i2c_dev_write(struct i2cdev * dev, const uint8_t * buf, size_t len)
+{
+    esp_err_t res;
+    i2c_bus_lock(dev->port);
+    int64_t startts = esp_timer_get_time();
+    res = i2c_master_write_to_device(dev->port, dev->addr, buf, len,
+                                     pdMS_TO_TICKS(dev->timeoutms));
+    recordresult(dev, res, startts);
+    i2c_bus_unlock(dev->port);
+    return res;
+}
+
+esp_err_t i2c_dev_read(struct i2cdev * dev, uint8_t * buf, size_t len)
+{
+    esp_err_t res;
+    i2c_bus_lock(dev->port);
+    int64_t startts = esp_timer_get_time();
+    res = i2c_master_read_from_device(dev->port, dev->addr, buf, len,
+                                      pdMS_TO_TICKS(dev->timeoutms));
+    recordresult(dev, res, startts);
+    i2c_bus_unlock(dev->port);
+    return res;
+}
+
+esp_err_t i2c_dev_writeread(struct i2cdev * dev, const uint8_t * wbuf, size_t wlen,
+                            uint8_t * rbuf, size_t rlen)
+{
+    esp_err_t res;
+    i2c_bus_lock(dev->port);
+    int64_t startts = esp_timer_get_time();
+    res = i2c_master_write_read_device(dev->port, dev->addr, wbuf, wlen, rbuf, rlen,
+                                       pdMS_TO_TICKS(dev->timeoutms));
+    recordresult(dev, res, startts);
+    i2c_bus_unlock(dev->port);
+    return res;
+}
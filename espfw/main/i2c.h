@@ -2,7 +2,63 @@
 #ifndef _I2C_H_
 #define _I2C_H_
 
+#include "driver/i2c.h" /* Needed for i2c_port_t */
+
+/* Buckets of the latency histogram, upper limits in microseconds.
+ * There is one more bucket for everything slower than the last one. */
+#define I2C_LATHISTLIMITS { 500, 1000, 2000, 5000, 20000 }
+#define I2C_LATHISTBUCKETS 6
+
+/* One device on one of our I2C buses.
+ * Drivers define one of these statically, with everything but
+ * port filled in, and then call i2c_dev_init() on it. */
+struct i2cdev {
+  i2c_port_t port;
+  uint8_t addr;
+  const char * name;
+  uint32_t maxclk; /* Fastest SCL clock the device supports, in Hz */
+  int timeoutms;   /* Timeout for a single transaction */
+  /* Statistics, maintained by i2c.c */
+  uint32_t ntrans;      /* Number of transactions */
+  uint32_t nerr;        /* Number of failed transactions (including timeouts) */
+  uint32_t ntimeout;    /* Number of transactions that timed out */
+  uint32_t consecfails; /* Number of failed transactions in a row */
+  uint32_t lathist[I2C_LATHISTBUCKETS];
+};
+
 void i2c_port_init();
 
-#endif /* _I2C_H_ */
+/* Registers a device on a bus. If the device cannot handle the clock
+ * the bus is currently running at, the bus is slowed down accordingly. */
+void i2c_dev_init(struct i2cdev * dev, i2c_port_t port);
+
+/* The usual transactions, with the timeout configured for the device. */
+esp_err_t i2c_dev_write(struct i2cdev * dev, const uint8_t * buf, size_t len);
+esp_err_t i2c_dev_read(struct i2cdev * dev, uint8_t * buf, size_t len);
+esp_err_t i2c_dev_writeread(struct i2cdev * dev, const uint8_t * wbuf, size_t wlen,
+                            uint8_t * rbuf, size_t rlen);
+
+/* Checks whether a device is there, by addressing it and seeing if
+ * it ACKs. Returns ESP_OK if it does. This is not counted in the
+ * statistics. */
+esp_err_t i2c_dev_probe(struct i2cdev * dev);
 
+/* Every single transaction above is atomic. If a driver needs a sequence
+ * of transactions to not be interrupted by other tasks using the same
+ * bus, it can lock the bus. This lock is recursive, and transactions on
+ * the other bus are not affected by it. */
+void i2c_bus_lock(i2c_port_t port);
+void i2c_bus_unlock(i2c_port_t port);
+
+/* For statistics: Returns the i-th registered device, or NULL if there
+ * are not that many. */
+struct i2cdev * i2c_getdev(int i);
+
+/* Returns the number of times a bus has been recovered (see i2c.c)
+ * since boot. */
+uint32_t i2c_getrecoveries(i2c_port_t port);
+
+/* Returns the sum of failed transactions over all devices since boot. */
+uint32_t i2c_geterrors(void);
+
+#endif /* _I2C_H_ */
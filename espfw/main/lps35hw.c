@@ -1,20 +1,40 @@
 /* Talking to the LPS35HW pressure sensor */
 
 #include "esp_log.h"
+#include "i2c.h"
 #include "lps35hw.h"
 #include "sdkconfig.h"
 
 
 #define LPS35HWADDR 0x5d  /* That is the default address of our breakout board */
-#define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication */
 
-static i2c_port_t lps35hwi2cport;
+#define LPS35HW_REG_CTRL1 0x10
+#define LPS35HW_ODR1HZ 0x10     /* Output data rate 1 Hz (the lowest) */
+#define LPS35HW_ENLPFP 0x08     /* Enable the low-pass filter */
+#define LPS35HW_LPFPCFG 0x04    /* LPF bandwidth ODR/20 instead of ODR/9 */
+#define LPS35HW_BDU 0x02        /* Block data update */
+#define LPS35HW_REG_CTRL2 0x11
+#define LPS35HW_FIFOEN 0x40
+#define LPS35HW_IFADDINC 0x10
+#define LPS35HW_REG_FIFOCTRL 0x14
+#define LPS35HW_FMODESTREAM 0x40 /* Stream mode: FIFO keeps the newest 32 samples */
+#define LPS35HW_REG_FIFOSTATUS 0x26
+#define LPS35HW_FIFOSIZE 32
+#define LPS35HW_REG_PRESSOUTXL 0x28
+/* Every sample in the FIFO consists of 3 bytes pressure and 2 bytes
+ * temperature. Reading beyond TEMP_OUT_H (0x2c) wraps around to
+ * PRESS_OUT_XL (0x28), so all samples can be read in one burst. */
+#define LPS35HW_BYTESPERSAMPLE 5
+static struct i2cdev lps35hwdev = {
+    .addr = LPS35HWADDR,
+    .name = "LPS35HW",
+    .maxclk = 400000,
+    .timeoutms = 50,
+};
 
 static esp_err_t lps35hw_register_read(uint8_t reg_addr, uint8_t *data, size_t len)
 {
-    return i2c_master_write_read_device(lps35hwi2cport,
-                                        LPS35HWADDR, &reg_addr, 1, data, len,
-                                        pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    return i2c_dev_writeread(&lps35hwdev, &reg_addr, 1, data, len);
 }
 
 static esp_err_t lps35hw_register_write_byte(uint8_t reg_addr, uint8_t data)
@@ -22,42 +42,74 @@ static esp_err_t lps35hw_register_write_byte(uint8_t reg_addr, uint8_t data)
     int ret;
     uint8_t write_buf[2] = {reg_addr, data};
 
-    ret = i2c_master_write_to_device(lps35hwi2cport,
-                                     LPS35HWADDR, write_buf, sizeof(write_buf),
-                                     pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    ret = i2c_dev_write(&lps35hwdev, write_buf, sizeof(write_buf));
 
     return ret;
 }
 
 void lps35hw_init(i2c_port_t port)
 {
-    lps35hwi2cport = port;
+    i2c_dev_init(&lps35hwdev, port);
 
     /* Configure the LPS35HW */
-    /* Other than the LPS25HB which did NOT support a oneshot-mode
-     * and thus had to be configured to do continous measurements
-     * at the lowest possible rate, the LPS35HW can do one-shot.
-     * So we do not need to configure anything here right now,
-     * the default values in all control registers are perfectly
-     * fine. */
+    /* We used to do one-shot measurements, but a single sample per
+     * minute is rather noisy. So instead we let the sensor measure
+     * continuously at 1 Hz (which costs only a few uA) through its
+     * low-pass filter, into the FIFO in stream mode. Once per cycle
+     * we then read everything that's in the FIFO in one go. */
+    lps35hw_register_write_byte(LPS35HW_REG_CTRL2, (LPS35HW_FIFOEN | LPS35HW_IFADDINC));
+    lps35hw_register_write_byte(LPS35HW_REG_FIFOCTRL, LPS35HW_FMODESTREAM);
+    lps35hw_register_write_byte(LPS35HW_REG_CTRL1, (LPS35HW_ODR1HZ | LPS35HW_ENLPFP
+                                                    | LPS35HW_LPFPCFG | LPS35HW_BDU));
 }
 
-void lps35hw_startmeas(void)
+int lps35hw_probe(void)
 {
-    /* CTRL_REG2 0x11: IF_ADD_INC (bit 4), ONE_SHOT (bit 0) */
-    lps35hw_register_write_byte(0x11, (0x10 | 0x01));
+    uint8_t whoami;
+    /* WHO_AM_I 0x0F always contains 0xB1 */
+    if (lps35hw_register_read(0x0F, &whoami, 1) != ESP_OK) {
+      return 0;
+    }
+    return (whoami == 0xB1);
 }
 
-double lps35hw_readpressure(void)
+
+void lps35hw_readfifo(struct lps35hwdata * d)
 {
-    uint8_t prr[3];
-    if (lps35hw_register_read(0x80 | 0x28, &prr[0], 3) != ESP_OK) {
-      /* There was an I2C read error - return a negative pressure to signal that. */
-      return -999999.9;
+    uint8_t fifostatus;
+    uint8_t buf[LPS35HW_FIFOSIZE * LPS35HW_BYTESPERSAMPLE];
+    double samples[LPS35HW_FIFOSIZE];
+    d->valid = 0;
+    d->nsamples = 0;
+    d->press = -999999.9;
+    d->pressvar = 0.0;
+    if (lps35hw_register_read(LPS35HW_REG_FIFOSTATUS, &fifostatus, 1) != ESP_OK) {
+      return;
+    }
+    int n = fifostatus & 0x3f;
+    if (n > LPS35HW_FIFOSIZE) { n = LPS35HW_FIFOSIZE; }
+    if (n == 0) {
+      ESP_LOGW("lps35hw.c", "FIFO is empty.");
+      return;
+    }
+    if (lps35hw_register_read(0x80 | LPS35HW_REG_PRESSOUTXL, &buf[0], n * LPS35HW_BYTESPERSAMPLE) != ESP_OK) {
+      return;
     }
-    double press = (((uint32_t)prr[2]  << 16)
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+      uint8_t * prr = &buf[i * LPS35HW_BYTESPERSAMPLE];
+      samples[i] = (((uint32_t)prr[2]  << 16)
                   + ((uint32_t)prr[1]  <<  8)
                   + ((uint32_t)prr[0]  <<  0)) / 4096.0;
-    return press;
+      sum += samples[i];
+    }
+    double mean = sum / n;
+    double sqdev = 0.0;
+    for (int i = 0; i < n; i++) {
+      sqdev += (samples[i] - mean) * (samples[i] - mean);
+    }
+    d->press = mean;
+    d->pressvar = (n > 1) ? (sqdev / (n - 1)) : 0.0;
+    d->nsamples = n;
+    d->valid = 1;
 }
-
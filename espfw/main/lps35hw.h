@@ -4,16 +4,25 @@
 
 #include "driver/i2c.h" /* Needed for i2c_port_t */
 
+struct lps35hwdata {
+  uint8_t valid;
+  int nsamples;    /* Number of samples that went into press */
+  double press;    /* mean pressure in hPa */
+  double pressvar; /* variance of the samples in hPa^2 */
+};
+
+/* This puts the sensor into continuous mode at 1 Hz, with the low
+ * pass filter enabled and the FIFO in stream mode. */
 void lps35hw_init(i2c_port_t port);
 
-/* Starts a one-shot measurement. Unfortunately, it is not
- * documented how long that will take. However, since you can
- * configure the sensor to between 1 and 75 measurements per
- * second in continous mode, it should be safe to assume it
- * won't take longer than a second, probably a lot less. */
-void lps35hw_startmeas(void);
-/* Read the result of the previous measurement. */
-double lps35hw_readpressure(void);
+/* Checks whether the sensor is there (by reading its WHO_AM_I register).
+ * Returns 1 if it is. */
+int lps35hw_probe(void);
+
+/* Drains the FIFO, and returns mean and variance of all samples that
+ * were in it. As the FIFO holds 32 samples, that is (at most) the last
+ * 32 seconds. */
+void lps35hw_readfifo(struct lps35hwdata * d);
 
 #endif /* _LPS35HW_H_ */
 
@@ -1,12 +1,19 @@
 /* Talking to the LTR390 UV / ambient light sensor */
 
 #include "esp_log.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "i2c.h"
 #include "ltr390.h"
 #include "sdkconfig.h"
 
 
 #define LTR390ADDR 0x53
-#define I2C_MASTER_TIMEOUT_MS 100  /* Timeout for I2C communication */
+
+/* The INT pin of the LTR390 is wired to this GPIO. It is active low. */
+#define LTR390_INTGPIO 14
 
 #define LTR390_REG_MAINCTRL 0x00
 #define LTR390_ALSMODE 0x00  /* Ambient Light mode (=UV bit not set) */
@@ -47,14 +54,49 @@
 #define LTR390_GAIN09 0x03
 #define LTR390_GAIN18 0x04
 
+/* Auto-ranging for ambient light: If a measurement is over- or
+ * underrange, we immediately measure again with a better gain, but
+ * with a shorter integration time (18 bit / 100 ms) so this does not
+ * take forever. At most this many extra measurements are made. */
+#define LTR390_ALSMAXRETRIES 2
+#define LTR390_ALSRETRYRATE (LTR390_RES18BIT | LTR390_RATE0100MS)
+
+/* Measurement profiles for ltr390_measure(). Each sample is one UV
+ * and one ALS conversion, and the results of all samples are averaged.
+ * All of them take roughly a second in total. */
+static const struct ltr390profile {
+    const char * name;
+    uint8_t measrate;
+    int nsamples;
+} ltr390profiles[] = {
+    [LTR390_PROF_FAST]    = { "fast",    (LTR390_RES18BIT | LTR390_RATE0100MS), 6 },
+    [LTR390_PROF_NORMAL]  = { "normal",  (LTR390_RES19BIT | LTR390_RATE0200MS), 3 },
+    [LTR390_PROF_PRECISE] = { "precise", (LTR390_RES20BIT | LTR390_RATE0500MS), 1 },
+};
+
+/* Where the selected profile is stored */
+#define LTR390NVSNAMESPACE "ltr390"
+
+#define LTR390_REG_PARTID 0x06
+#define LTR390_PARTID 0xB0 /* upper nibble: part number, lower nibble: revision */
+
 #define LTR390_REG_MAINSTATUS 0x07
 #define LTR390_MSTA_NEWDATA 0x08
+#define LTR390_MSTA_INTSTATUS 0x10 /* cleared by reading MAINSTATUS */
 
 #define LTR390_REG_INTCFG 0x19
 #define LTR390_INT_USEALS 0x10 /* this is the poweron default */
 #define LTR390_INT_USEUVS 0x30
 #define LTR390_INT_ENABLE 0x04
 
+#define LTR390_REG_INTPERSIST 0x1a
+/* The LTR390 has no real "data ready" interrupt, only one for
+ * crossing thresholds. But with the upper threshold at 0, the lower
+ * one at the maximum and a persistence of 0, every single conversion
+ * triggers it. */
+#define LTR390_REG_THRESUP 0x21 /* 3 bytes, LSB first */
+#define LTR390_REG_THRESLOW 0x24 /* 3 bytes, LSB first */
+
 #define LTR390_REG_ALSDATAL 0x0d  /* LSB */
 #define LTR390_REG_ALSDATAM 0x0e
 #define LTR390_REG_ALSDATAH 0x0f  /* MSB */
@@ -63,8 +105,22 @@
 #define LTR390_REG_UVSDATAM 0x11
 #define LTR390_REG_UVSDATAH 0x12  /* MSB */
 
-static i2c_port_t ltr390i2cport;
+static struct i2cdev ltr390dev = {
+    .addr = LTR390ADDR,
+    .name = "LTR390",
+    .maxclk = 400000,
+    .timeoutms = 50,
+};
 static uint8_t alsgainsetting;
+static int curprofile = LTR390_PROF_NORMAL;
+/* Current content of the MEASRATE register */
+static uint8_t measrate = (LTR390_RES20BIT | LTR390_RATE2000MS);
+/* Given by the interrupt handler whenever the LTR390 signals that a
+ * conversion finished. */
+static SemaphoreHandle_t ltr390datasem = NULL;
+/* Set if the interrupt did not arrive although there was data -
+ * then we just poll as in the old days. */
+static int usepolling = 0;
 /* Correction factors for glass above the sensor. These are
  * different for Ambient Light and UV because the glass
  * filters different wavelengths differently. */
@@ -79,30 +135,167 @@ static esp_err_t ltr390_writereg(uint8_t reg, uint8_t val)
     uint8_t regandval[2];
     regandval[0] = reg;
     regandval[1] = val;
-    return i2c_master_write_to_device(ltr390i2cport, LTR390ADDR,
-                                      regandval, 2,
-                                      I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    return i2c_dev_write(&ltr390dev, regandval, 2);
+}
+
+static void ltr390irq(void * arg)
+{
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(ltr390datasem, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/* Returns the conversion time in ms for the current resolution,
+ * rounded up. */
+static int convtime(void)
+{
+    switch (measrate & 0x70) {
+    case LTR390_RES20BIT: return 400;
+    case LTR390_RES19BIT: return 200;
+    case LTR390_RES18BIT: return 100;
+    case LTR390_RES17BIT: return 50;
+    case LTR390_RES16BIT: return 25;
+    default:              return 13;
+    };
+}
+
+/* Reads MAINSTATUS, which also clears a pending interrupt.
+ * Returns the register value, or -1 on error. */
+static int readmainstatus(void)
+{
+    uint8_t rtr = LTR390_REG_MAINSTATUS;
+    uint8_t st;
+    if (i2c_dev_writeread(&ltr390dev, &rtr, 1, &st, 1) != ESP_OK) {
+      return -1;
+    }
+    return st;
+}
+
+/* Forget about any conversion that might have finished before,
+ * so that the next waitfordata() waits for a new one. */
+static void discardpending(void)
+{
+    if (ltr390datasem != NULL) {
+      xSemaphoreTake(ltr390datasem, 0);
+    }
+    readmainstatus();
+}
+
+/* Waits until the LTR390 has new data. Returns 1 if it does, 0 on
+ * timeout or error. Normally, this sleeps until the interrupt
+ * arrives, so no I2C traffic is needed until the data is there. */
+static int waitfordata(void)
+{
+    int timeout = convtime() + 100;
+    int st;
+    if ((ltr390datasem != NULL) && (usepolling == 0)) {
+      if (xSemaphoreTake(ltr390datasem, pdMS_TO_TICKS(timeout)) == pdTRUE) {
+        st = readmainstatus();
+        if ((st >= 0) && ((st & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA)) {
+          return 1;
+        }
+      }
+      /* Either no interrupt arrived, or there was no data after all.
+       * Check whether the data is there anyways - in that case the
+       * interrupt line is not working. */
+      st = readmainstatus();
+      if ((st >= 0) && ((st & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA)) {
+        ESP_LOGW("ltr390.c", "Data ready, but no interrupt received. Falling back to polling.");
+        usepolling = 1;
+        return 1;
+      }
+      return 0;
+    }
+    /* Polling mode */
+    for (int waited = 0; waited <= timeout; waited += 50) {
+      st = readmainstatus();
+      if ((st >= 0) && ((st & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA)) {
+        return 1;
+      }
+      vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    return 0;
+}
+
+int ltr390_probe(void)
+{
+    uint8_t rtr = LTR390_REG_PARTID;
+    uint8_t id;
+    if (i2c_dev_writeread(&ltr390dev, &rtr, 1, &id, 1) != ESP_OK) {
+      return 0;
+    }
+    return ((id & 0xF0) == LTR390_PARTID);
 }
 
 void ltr390_startuvmeas(void)
 {
+    ltr390_writereg(LTR390_REG_INTCFG, (LTR390_INT_USEUVS | LTR390_INT_ENABLE));
+    discardpending();
     ltr390_writereg(LTR390_REG_GAIN, LTR390_GAIN18);
     ltr390_writereg(LTR390_REG_MAINCTRL, (LTR390_UVSMODE | LTR390_LSENABLE));
 }
 
-void ltr390_startalmeas(void)
+static uint8_t gainreg(int gain)
 {
-    uint8_t g = LTR390_GAIN01;
-    switch (alsgainsetting) {
-    case  3: g = LTR390_GAIN03; break;
-    case  6: g = LTR390_GAIN06; break;
-    case  9: g = LTR390_GAIN09; break;
-    case 18: g = LTR390_GAIN18; break;
+    switch (gain) {
+    case  3: return LTR390_GAIN03;
+    case  6: return LTR390_GAIN06;
+    case  9: return LTR390_GAIN09;
+    case 18: return LTR390_GAIN18;
     };
-    ltr390_writereg(LTR390_REG_GAIN, g);
+    return LTR390_GAIN01;
+}
+
+/* The integration time factor from the lux formula in the datasheet,
+ * for the current resolution. */
+static double intfactor(void)
+{
+    switch (measrate & 0x70) {
+    case LTR390_RES20BIT: return 4.0;
+    case LTR390_RES19BIT: return 2.0;
+    case LTR390_RES18BIT: return 1.0;
+    case LTR390_RES17BIT: return 0.5;
+    case LTR390_RES16BIT: return 0.25;
+    case LTR390_RES13BIT: return 0.125; /* 12.5 ms */
+    default:              return 1.0;   /* reserved values, we never set them */
+    };
+}
+
+/* The maximum raw value for the current resolution */
+static uint32_t fullscale(void)
+{
+    switch (measrate & 0x70) {
+    case LTR390_RES20BIT: return 0xfffff;
+    case LTR390_RES19BIT: return 0x7ffff;
+    case LTR390_RES18BIT: return 0x3ffff;
+    case LTR390_RES17BIT: return 0x1ffff;
+    case LTR390_RES16BIT: return 0x0ffff;
+    case LTR390_RES13BIT: return 0x01fff;
+    default:              return 0x3ffff;
+    };
+}
+
+static void startals(int gain)
+{
+    ltr390_writereg(LTR390_REG_INTCFG, (LTR390_INT_USEALS | LTR390_INT_ENABLE));
+    discardpending();
+    ltr390_writereg(LTR390_REG_GAIN, gainreg(gain));
     ltr390_writereg(LTR390_REG_MAINCTRL, (LTR390_ALSMODE | LTR390_LSENABLE));
 }
 
+static void setmeasrate(uint8_t mr)
+{
+    if (mr != measrate) {
+      measrate = mr;
+      ltr390_writereg(LTR390_REG_MEASRATE, measrate);
+    }
+}
+
+void ltr390_startalmeas(void)
+{
+    startals(alsgainsetting);
+}
+
 void ltr390_stopmeas(void)
 {
     ltr390_writereg(LTR390_REG_MAINCTRL, 0);
@@ -110,48 +303,64 @@ void ltr390_stopmeas(void)
 
 void ltr390_init(i2c_port_t port)
 {
-    ltr390i2cport = port;
+    i2c_dev_init(&ltr390dev, port);
 
     /* Configure the LTR390 */
-    ltr390_writereg(LTR390_REG_MEASRATE, (LTR390_RES20BIT | LTR390_RATE2000MS));
+    ltr390_writereg(LTR390_REG_MEASRATE, measrate);
+    /* Make every conversion trigger an interrupt (see above) */
+    uint8_t thres[7] = { LTR390_REG_THRESUP, 0x00, 0x00, 0x00, 0xff, 0xff, 0x0f };
+    i2c_dev_write(&ltr390dev, thres, 7);
+    ltr390_writereg(LTR390_REG_INTPERSIST, 0x00);
+
+    ltr390datasem = xSemaphoreCreateBinary();
+    gpio_config_t intpin = {
+      .pin_bit_mask = (1ULL << LTR390_INTGPIO),
+      .mode = GPIO_MODE_INPUT,
+      .pull_up_en = GPIO_PULLUP_ENABLE,
+      .pull_down_en = GPIO_PULLDOWN_DISABLE,
+      .intr_type = GPIO_INTR_NEGEDGE,
+    };
+    esp_err_t e = gpio_config(&intpin);
+    if (e == ESP_OK) {
+      e = gpio_install_isr_service(0);
+      if (e == ESP_ERR_INVALID_STATE) { /* Already installed, that's fine */
+        e = ESP_OK;
+      }
+    }
+    if (e == ESP_OK) {
+      e = gpio_isr_handler_add(LTR390_INTGPIO, ltr390irq, NULL);
+    }
+    if (e != ESP_OK) {
+      ESP_LOGE("ltr390.c", "Could not set up interrupt on GPIO%d: %s. Will poll instead.",
+               LTR390_INTGPIO, esp_err_to_name(e));
+      usepolling = 1;
+    }
     ltr390_startuvmeas();
     
     alsgainsetting = 1;
+
+    nvs_handle_t nvsh;
+    if (nvs_open(LTR390NVSNAMESPACE, NVS_READONLY, &nvsh) == ESP_OK) {
+      uint8_t u8;
+      if ((nvs_get_u8(nvsh, "profile", &u8) == ESP_OK)
+       && (u8 < (sizeof(ltr390profiles) / sizeof(ltr390profiles[0])))) {
+        curprofile = u8;
+      }
+      nvs_close(nvsh);
+    }
+    ESP_LOGI("ltr390.c", "Using measurement profile %s.", ltr390profiles[curprofile].name);
 }
 
 double ltr390_readuv(void)
 {
     uint8_t uvsreg[3];
     int isvalid = 1;
-    uint8_t repctr = 0;
-    uint8_t rtr = LTR390_REG_MAINSTATUS;
-    do {
-      if (isvalid != 1) {
-        /* Sleep a short while before retrying */
-        vTaskDelay(pdMS_TO_TICKS(50));
-      }
-      uint8_t res = i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-                                                 &rtr, 1, &uvsreg[0], 1,
-                                                 I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-      if (res != ESP_OK) {
-        isvalid = 0;
-      } else {
-        if ((uvsreg[0] & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
-          isvalid = 1;
-        } else {
-          isvalid = 0;
-        }
-      }
-      repctr++;
-    } while ((isvalid != 1) && (repctr < 10));
-    if (isvalid != 1) {
+    if (!waitfordata()) {
       ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (3).");
       return -1.0;
     }
-    rtr = LTR390_REG_UVSDATAL;
-    if (i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-        &rtr, 1, &uvsreg[0], 3,
-        I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
+    uint8_t rtr = LTR390_REG_UVSDATAL;
+    if (i2c_dev_writeread(&ltr390dev, &rtr, 1, &uvsreg[0], 3) != ESP_OK) {
       isvalid = 0;
     }
     if (isvalid != 1) {
@@ -162,6 +371,9 @@ double ltr390_readuv(void)
     uint32_t uvsr32 = ((uint32_t)(uvsreg[2] & 0x0F) << 16)
                     | ((uint32_t)uvsreg[1] << 8)
                     | uvsreg[0];
+    /* Scale to what we would have gotten at 20 bits resolution, see
+     * below why. */
+    double uvs20 = (double)uvsr32 * (4.0 / intfactor());
     /* The datasheet uses "UV sensitivity" in the UV index formula, and that one is
      * only given for gain=18 and resolution=20 bits, so we cannot really use anything
      * else.
@@ -171,72 +383,163 @@ double ltr390_readuv(void)
      * datasheet there. The only source for the "1.4" datasheet is a github repo for
      * an Arduino-library: https://github.com/levkovigor/LTR390 */
     double uvsensitivity = 2300.0;
-    double uvind = ((double)uvsr32 / uvsensitivity) * glassfactoruv;
+    double uvind = (uvs20 / uvsensitivity) * glassfactoruv;
     return uvind;
 }
 
-double ltr390_readal(void)
+/* Waits for and reads one raw ALS value. Returns 0 on success. */
+static int readalsraw(uint32_t * raw)
 {
     uint8_t alsreg[3];
-    int isvalid = 1;
-    uint8_t rtr = LTR390_REG_MAINSTATUS;
-    uint8_t repctr = 0;
-    do {
-      if (isvalid != 1) {
-        /* Sleep a short while before retrying */
-        vTaskDelay(pdMS_TO_TICKS(50));
-      }
-      uint8_t res = i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-                                                 &rtr, 1, &alsreg[0], 1,
-                                                 I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-      if (res != ESP_OK) {
-        isvalid = 0;
-      } else {
-        if ((alsreg[0] & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
-          isvalid = 1;
-        } else {
-          isvalid = 0;
-        }
-      }
-      repctr++;
-    } while ((isvalid != 1) && (repctr < 10));
-    if (isvalid != 1) {
+    if (!waitfordata()) {
       ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (1).");
-      return -1.0;
+      return 1;
     }
-    rtr = LTR390_REG_ALSDATAL;
-    if (i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-        &rtr, 1, &alsreg[0], 3,
-        I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
-      isvalid = 0;
-    }
-    if (isvalid != 1) {
-      /* Read error, signal that we received nonsense by returning a negative UV index */
+    uint8_t rtr = LTR390_REG_ALSDATAL;
+    if (i2c_dev_writeread(&ltr390dev, &rtr, 1, &alsreg[0], 3) != ESP_OK) {
       ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (2).");
+      return 1;
+    }
+    *raw = ((uint32_t)(alsreg[2] & 0x0F) << 16)
+         | ((uint32_t)alsreg[1] << 8)
+         | alsreg[0];
+    return 0;
+}
+
+/* Picks the gain for a remeasurement at LTR390_ALSRETRYRATE after an
+ * underrange reading: The highest one that still keeps us at no more
+ * than half of the full scale. */
+static int pickhighergain(uint32_t raw, int gain)
+{
+    const int gains[] = { 18, 9, 6, 3, 1 };
+    /* Counts per gain at the retry resolution */
+    double cpg = ((double)raw / (double)gain) / intfactor();
+    for (int i = 0; i < 5; i++) {
+      if ((cpg * gains[i]) < (double)(0x3ffff / 2)) {
+        return gains[i];
+      }
+    }
+    return 1;
+}
+
+double ltr390_readal(void)
+{
+    uint32_t alsr32;
+    uint8_t normalrate = measrate;
+    int gain = alsgainsetting;
+    if (readalsraw(&alsr32) != 0) {
       return -1.0;
     }
-    uint32_t alsr32 = ((uint32_t)(alsreg[2] & 0x0F) << 16)
-                    | ((uint32_t)alsreg[1] << 8)
-                    | alsreg[0];
-    double lux = (((double)alsr32 * 0.6) / ((double)alsgainsetting * 4.0)) * glassfactoral;
+    for (int retries = 0; retries < LTR390_ALSMAXRETRIES; retries++) {
+      int newgain;
+      if (alsr32 >= ((fullscale() / 10) * 9)) { /* (almost) overflowing */
+        if (gain == 1) {
+          /* This is already the largest range there is - a shorter
+           * integration time does not change that either. */
+          break;
+        }
+        newgain = 1;
+      } else if (alsr32 < (fullscale() >> 9)) { /* underflowing */
+        newgain = pickhighergain(alsr32, gain);
+        /* Only worth it if the remeasurement results in more counts -
+         * it has less resolution after all. */
+        if ((newgain * 1.0) <= (gain * intfactor())) {
+          break;
+        }
+      } else { /* in range */
+        break;
+      }
+      ESP_LOGI("ltr390.c", "ALS raw value %lu at gain %d out of range, remeasuring at gain %d",
+                           alsr32, gain, newgain);
+      ltr390_writereg(LTR390_REG_MAINCTRL, 0);
+      setmeasrate(LTR390_ALSRETRYRATE);
+      startals(newgain);
+      gain = newgain;
+      if (readalsraw(&alsr32) != 0) {
+        setmeasrate(normalrate);
+        return -1.0;
+      }
+    }
+    double lux = (((double)alsr32 * 0.6) / ((double)gain * intfactor())) * glassfactoral;
 #if 1
-    ESP_LOGI("ltr390.c", "DEBUG: raw ALS values %02x%02x%02x at gain %u -> %.3f lux",
-                         alsreg[0], alsreg[1], alsreg[2], alsgainsetting, lux);
+    ESP_LOGI("ltr390.c", "DEBUG: raw ALS value %05lx at gain %d and factor %.2f -> %.3f lux",
+                         alsr32, gain, intfactor(), lux);
 #endif
-    /* Correct the alsgainsetting for the next measurement, if we're
-     * either (almost) overflowing or underflowing. */
-    if (alsr32 > 0xd000) {
-      if (alsgainsetting != 1) {
-        ESP_LOGI("ltr390.c", "switching GAIN for next ambient light measurement to 1");
-      }
-      alsgainsetting = 1;
+    if (measrate != normalrate) {
+      ltr390_writereg(LTR390_REG_MAINCTRL, 0);
+      setmeasrate(normalrate);
     }
-    if (alsr32 < 0x800) {
-      if (alsgainsetting != 18) {
-        ESP_LOGI("ltr390.c", "switching GAIN for next ambient light measurement to 18");
-      }
-      alsgainsetting = 18;
+    /* Start with the gain that worked next time. */
+    if (gain != alsgainsetting) {
+      ESP_LOGI("ltr390.c", "switching GAIN for next ambient light measurement to %d", gain);
+      alsgainsetting = gain;
     }
     return lux;
 }
 
+int ltr390_setprofile(int profile)
+{
+    if ((profile < 0) || (profile >= (int)(sizeof(ltr390profiles) / sizeof(ltr390profiles[0])))) {
+      return 1;
+    }
+    curprofile = profile;
+    nvs_handle_t nvsh;
+    if (nvs_open(LTR390NVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+      ESP_LOGE("ltr390.c", "Failed to open NVS for saving the profile.");
+      return 1;
+    }
+    esp_err_t e = nvs_set_u8(nvsh, "profile", curprofile);
+    if (e == ESP_OK) { e = nvs_commit(nvsh); }
+    nvs_close(nvsh);
+    if (e != ESP_OK) {
+      ESP_LOGE("ltr390.c", "Failed to save the profile to NVS: %s", esp_err_to_name(e));
+      return 1;
+    }
+    return 0;
+}
+
+int ltr390_getprofile(void)
+{
+    return curprofile;
+}
+
+const char * ltr390_getprofilename(int profile)
+{
+    if ((profile >= 0) && (profile < (int)(sizeof(ltr390profiles) / sizeof(ltr390profiles[0])))) {
+      return ltr390profiles[profile].name;
+    }
+    return "invalid";
+}
+
+void ltr390_measure(struct ltr390data * res)
+{
+    const struct ltr390profile * p = &ltr390profiles[curprofile];
+    double uvsum = 0.0;
+    double luxsum = 0.0;
+    res->nuv = 0;
+    res->nal = 0;
+    ltr390_writereg(LTR390_REG_MAINCTRL, 0);
+    setmeasrate(p->measrate);
+    /* Alternate between UV and ALS, so that a passing cloud affects
+     * both the same way. */
+    for (int i = 0; i < p->nsamples; i++) {
+      ltr390_startuvmeas();
+      double uv = ltr390_readuv();
+      if (uv >= 0.0) {
+        uvsum += uv;
+        res->nuv++;
+      }
+      ltr390_startalmeas();
+      double lux = ltr390_readal();
+      if (lux >= 0.0) {
+        luxsum += lux;
+        res->nal++;
+      }
+    }
+    /* No need to keep the sensor running until the next cycle. */
+    ltr390_stopmeas();
+    res->uvind = (res->nuv > 0) ? (uvsum / res->nuv) : -1.0;
+    res->lux = (res->nal > 0) ? (luxsum / res->nal) : -1.0;
+    ESP_LOGI("ltr390.c", "profile %s: %d UV and %d ALS samples averaged",
+                         p->name, res->nuv, res->nal);
+}
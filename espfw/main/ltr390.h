@@ -4,9 +4,26 @@
 
 #include "driver/i2c.h" /* Needed for i2c_port_t */
 
+/* Measurement profiles for ltr390_measure() */
+#define LTR390_PROF_FAST    0  /* 18 bit, 6 UV + 6 ALS conversions */
+#define LTR390_PROF_NORMAL  1  /* 19 bit, 3 UV + 3 ALS conversions */
+#define LTR390_PROF_PRECISE 2  /* 20 bit, 1 UV + 1 ALS conversion */
+
+struct ltr390data {
+  double uvind;  /* averaged UV index, negative if invalid */
+  double lux;    /* averaged ambient light, negative if invalid */
+  int nuv;       /* number of valid UV samples in the average */
+  int nal;       /* number of valid ALS samples in the average */
+};
+
 /* Init needs to be called before anything else.
- * will implicitly start UV measurement! */
+ * will implicitly start UV measurement!
+ * This also sets up the interrupt from the INT pin of the LTR390,
+ * so the read functions below can sleep until data is ready. */
 void ltr390_init(i2c_port_t port);
+/* Checks whether the sensor is there (by reading its part ID).
+ * Returns 1 if it is. */
+int ltr390_probe(void);
 /* Start an UV measurement. Results available after 400 ms. */
 void ltr390_startuvmeas(void);
 /* Start an AL (ambient light) measurement. Results after 400 ms. */
@@ -19,16 +36,30 @@ void ltr390_startalmeas(void);
 void ltr390_stopmeas(void);
 /* Read UV measurement results.
  * You should have started an UV measurement 400 ms before,
- * but if you haven't, this will block and wait for up to 500ms
- * for a result.
+ * but if you haven't, this will block until the conversion is done
+ * (signalled by interrupt), for up to 500ms.
  */
 double ltr390_readuv(void);
 /* Read AmbientLight measurement results.
  * You should have started an AL measurement 400 ms before,
- * but if you haven't, this will block and wait for up to 500ms
- * for a result.
+ * but if you haven't, this will block until the conversion is done
+ * (signalled by interrupt), for up to 500ms.
+ * If the result is over- or underrange, this immediately measures
+ * again with a better gain and a 100 ms integration time, up to two
+ * times, so this may take another 400 ms. If it did that, the sensor
+ * is stopped afterwards and you need to start a new measurement.
  */
 double ltr390_readal(void);
+/* Selects the measurement profile used by ltr390_measure(), and saves
+ * it to NVS so it survives a reboot. Returns 0 on success. */
+int ltr390_setprofile(int profile);
+int ltr390_getprofile(void);
+const char * ltr390_getprofilename(int profile);
+/* Does a complete measurement according to the current profile:
+ * Alternates between UV and ALS conversions, and averages them.
+ * This takes around a second, during which we mostly sleep waiting
+ * for the interrupt. The sensor is stopped afterwards. */
+void ltr390_measure(struct ltr390data * res);
 
 #endif /* _LTR390_H_ */
 
@@ -1,24 +1,35 @@
 #include "sdkconfig.h"
 #include <esp_log.h>
 #include <esp_sleep.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <math.h>
 #include <nvs_flash.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 #include "batsens.h"
+#include "boost.h"
+#include "breaker.h"
+#include "energy.h"
 #include "button.h"
 #include "i2c.h"
 #include "lps35hw.h"
 #include "ltr390.h"
 #include "mobilenet.h"
+#include "modemsup.h"
+#include "opsel.h"
+#include "pcounters.h"
 #include "rgbled.h"
 #include "rg15.h"
+#include "sched.h"
 #include "sen50.h"
 #include "sht4x.h"
 #include "submit.h"
+#include "timesync.h"
+#include "uplink.h"
 #include "webserver.h"
 #include "wifiap.h"
 #include "windsens.h"
@@ -34,8 +45,154 @@ int curwifistate = 0;
 struct ev evs[2];
 int activeevs = 0;
 
+/* Circuit breakers for all our sensors, so that a missing or broken
+ * sensor does not cost us its timeouts in every cycle. */
+static struct breaker brk_sht4x;
+static struct breaker brk_lps35hw;
+static struct breaker brk_ltr390;
+static struct breaker brk_winddir;
+static struct breaker brk_windsp;
+static struct breaker brk_rg15;
+static struct breaker brk_sen50;
+
+/* The measurement cycle: every cycle, one sample with the current
+ * values of all channels gets queued for upload. */
+static struct schedjob sj_meas;
+#define MEASPERIOD 60000
+#define MEASPERIODBOOSTED 30000
+
+/* Sampling rates of the sensor channels, normally and while boosted
+ * (see boost.h). Fast channels are aggregated over the measurement
+ * cycle, slow channels should be a multiple of it, and are only
+ * uploaded in the cycles they were measured in.
+ * Particulate matter is missing here because the SEN50 has its own
+ * (adaptive) schedule, with a warm-up phase before every reading. */
+#define CH_WIND    0
+#define CH_RAIN    1
+#define CH_TEMPHUM 2
+#define CH_LIGHT   3
+#define CH_PRESS   4
+#define CH_BATTERY 5
+#define CH_NUMCHANNELS 6
+struct channel {
+  const char * name;
+  uint32_t periodms;
+  uint32_t boostedms;
+  int inmeas; /* only sampled within the measurement cycle */
+  struct schedjob job;
+};
+static struct channel channels[CH_NUMCHANNELS] = {
+  [CH_WIND]    = { "wind",        5000,   2000, 0 },
+  [CH_RAIN]    = { "rain",       10000,   5000, 0 },
+  [CH_TEMPHUM] = { "temp/hum",   60000,  30000, 1 },
+  [CH_LIGHT]   = { "UV/light",   60000,  60000, 1 },
+  [CH_PRESS]   = { "pressure",  300000,  60000, 1 },
+  [CH_BATTERY] = { "battery",   300000, 300000, 1 },
+};
+
+/* Wind samples aggregated over the measurement cycle. The direction is
+ * averaged as a vector, everything else would go wrong around north. */
+struct windagg {
+  int ndir;
+  double sumsin, sumcos;
+  int nspeed;
+  double sumspeed;
+  float maxspeed;
+};
+static struct windagg windagg;
+
 #define sleep_ms(x) vTaskDelay(pdMS_TO_TICKS(x))
 
+/* Once our clock is set, moves the next deadline of all jobs that run
+ * in whole minutes (the measurement cycle and the slow channels) to
+ * the nearest full minute, and that of the jobs that run a few times
+ * per minute to the nearest multiple of their period. The scheduler
+ * runs on the monotonic clock, and this keeps it in step with the
+ * wall clock. */
+static void alignjobs(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (!ts_isrealtime(tv.tv_sec)) {
+    return;
+  }
+  int64_t nowus = esp_timer_get_time();
+  struct schedjob * j;
+  for (int i = 0; (j = sched_get(i)) != NULL; i++) {
+    int64_t grid;
+    if ((j->period % 60000000LL) == 0) {
+      grid = 60000000LL;
+    } else if ((60000000LL % j->period) == 0) {
+      grid = j->period;
+    } else {
+      continue;
+    }
+    int64_t wallnext = ((int64_t)tv.tv_sec * 1000000LL + tv.tv_usec) + (j->next - nowus);
+    int64_t rem = wallnext % grid;
+    if (rem < (grid / 2)) {
+      sched_setnext(j, j->next - rem);
+    } else {
+      sched_setnext(j, j->next + (grid - rem));
+    }
+  }
+}
+
+/* Switches all channels and the measurement cycle between the normal
+ * and the boosted rates. */
+static void setrates(int boosted)
+{
+  for (int i = 0; i < CH_NUMCHANNELS; i++) {
+    sched_setperiod(&channels[i].job, (boosted ? channels[i].boostedms : channels[i].periodms));
+  }
+  sched_setperiod(&sj_meas, (boosted ? MEASPERIODBOOSTED : MEASPERIOD));
+}
+
+/* Reads the wind sensors once, for the aggregation over the cycle. */
+static void samplewind(void)
+{
+  if (brk_allow(&brk_winddir)) {
+    float wd = windsens_getwinddir();
+    if ((wd > -0.01) && (wd < 360.01)) {
+      brk_success(&brk_winddir);
+      windagg.sumsin += sin(wd * M_PI / 180.0);
+      windagg.sumcos += cos(wd * M_PI / 180.0);
+      windagg.ndir++;
+    } else {
+      brk_failure(&brk_winddir);
+    }
+  }
+  if (brk_allow(&brk_windsp)) {
+    float ws = windsens_getwindspeed();
+    if (ws > -0.01) {
+      brk_success(&brk_windsp);
+      windagg.sumspeed += ws;
+      if ((windagg.nspeed == 0) || (ws > windagg.maxspeed)) {
+        windagg.maxspeed = ws;
+      }
+      windagg.nspeed++;
+    } else {
+      brk_failure(&brk_windsp);
+    }
+  }
+}
+
+/* Probes for all sensors and initializes the circuit breakers for them
+ * accordingly. */
+static void probesensors(void)
+{
+  int wk2132present = wk2132_probe();
+  int windpresent = (wk2132present ? windsens_probe() : 0);
+  brk_init(&brk_sht4x, "SHT4x", sht4x_probe());
+  brk_init(&brk_lps35hw, "LPS35HW", lps35hw_probe());
+  brk_init(&brk_ltr390, "LTR390", ltr390_probe());
+  brk_init(&brk_winddir, "wind direction", (windpresent & WINDSENS_DIR) != 0);
+  brk_init(&brk_windsp, "wind speed", (windpresent & WINDSENS_SPEED) != 0);
+  /* The RG15 will not talk unless talked to, so all we can check is
+   * whether the serial port it is connected to is there. */
+  brk_init(&brk_rg15, "RG15", wk2132present);
+  brk_init(&brk_sen50, "SEN50", sen50_probe());
+}
+
 void app_main(void)
 {
   ESP_LOGI(TAG, "Early initialization starting...");
@@ -48,6 +205,9 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(err);
   }
+  pcounters_init();
+  upl_init();
+  ops_init();
   mn_init();
   i2c_port_init();
   sht4x_init(I2C_NUM_0);
@@ -57,7 +217,7 @@ void app_main(void)
   rg15_init(); /* Note: RG15 is connected to wk2132 port 0 */
   windsens_init(1); /* Wind sensor is connected to wk2132 port 1 */
   sen50_init(I2C_NUM_1);
-  sen50_startmeas(); /* FIXME: We probably do not want this to run all the time. */
+  probesensors();
   button_init();
   rgbled_init();
   batsens_init();
@@ -69,7 +229,28 @@ void app_main(void)
   mn_configureltemodule();
 
   time_t lastmeasts = time(NULL);
-  time_t lastsuccsubmit = time(NULL);
+  /* Have we been attached since boot? And how long the attach in the
+   * last upload took to the first IP address (ms), -1 if it failed or
+   * we were still attached. */
+  int attachedonce = 0;
+  long ttfip = -1;
+  /* Mobile network info from the last upload. It goes out with the
+   * next sample, once. */
+  struct mninfo mi;
+  int newmninfo = 0;
+  /* The first measurement is right away, and all channels are
+   * sampled for it. */
+  int64_t firstrun = esp_timer_get_time();
+  for (int i = 0; i < CH_NUMCHANNELS; i++) {
+    sched_add(&channels[i].job, channels[i].name, channels[i].periodms, SCHED_SKIP);
+    sched_setnext(&channels[i].job, firstrun);
+    /* The measurement cycle wakes us for these. */
+    sched_setwakes(&channels[i].job, !channels[i].inmeas);
+  }
+  sched_add(&sj_meas, "measurement", MEASPERIOD, SCHED_SKIP);
+  int boosted = 0;
+  sched_setnext(&sj_meas, firstrun);
+  memset(&windagg, 0, sizeof(windagg));
   while (1) {
     if (nextwifistate != curwifistate) {
       curwifistate = nextwifistate;
@@ -81,70 +262,191 @@ void app_main(void)
         wifiap_on();
       }
     }
-    if ((time(NULL) - lastmeasts) >= 60) {
+    /* Start the particulate matter sensor if its warm-up is due - but
+     * if its breaker is open, don't power the fan and laser for a
+     * reading we would skip anyway. */
+    if (sen50_sched_nextwake() <= time(NULL)) {
+      if (brk_allow(&brk_sen50)) {
+        sen50_sched_tick(time(NULL));
+      } else {
+        sen50_sched_skip(time(NULL));
+      }
+    }
+    /* The fast channels */
+    if (sched_due(&channels[CH_WIND].job)) {
+      samplewind();
+    }
+    if (sched_due(&channels[CH_RAIN].job)) {
+      /* Parse the reply to the last request, and request the next one.
+       * The rain accounting itself happens in rg15.c. */
+      if (brk_allow(&brk_rg15)) {
+        rg15_poll();
+        rg15_requestread();
+      }
+    }
+    if (sched_due(&sj_meas)) {
       /* Time for an update of all sensors. */
       int naevs = (activeevs == 0) ? 1 : 0;
+      ts_compensate();
+      alignjobs();
       lastmeasts = time(NULL);
+      if (ts_isrealtime(lastmeasts)) {
+        /* Our clock is set, so we measure at the start of every minute
+         * (or half minute while boosted), and that is the timestamp of
+         * the sample. */
+        time_t p = sj_meas.period / 1000000LL;
+        lastmeasts = ((lastmeasts + (p / 2)) / p) * p;
+      }
+      ESP_LOGI(TAG, "measurement cycle started %lld ms late", sj_meas.lastjitter / 1000);
       evs[naevs].lastupd = lastmeasts;
-      sht4x_startmeas();
-      lps35hw_startmeas();
-      rg15_requestread();
-      /* Read UV index and switch to ambient light measurement */
-      float uvind = ltr390_readuv();
-      ltr390_startalmeas();
-      sleep_ms(1111); /* Slightly more than a second is enough for all the sensors above */
+      /* Which of the slow channels are due, and which sensors do we
+       * try to use in this cycle? */
+      int dotemphum = sched_due(&channels[CH_TEMPHUM].job);
+      int dolight = sched_due(&channels[CH_LIGHT].job);
+      int dopress = sched_due(&channels[CH_PRESS].job);
+      int dobattery = sched_due(&channels[CH_BATTERY].job);
+      int usesht4x = dotemphum && brk_allow(&brk_sht4x);
+      int uselps35hw = dopress && brk_allow(&brk_lps35hw);
+      int useltr390 = dolight && brk_allow(&brk_ltr390);
+      int userg15 = brk_allow(&brk_rg15);
+      if (usesht4x) { sht4x_startmeas(); }
+      /* The LTR390 measurement takes about a second, so we do that
+       * while waiting for the other sensors. */
+      int64_t waitstart = esp_timer_get_time();
+      float uvind = -1.0;
+      float amblight = -1.0;
+      if (useltr390) {
+        struct ltr390data light;
+        ltr390_measure(&light);
+        uvind = light.uvind;
+        amblight = light.lux;
+        if ((light.nuv > 0) || (light.nal > 0)) { brk_success(&brk_ltr390); } else { brk_failure(&brk_ltr390); }
+      }
+      /* Slightly more than a second is enough for all the sensors above */
+      int64_t waited = (esp_timer_get_time() - waitstart) / 1000;
+      if (usesht4x && (waited < 1111)) {
+        sleep_ms(1111 - waited);
+      }
       struct sht4xdata temphum;
-      sht4x_read(&temphum);
+      temphum.valid = 0;
+      if (usesht4x) {
+        sht4x_read(&temphum);
+        if (temphum.valid || temphum.blanked) { brk_success(&brk_sht4x); } else { brk_failure(&brk_sht4x); }
+        /* Runs the heater if needed, and if it will have cooled down
+         * again by the next reading. */
+        sht4x_heatersched(&temphum, channels[CH_TEMPHUM].job.period / 1000);
+      }
       if (temphum.valid) {
         ESP_LOGI(TAG, "|- temp %.2f   hum %.1f", temphum.temp, temphum.hum);
-      } else {
+      } else if (dotemphum) {
         ESP_LOGW(TAG, "|- no valid temp/hum");
       }
-      double press = lps35hw_readpressure();
-      ESP_LOGI(TAG, "|- press %.3lfhPa", press);
-      float wd = windsens_getwinddir();
-      ESP_LOGI(TAG, "|- wind direction: %.1f degrees", wd);
-      float ws = windsens_getwindsp_multisample(3);
-      ESP_LOGI(TAG, "|- wind speed: %.1f m/s (~%.2f km/h)", ws, (ws * 3.6));
-      float bv = batsens_read();
-      ESP_LOGI(TAG, "|- battery voltage: %.2fV", bv);
-      float rgc = rg15_readraincount();
+      double press = -1.0;
+      struct lps35hwdata pressdata;
+      pressdata.valid = 0;
+      if (uselps35hw) {
+        lps35hw_readfifo(&pressdata);
+        if (pressdata.valid) { brk_success(&brk_lps35hw); } else { brk_failure(&brk_lps35hw); }
+      }
+      if (pressdata.valid) {
+        press = pressdata.press;
+        ESP_LOGI(TAG, "|- press %.3lfhPa (variance %.5lf over %d samples)",
+                      press, pressdata.pressvar, pressdata.nsamples);
+      } else if (dopress) {
+        ESP_LOGW(TAG, "|- no valid pressure");
+      }
+      /* Wind is the average over all samples in this cycle. */
+      float wd = -1.0;
+      if (windagg.ndir > 0) {
+        wd = atan2(windagg.sumsin, windagg.sumcos) * 180.0 / M_PI;
+        if (wd < 0.0) { wd += 360.0; }
+      }
+      ESP_LOGI(TAG, "|- wind direction: %.1f degrees (%d samples)", wd, windagg.ndir);
+      float ws = -1.0;
+      float wgust = -1.0;
+      if (windagg.nspeed > 0) {
+        ws = windagg.sumspeed / windagg.nspeed;
+        wgust = windagg.maxspeed;
+      }
+      ESP_LOGI(TAG, "|- wind speed: %.1f m/s (~%.2f km/h), gusts %.1f m/s (%d samples)",
+                    ws, (ws * 3.6), wgust, windagg.nspeed);
+      memset(&windagg, 0, sizeof(windagg));
+      float bv = -1.0;
+      if (dobattery) {
+        /* The modem is not transmitting now, so this is our resting voltage. */
+        bv = batsens_sample(BS_IDLE);
+        ESP_LOGI(TAG, "|- battery voltage: %.2fV", bv);
+        /* Let the energy governor decide how much we can afford */
+        en_update(bv);
+      }
+      const struct enprofile * enprof = en_getprofile();
+      sen50_sched_enable(enprof->sen50on);
+      float rgc = -99999.9;
+      if (userg15) {
+        rgc = rg15_readraincount();
+        if (rgc > -0.01) { brk_success(&brk_rg15); } else { brk_failure(&brk_rg15); }
+      }
+      struct rg15state rain;
+      rg15_getstate(&rain);
       if (rgc > -0.01) {
-        ESP_LOGI(TAG, "|- rain count: %.2f mm", rgc);
+        pcounters_addrain(rgc);
+        ESP_LOGI(TAG, "|- rain count: %.2f mm, rate %.2f mm/h, %s", rgc, rain.rainrate,
+                      (rain.raining ? "raining" : "not raining"));
       } else {
         ESP_LOGI(TAG, "|- no valid rain counter data");
       }
       struct sen50data pm;
-      sen50_read(&pm);
+      pm.valid = 0;
+      int pmdue = sen50_sched_due(time(NULL));
+      if (pmdue) {
+        if (brk_allow(&brk_sen50)) {
+          sen50_read(&pm);
+          if (pm.valid) { brk_success(&brk_sen50); } else { brk_failure(&brk_sen50); }
+        }
+        sen50_sched_done(time(NULL), &pm);
+      }
       if (pm.valid) {
         ESP_LOGI(TAG, "|- PM1.0: %.1f  PM2.5: %.1f  PM4.0: %.1f  PM10.0: %.1f", pm.pm010, pm.pm025, pm.pm040, pm.pm100);
-      } else {
+      } else if (pmdue) {
         ESP_LOGW(TAG, "|- no valid particulate matter data");
+      } else {
+        ESP_LOGI(TAG, "|- no particulate matter reading due in this cycle");
+      }
+      if (dolight) {
+        ESP_LOGI(TAG, "|- UV: %.2f  AmbientLight: %.2f lux", uvind, amblight);
+      }
+      /* Does anything interesting happen that we should look at more
+       * closely? Not if we're short on energy though. */
+      struct bstinput bi;
+      bi.raining = rain.raining;
+      bi.rainstart = rain.rainstart;
+      bi.press = press;
+      bi.gust = wgust;
+      bi.temp = (temphum.valid ? temphum.temp : NAN);
+      struct enstate enst;
+      en_getstate(&enst);
+      bst_update(lastmeasts, &bi, (enst.profile != EN_PROF_SURVIVAL));
+      if (bst_active() != boosted) {
+        boosted = bst_active();
+        setrates(boosted);
       }
-      /* Read Ambient Light in Lux (may block for up to 500 ms!) and switch
-       * right back to UV mode */
-      float amblight = ltr390_readal();
-      ltr390_startuvmeas();
-      ESP_LOGI(TAG, "|- UV: %.2f  AmbientLight: %.2f lux", uvind, amblight);
-      /* Now send them out via network */
-      mn_wakeltemodule();
-      mn_waitforltemoduleready();
-      rgbled_setled(33, 33, 0); /* Yellow - we're sending */
-      mn_repeatcfgcmds();
-      mn_sendqueuedcommands();
-      mn_waitfornetworkconn(181);
-      mn_waitforipaddr(61);
-      /* Fetch LTE modem signal info for the webinterface */
-      mn_getmninfo(evs[naevs].modemstatus);
-      struct wpd tosubmit[15]; /* we'll submit at most 13 values because we have that many sensors */
-      int nts = 0; /* Number of values to submit */
+      /* The sag is from the last time the modem was online. */
+      struct batsensdata bsd;
+      batsens_getdata(&bsd);
+      /* Queue the values for the next upload, with the time of
+       * this measurement. */
+      upl_begin(lastmeasts);
       /* Lets define a little helper macro to limit the copy+paste orgies */
-      #define QUEUETOSUBMIT(s, v)  tosubmit[nts].sensorid = s; tosubmit[nts].value = v; nts++;
+      #define QUEUETOSUBMIT(s, v)  upl_add(s, v)
       if (temphum.valid) {
         QUEUETOSUBMIT("74", temphum.temp);
         QUEUETOSUBMIT("75", temphum.hum);
         evs[naevs].temp = temphum.temp;
         evs[naevs].hum = temphum.hum;
+      } else if (!dotemphum) {
+        /* Not measured in this cycle, keep showing the last values. */
+        evs[naevs].temp = evs[activeevs].temp;
+        evs[naevs].hum = evs[activeevs].hum;
       } else {
         evs[naevs].temp = NAN;
         evs[naevs].hum = NAN;
@@ -152,8 +454,14 @@ void app_main(void)
       if (press > 0) {
         QUEUETOSUBMIT("76", press);
         evs[naevs].press = press;
+        evs[naevs].pressvar = pressdata.pressvar;
+      } else if (!dopress) {
+        /* Not measured in this cycle, keep showing the last values. */
+        evs[naevs].press = evs[activeevs].press;
+        evs[naevs].pressvar = evs[activeevs].pressvar;
       } else {
         evs[naevs].press = NAN;
+        evs[naevs].pressvar = NAN;
       }
       if ((wd > -0.01) && (wd < 360.01)) { /* Valid wind direction measurement */
         QUEUETOSUBMIT("78", wd);
@@ -163,6 +471,7 @@ void app_main(void)
       }
       if (ws > -0.01) { /* Valid wind speed measurement */
         QUEUETOSUBMIT("79", ws);
+        QUEUETOSUBMIT(WPDID_WINDGUST, wgust);
         evs[naevs].windspeed = ws;
       } else {
         evs[naevs].windspeed = NAN;
@@ -170,14 +479,21 @@ void app_main(void)
       if (bv > -0.01) { /* Valid battery measurement */
         QUEUETOSUBMIT("80", bv);
         evs[naevs].batvolt = bv;
+        evs[naevs].batsag = bsd.sag;
+      } else if (!dobattery) {
+        evs[naevs].batvolt = evs[activeevs].batvolt;
+        evs[naevs].batsag = evs[activeevs].batsag;
       } else {
         evs[naevs].batvolt = NAN;
+        evs[naevs].batsag = NAN;
       }
       if (rgc > -0.01) { /* Valid rain gauge measurement */
         QUEUETOSUBMIT("81", rgc);
         evs[naevs].raingc = rgc;
+        evs[naevs].rainrate = rain.rainrate;
       } else {
         evs[naevs].raingc = NAN;
+        evs[naevs].rainrate = NAN;
       }
       if (pm.valid) { /* Valid particulate matter measurement */
         QUEUETOSUBMIT("82", pm.pm010);
@@ -188,6 +504,12 @@ void app_main(void)
         evs[naevs].pm025 = pm.pm025;
         evs[naevs].pm040 = pm.pm040;
         evs[naevs].pm100 = pm.pm100;
+      } else if (!pmdue) {
+        /* Not measured in this cycle, keep showing the last values. */
+        evs[naevs].pm010 = evs[activeevs].pm010;
+        evs[naevs].pm025 = evs[activeevs].pm025;
+        evs[naevs].pm040 = evs[activeevs].pm040;
+        evs[naevs].pm100 = evs[activeevs].pm100;
       } else {
         evs[naevs].pm010 = NAN;
         evs[naevs].pm025 = NAN;
@@ -197,51 +519,201 @@ void app_main(void)
       if (uvind > -0.01) { /* Valid UV-Index measurement */
         QUEUETOSUBMIT("86", uvind);
         evs[naevs].uvind = uvind;
+      } else if (!dolight) {
+        evs[naevs].uvind = evs[activeevs].uvind;
       } else {
         evs[naevs].uvind = NAN;
       }
       if (amblight > -0.01) { /* Valid Ambient Light measurement */
         QUEUETOSUBMIT("87", amblight);
         evs[naevs].amblight = amblight;
+      } else if (!dolight) {
+        evs[naevs].amblight = evs[activeevs].amblight;
       } else {
         evs[naevs].amblight = NAN;
       }
+      /* Health telemetry: these are counters since boot. */
+      QUEUETOSUBMIT(WPDID_I2CERRORS, i2c_geterrors());
+      QUEUETOSUBMIT(WPDID_I2CRECOVERIES, i2c_getrecoveries(I2C_NUM_0) + i2c_getrecoveries(I2C_NUM_1));
+      /* ...and these are persistent over resets. */
+      QUEUETOSUBMIT(WPDID_RAINTOTAL, (float)pcounters_get(PC_RAINUM) / 1000.0);
+      QUEUETOSUBMIT(WPDID_BOOTS, pcounters_get(PC_BOOTS));
+      QUEUETOSUBMIT(WPDID_SUBMITFAILS, pcounters_get(PC_SUBMITFAIL));
+      QUEUETOSUBMIT(WPDID_MODEMPOWERCYCLES, pcounters_get(PC_MODEMPOWERCYCLES));
+      if ((bsd.idle > -0.01) && (bsd.loaded > -0.01)) {
+        QUEUETOSUBMIT(WPDID_BATSAG, bsd.sag);
+      }
+      QUEUETOSUBMIT(WPDID_ENERGYPROFILE, enst.profile);
+      QUEUETOSUBMIT(WPDID_SCHEDJITTER, (float)sj_meas.lastjitter / 1000.0);
+      if (boosted) {
+        struct bststate bst;
+        bst_getstate(&bst);
+        QUEUETOSUBMIT(WPDID_BOOSTTRIGGERS, bst.triggers);
+      } else {
+        QUEUETOSUBMIT(WPDID_BOOSTTRIGGERS, 0);
+      }
+      if (newmninfo) {
+        /* Time from the start of the last attach attempt to the first
+         * IP address, in seconds. */
+        if (ttfip >= 0) {
+          QUEUETOSUBMIT(WPDID_TTFIP, (float)ttfip / 1000.0);
+        }
+        /* Signal at the last upload. The cell ID does not fit into a
+         * float, so that one is only on the webpage. */
+        if (mi.act >= 0) {
+          QUEUETOSUBMIT(WPDID_ACT, mi.act);
+        }
+        if (!isnan(mi.rsrp)) {
+          QUEUETOSUBMIT(WPDID_RSRP, mi.rsrp);
+        }
+        if (!isnan(mi.rsrq)) {
+          QUEUETOSUBMIT(WPDID_RSRQ, mi.rsrq);
+        }
+        if (!isnan(mi.rxlev)) {
+          QUEUETOSUBMIT(WPDID_RXLEV, mi.rxlev);
+        }
+        if (mi.plmn != 0) {
+          QUEUETOSUBMIT(WPDID_PLMN, mi.plmn);
+        }
+        newmninfo = 0;
+      }
       /* Clean up helper macro */
       #undef QUEUETOSUBMIT
-      /* mark the updated values as the current ones for the webserver */
-      activeevs = naevs;
-      if (nts > 0) { /* Is there at least one valid value to submit? */
-        ESP_LOGI(TAG, "have %d values to submit...", nts);
-        if (submit_to_wpd_multi(nts, tosubmit) == 0) {
-          lastsuccsubmit = time(NULL);
+      upl_commit();
+      /* We upload every uploadevery cycles as the energy profile
+       * dictates, or less often if a larger batch size is configured.
+       * While boosted, we upload every cycle - that includes the cycle
+       * in which the boost was triggered, so the event goes out right
+       * away, whatever is in the batch. upl_due() overrides all this
+       * as long as WPD_HONOURSTIMESTAMPS is not set. */
+      int batchsize = upl_getbatchsize();
+      if (enprof->uploadevery > batchsize) {
+        batchsize = enprof->uploadevery;
+      }
+      if (boosted) {
+        batchsize = 1;
+      }
+      if (upl_due(batchsize)) {
+        /* Now send them out via network */
+        mn_wakeltemodule();
+        mn_waitforltemoduleready();
+        rgbled_setled(33, 33, 0); /* Yellow - we're sending */
+        mn_repeatcfgcmds();
+        mn_sendqueuedcommands();
+        /* On the first attach after boot, and after a failed upload,
+         * the module may spend minutes on its automatic operator
+         * selection. Try the operator that worked best so far first,
+         * with a short timeout, and only then fall back to automatic
+         * selection. Leave it alone if the admin picked one. */
+        int64_t attachstart = esp_timer_get_time();
+        /* Only an attach from unregistered counts for the time to the
+         * first IP and the operator statistics - if we are still
+         * attached from the last upload, that is just a few ms. */
+        int wasregistered = mn_isregistered();
+        unsigned long prefplmn;
+        int prefact;
+        int attachres;
+        if ((!attachedonce || (mns_getlevel() != MNS_LVL_NONE))
+         && !ops_getmanual() && (ops_getbest(&prefplmn, &prefact) == 0)) {
+          ESP_LOGI(TAG, "trying preferred operator %lu (act %d) first", prefplmn, prefact);
+          attachres = mn_selectoperator(prefplmn, prefact, 60);
+          if (attachres == 0) {
+            attachres = mn_waitforattach(60);
+          }
+          if (attachres != 0) {
+            ESP_LOGW(TAG, "preferred operator failed, falling back to automatic selection");
+            ops_preffailed(prefplmn, prefact);
+            mn_selectoperator(0, -1, 180);
+            attachres = mn_waitforattach(180);
+          }
+        } else {
+          attachres = mn_waitforattach(240);
         }
+        int freshattach = ((attachres == 0) && !wasregistered);
+        if (attachres == 0) {
+          attachedonce = 1;
+        }
+        ttfip = (freshattach ? ((esp_timer_get_time() - attachstart) / 1000) : -1);
+        /* Fetch network and signal info, for the telemetry, the
+         * webinterface and the operator statistics. */
+        if ((mn_getmninfo(&mi) == 0) && freshattach) {
+          ops_attached(mi.plmn, mi.act, ttfip,
+                       ((mi.act == 0) ? mi.rxlev : mi.rsrp));
+        }
+        evs[naevs].mninfo = mi;
+        newmninfo = 1;
+        time_t nettime;
+        if (ts_syncdue() && (mn_getnetworktime(&nettime) == 0)) {
+          time_t step = ts_sync(nettime);
+          if (step != 0) {
+            /* Everything we remember as a timestamp is now off by step. */
+            upl_shifttimes(step);
+            sen50_sched_shifttimes(step);
+            en_shifttimes(step);
+            rg15_shifttimes(step);
+            bst_shifttimes(step);
+            mns_shifttimes(step);
+            batsens_shifttimes(step);
+            mn_shifttimes(step);
+            lastmeasts += step;
+            evs[naevs].lastupd += step;
+            evs[naevs].mninfo.ts += step;
+          }
+          alignjobs();
+        }
+        ESP_LOGI(TAG, "have %d samples to submit...", upl_count());
+        /* submit_to_wpd_batch() measures the battery under load while
+         * the modem transmits. */
+        time_t flushstart = time(NULL);
+        int flushres = upl_flush();
+        batsens_getdata(&bsd);
+        if ((bsd.loadedts >= flushstart) && (bsd.idle > -0.01)) {
+          ESP_LOGI(TAG, "battery under load: %.2fV, sag %.3fV", bsd.loaded, bsd.sag);
+          evs[naevs].batsag = bsd.sag;
+        }
+        if (flushres == 0) {
+          pcounters_inc(PC_SUBMITOK);
+          ops_submitresult(1);
+          mns_success();
+        } else {
+          pcounters_inc(PC_SUBMITFAIL);
+          ops_submitresult(0);
+          /* Try to get the modem working again, the samples stay
+           * queued for the next attempt. */
+          mns_failure();
+        }
+      } else {
+        ESP_LOGI(TAG, "not uploading in this cycle (profile %s, %d of %d samples queued)",
+                      enprof->name, upl_count(), batchsize);
+        evs[naevs].mninfo = evs[activeevs].mninfo;
       }
+      /* mark the updated values as the current ones for the webserver */
+      activeevs = naevs;
       rgbled_setled(0, 0, curwifistate * 33);
     }
-    if ((time(NULL) - lastsuccsubmit) > 900) {
-      /* We have not successfully submitted any values in 15 minutes.
-       * That probably means that our crappy LTE module has once again locked up.
-       * So lets try to tell it to reset, and then reset the ESP. */
-      ESP_LOGE(TAG, "No successful submit in %lld seconds - about to powercycle the LTE modem and reset.", (time(NULL) - lastsuccsubmit));
-      mn_powercycleltemodem();
-      ESP_LOGE(TAG, "modem powercycled, now resetting the ESP32...");
-      esp_restart();
+    pcounters_commit(0);
+    /* The SEN50 scheduler works in wall clock seconds. */
+    int64_t wakeat = sched_nextdeadline();
+    int64_t sen50wake = esp_timer_get_time()
+                      + (int64_t)(sen50_sched_nextwake() - time(NULL)) * 1000000LL;
+    if (sen50wake < wakeat) {
+      wakeat = sen50wake;
     }
-    long howmuchtosleep = (lastmeasts + 60) - time(NULL) - 1;
-    if (howmuchtosleep > 60) { howmuchtosleep = 60; }
-    if (howmuchtosleep > 0) {
+    int64_t howmuchtosleep = wakeat - esp_timer_get_time(); /* in us */
+    if (howmuchtosleep > 60000000LL) { howmuchtosleep = 60000000LL; }
+    if (howmuchtosleep >= 10000) { /* Not worth it for less than 10 ms */
       if (curwifistate > 0) {
         /* We cannot sleep if WiFi is on (else that would be unusable) */
-        ESP_LOGI(TAG, "will now idle for %ld seconds", howmuchtosleep);
-        vTaskDelay(pdMS_TO_TICKS(howmuchtosleep * 1000));
+        ESP_LOGI(TAG, "will now idle for %lld ms", howmuchtosleep / 1000);
+        vTaskDelay(pdMS_TO_TICKS(howmuchtosleep / 1000));
       } else {
         if (button_getstate() == 0) { /* We cannot sleep, we'd be woken up instantly from the GPIO IRQ */
           ESP_LOGI(TAG, "button still pressed...");
           vTaskDelay(pdMS_TO_TICKS(1000));
         } else {
-          ESP_LOGI(TAG, "will now enter light sleep mode for %ld seconds", howmuchtosleep);
+          ESP_LOGI(TAG, "will now enter light sleep mode for %lld ms", howmuchtosleep / 1000);
           /* This is given in microseconds */
-          esp_sleep_enable_timer_wakeup(howmuchtosleep * (int64_t)1000000);
+          esp_sleep_enable_timer_wakeup(howmuchtosleep);
           esp_light_sleep_start();
           button_rtcdetach(); /* needs to be called after sleep to detach the GPIO from the RTC again! */
         }
@@ -2,7 +2,10 @@
 #include <driver/gpio.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <esp_timer.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "esp_log.h"
@@ -42,6 +45,49 @@ static int serialinlblav = 0;
 static char queuedcommands[100];
 static portMUX_TYPE cmdqueuespinlock = portMUX_INITIALIZER_UNLOCKED;
 
+/* The greeting text we configure with AT+CSGT. The module sends this
+ * whenever it has (re)booted. */
+#define LTEMGREETING "LTEmodule now ready"
+/* The volatile settings that the module loses when it reboots, e.g.
+ * when it wakes from PSM deep sleep. cfgvalid is a bitmask of the
+ * ones we believe are currently active in the module. */
+#define MNCFG_ECHOOFF 0x01  /* ATE0 */
+#define MNCFG_CMEE    0x02  /* AT+CMEE=2 */
+#define MNCFG_HEXMODE 0x04  /* AT+UDCONF=1,1 */
+#define MNCFG_PSDPROF 0x08  /* AT+UPSD=0,100,1 */
+#define MNCFG_CEREG   0x10  /* AT+CEREG=2 */
+#define MNCFG_CGREG   0x20  /* AT+CGREG=2 */
+#define MNCFG_CGEREP  0x40  /* AT+CGEREP=1 */
+#define MNCFG_ALL     0x7f
+static int cfgvalid = 0;
+
+/* Network registration and PDP context state, tracked through the URCs
+ * the module sends. */
+static struct mnnetstate netstate = {
+  .epsreg = 0, .gprsreg = 0, .act = -1, .tac = 0, .ci = 0,
+  .pdpactive = 0, .ipaddr = "", .attachms = -1
+};
+static void checkurc(char * l);
+
+/* History of what mn_getmninfo() found, a ring buffer. */
+static struct mninfo infohist[MN_INFOHISTLEN];
+static int infohistpos = 0;
+static int infohistcnt = 0;
+
+/* The module (re)booted, so it has forgotten all volatile settings,
+ * and it is no longer attached to the network. */
+static void forgetstate(void)
+{
+  cfgvalid = 0;
+  netstate.epsreg = 0;
+  netstate.gprsreg = 0;
+  netstate.pdpactive = 0;
+  netstate.ipaddr[0] = 0;
+}
+
+/* Health signals for the modem supervisor */
+static struct mnhealth health = { .consecutivetimeouts = 0, .timeouts = 0, .greetings = 0 };
+
 /* removes all occurences of char b from string a. */
 static void delchar(char * a, char b) {
   char * s; char * d;
@@ -57,25 +103,6 @@ static void delchar(char * a, char b) {
   *d = '\0';
 }
 
-/* Helper function to clear anything still unread on the serial input before
- * sending a new command. */
-static void clearserialinputbuf(void)
-{
-  /* Clear our buffered input. */
-  serialinlbpos = 0;
-  serialinlblav = 0;
-  /* Clear UART buffer */
-  size_t sba;
-  if (uart_get_buffered_data_len(LTEMUART, &sba) != ESP_OK) {
-    return;
-  }
-  while (sba > 0) {
-    char b[2];
-    (void) uart_read_bytes(LTEMUART, b, 1, 1);
-    sba--;
-  }
-}
-
 static void readavailableserialuntillinefeed(void)
 {
   if (serialinlblav > 0) { /* Don't read anything if the previous line has */
@@ -131,6 +158,33 @@ void getserialline(char * buf, int buflen) {
   }
 }
 
+/* Helper function to clear anything still unread on the serial input before
+ * sending a new command. URCs in there are still processed. */
+static void clearserialinputbuf(void)
+{
+  /* Anything complete in there that is not a reply to anything may
+   * still be an URC we need to look at. */
+  while (seriallineavailable() > 0) {
+    char l[sizeof(serialinlinebuf)];
+    getserialline(l, sizeof(l));
+    delchar(l, '\n');
+    checkurc(l);
+  }
+  /* Clear our buffered input. */
+  serialinlbpos = 0;
+  serialinlblav = 0;
+  /* Clear UART buffer */
+  size_t sba;
+  if (uart_get_buffered_data_len(LTEMUART, &sba) != ESP_OK) {
+    return;
+  }
+  while (sba > 0) {
+    char b[2];
+    (void) uart_read_bytes(LTEMUART, b, 1, 1);
+    sba--;
+  }
+}
+
 /* Read serial line with timeout.
  * This stops reading on a \n, or after a timeout. The \n is NOT in the
  * returned string.
@@ -144,6 +198,7 @@ int readseriallinewto(char * buf, int buflen, int timeout)
     if (seriallineavailable() > 0) {
       getserialline(buf, buflen);
       delchar(buf, '\n');
+      checkurc(buf);
       return strlen(buf);
     }
     sleep_ms(50);
@@ -167,6 +222,14 @@ int waitforatreplywto(char * buf, int buflen, int timeout)
       /* Is this either "OK" or "ERROR" or "+CME ERROR.*"? Then this
        * is the end of the reply to the last AT command. */
       //ESP_LOGI(TAG, "cptr: %s len %d", cptr, strlen(cptr));
+      if (strcmp(cptr, LTEMGREETING) == 0) {
+        /* The module rebooted behind our back. */
+        ESP_LOGW(TAG, "LTE module greeted us unexpectedly, it must have rebooted.");
+        forgetstate();
+        health.greetings++;
+      }
+      /* The module is talking to us, whatever it says. */
+      health.consecutivetimeouts = 0;
       if ((strcmp(cptr, "OK") == 0)
        || (strcmp(cptr, "ERROR") == 0)
        || (strncmp(cptr, "+CME ERROR", 10) == 0)) {
@@ -178,6 +241,8 @@ int waitforatreplywto(char * buf, int buflen, int timeout)
     }
   } while (lastreadrc >= 0);
   buf[res] = 0;
+  health.timeouts++;
+  health.consecutivetimeouts++;
   return -1;
 }
 
@@ -224,6 +289,24 @@ int sendatcmd(char * cmd, int timeout)
   return res;
 }
 
+/* Like sendatcmd, but for when we need to know whether the module
+ * accepted the command: Returns 0 only if the reply ended in "OK". */
+static int sendatcmdok(char * cmd, int timeout)
+{
+  char rcvbuf[350];
+  clearserialinputbuf();
+  sprintf(rcvbuf, "%s\r\n", cmd);
+  sendserialline(rcvbuf);
+  int res = waitforatreplywto(&rcvbuf[0], sizeof(rcvbuf), timeout);
+  ESP_LOGI(TAG, "sendatcmdok: Sent '%s', Received serial: error=%s, Text '%s'", cmd, ((res < 0) ? "Yes" : "No"), rcvbuf);
+  if (res < 0) {
+    return 1;
+  }
+  char * lastline = strrchr(rcvbuf, '\n');
+  lastline = (lastline == NULL) ? rcvbuf : (lastline + 1);
+  return (strcmp(lastline, "OK") != 0);
+}
+
 void mn_wakeltemodule(void)
 {
   /* Note: The PWR pin is inverted on the click board - so we need to pull
@@ -257,8 +340,11 @@ int mn_waitforltemoduleready(void)
      * to power up after waking it via power pin aka mn_wakeltemodule(). */
     res = readseriallinewto(buf, sizeof(buf), 6);
     if (res >= 19) {
-      if (strncmp(buf, "LTEmodule now ready", 19) == 0) {
+      if (strncmp(buf, LTEMGREETING, 19) == 0) {
         ESP_LOGI(TAG, "LTEmodule reported ready.");
+        /* It just booted, so it has forgotten all volatile settings. */
+        forgetstate();
+        health.consecutivetimeouts = 0;
         return 0;
       }
     }
@@ -273,109 +359,252 @@ int mn_waitforltemoduleready(void)
   return 1;
 }
 
-/* Return the network state, as returned in AT+COPS.
- * So 3 = GPRS, 7 = LTE-M?, 9 = NB-IOT?
- * -2 if AT+COPS could not be read. -1 if not connected. */
-int readnetworkstate(void)
+/* Registration states as reported by +CEREG / +CGREG */
+#define REG_NOTREG    0
+#define REG_HOME      1
+#define REG_SEARCHING 2
+#define REG_DENIED    3
+#define REG_UNKNOWN   4
+#define REG_ROAMING   5
+#define ISREGISTERED(s) (((s) == REG_HOME) || ((s) == REG_ROAMING))
+
+/* Parses a +CEREG or +CGREG line (after the prefix). These come in two
+ * flavours: As a reply to our query, "<n>,<stat>[,<tac>,<ci>,<act>]",
+ * and as an URC, "<stat>[,<tac>,<ci>,<act>]" - the tac being quoted
+ * tells the two apart. */
+static void parsereg(char * l, int * stat, int isgprs)
+{
+  char tmp[100];
+  char * fields[6];
+  int nf = 0;
+  char * sp;
+  strncpy(tmp, l, sizeof(tmp) - 1);
+  tmp[sizeof(tmp) - 1] = 0;
+  char * f = strtok_r(tmp, ",", &sp);
+  while ((f != NULL) && (nf < 6)) {
+    while (*f == ' ') { f++; }
+    fields[nf++] = f;
+    f = strtok_r(NULL, ",", &sp);
+  }
+  if (nf == 0) {
+    return;
+  }
+  int first = 0;
+  if ((nf >= 2) && (fields[1][0] != '"')) {
+    first = 1; /* reply to a query, skip <n> */
+  }
+  *stat = strtol(fields[first], NULL, 10);
+  if ((nf >= (first + 3)) && ISREGISTERED(*stat)) {
+    netstate.tac = strtoul(fields[first + 1] + 1, NULL, 16);
+    netstate.ci = strtoul(fields[first + 2] + 1, NULL, 16);
+    if (nf >= (first + 4)) {
+      netstate.act = strtol(fields[first + 3], NULL, 10);
+    } else if (isgprs) {
+      netstate.act = 0;
+    }
+  }
+}
+
+/* Looks at a line we received, and updates the network state if it
+ * is one of the registration or PDP context URCs. */
+static void checkurc(char * l)
+{
+  if (strncmp(l, "+CEREG: ", 8) == 0) {
+    int old = netstate.epsreg;
+    parsereg(l + 8, &netstate.epsreg, 0);
+    if (netstate.epsreg != old) {
+      ESP_LOGI(TAG, "EPS registration state: %d", netstate.epsreg);
+    }
+  } else if (strncmp(l, "+CGREG: ", 8) == 0) {
+    int old = netstate.gprsreg;
+    parsereg(l + 8, &netstate.gprsreg, 1);
+    if (netstate.gprsreg != old) {
+      ESP_LOGI(TAG, "GPRS registration state: %d", netstate.gprsreg);
+    }
+  } else if (strncmp(l, "+CGEV: ", 7) == 0) {
+    /* e.g. "+CGEV: ME PDN ACT 1", "+CGEV: NW PDN DEACT 1", "+CGEV: NW DETACH" */
+    if ((strstr(l, "DEACT") != NULL) || (strstr(l, "DETACH") != NULL)) {
+      netstate.pdpactive = 0;
+      netstate.ipaddr[0] = 0;
+    } else if (strstr(l, "ACT") != NULL) {
+      netstate.pdpactive = 1;
+    }
+    ESP_LOGI(TAG, "PDP context event: %s", l);
+  }
+  if (!ISREGISTERED(netstate.epsreg) && !ISREGISTERED(netstate.gprsreg)) {
+    netstate.ipaddr[0] = 0;
+  }
+}
+
+/* Asks for the IP address of our PDP context. Returns 0 and fills
+ * netstate.ipaddr if we have one. */
+static int queryipaddr(void)
 {
-  char rcvbuf[200];
+  char buf[200];
   clearserialinputbuf();
-  sprintf(rcvbuf, "%s\r\n", "AT+COPS?");
-  sendserialline(rcvbuf);
-  int res = waitforatreplywto(&rcvbuf[0], sizeof(rcvbuf), 2);
-  if (res <= 0) { return -2; }
-  char * sp1; char * sp2;
-  char * st1 = strtok_r(rcvbuf, "\n", &sp1);
-  do {
-    if (strncmp(st1, "+COPS:", 6) == 0) {
-      char * st2 = strtok_r(st1, ",", &sp2);
-      int ctr = 1;
-      do {
-        if (ctr == 4) {
-          return strtol(st2, NULL, 10);
-        }
-        st2 = strtok_r(NULL, ",", &sp2);
-        ctr++;
-      } while (st2 != NULL);
+  sendserialline("AT+CGPADDR=1\r\n");
+  int res = waitforatreplywto(buf, sizeof(buf), 4);
+  if (res <= 0) {
+    return 1;
+  }
+  char * sp1;
+  char * st1 = strtok_r(buf, "\n", &sp1);
+  while (st1 != NULL) {
+    ESP_LOGI(TAG, "CGPADDRrb: '%s'", st1);
+    if (strncmp(st1, "+CGPADDR: 1,", 12) == 0) {
+      /* This is the line containing the answer */
+      /* Documentation says the IP is enclosed in quotes, reality says it
+       * is not - so we better handle both cases. */
+      char * ip = &st1[12];
+      if (*ip == '"') { ip++; }
+      char * ep = strchr(ip, '"');
+      if (ep != NULL) { *ep = 0; }
+      if ((strlen(ip) == 0) || (strcmp(ip, "0.0.0.0") == 0)) { /* Not really an IP. */
+        return 1;
+      }
+      strncpy(netstate.ipaddr, ip, sizeof(netstate.ipaddr) - 1);
+      netstate.ipaddr[sizeof(netstate.ipaddr) - 1] = 0;
+      return 0;
     }
     st1 = strtok_r(NULL, "\n", &sp1);
-  } while (st1 != NULL);
-  /* There was no access technology in +COPS output, so we're not connected. */
-  return -1;
+  }
+  return 1;
 }
 
-/* Tries to wait until the mobile network has a data connection, with a timeout.
- * This will also automatically handle the case where the module did a
- * fallback to 2G, in which case we have to send an extra command to
- * enable the GPRS data connection. */
-void mn_waitfornetworkconn(int timeout)
+int mn_waitforattach(int timeout)
 {
-  int nws;
-  time_t stts = time(NULL);
+  char buf[200];
+  int64_t stts = esp_timer_get_time();
+  int64_t tous = (int64_t)timeout * 1000000LL;
+  int64_t lastipquery = 0;
+  int cgactsent = 0;
+  /* The URCs only tell us about changes, so we need to know where
+   * we start from. */
+  clearserialinputbuf();
+  sendserialline("AT+CEREG?;+CGREG?\r\n");
+  waitforatreplywto(buf, sizeof(buf), 4);
   do {
-    nws = readnetworkstate();
-    ESP_LOGI(TAG, "network state: %d\n", nws);
-    if (nws <= 0) {
-      sleep_ms(500);
-    } else {
-      /* we have a valid network connection. */
-      if (nws == 3) { /* GPRS */
+    int eps = ISREGISTERED(netstate.epsreg);
+    int gprs = ISREGISTERED(netstate.gprsreg);
+    if (eps || gprs) {
+      if (!eps && !cgactsent) {
         /* GPRS requires manual context activation, LTE does it automatically */
         ESP_LOGI(TAG, "GPRS connection detected, sending 'AT+CGACT=1,1'...");
-        sendatcmd("AT+CGACT=1,1", timeout);
+        int remaining = (tous - (esp_timer_get_time() - stts)) / 1000000LL;
+        sendatcmd("AT+CGACT=1,1", ((remaining > 4) ? remaining : 4));
+        cgactsent = 1;
+      }
+      /* Ask for the IP right away when the context got activated, and
+       * otherwise every few seconds, in case the module does not tell us. */
+      int64_t now = esp_timer_get_time();
+      if ((lastipquery == 0) || netstate.pdpactive || ((now - lastipquery) >= 5000000LL)) {
+        lastipquery = now;
+        if (queryipaddr() == 0) {
+          netstate.pdpactive = 1;
+          netstate.attachms = (esp_timer_get_time() - stts) / 1000;
+          ESP_LOGI(TAG, "Attached (%s, act %d) with IP address %s after %ld ms",
+                        (eps ? "EPS" : "GPRS"), netstate.act, netstate.ipaddr, netstate.attachms);
+          return 0;
+        }
+        /* We did not get one, so the context is not (yet) active. */
+        netstate.pdpactive = 0;
       }
-      return;
     }
-  } while ((time(NULL) - stts) < timeout);
+    /* Wait for something to happen. This is where the URCs arrive. */
+    readseriallinewto(buf, sizeof(buf), 1);
+  } while ((esp_timer_get_time() - stts) < tous);
+  ESP_LOGW(TAG, "Timeout waiting for network attach (EPS %d, GPRS %d)",
+                netstate.epsreg, netstate.gprsreg);
+  netstate.attachms = -1;
+  return 1;
 }
 
-/* Tries to wait until the mobile network connection has gotten an IP
- * address, with a timeout. */
-void mn_waitforipaddr(int timeout)
+void mn_getnetstate(struct mnnetstate * ns)
 {
-  char buf[200]; char ipbuf[34];
-  char * obuf = &ipbuf[0];
-  int obufsize = sizeof(ipbuf);
-  time_t stts = time(NULL);
+  *ns = netstate;
+}
+
+int mn_isregistered(void)
+{
+  return (ISREGISTERED(netstate.epsreg) || ISREGISTERED(netstate.gprsreg));
+}
+
+int mn_issearching(void)
+{
+  return ((netstate.epsreg == REG_SEARCHING) || (netstate.gprsreg == REG_SEARCHING));
+}
+
+int mn_selectoperator(unsigned long plmn, int act, int timeout)
+{
+  char cmd[40];
+  if (plmn == 0) {
+    strcpy(cmd, "AT+COPS=0");
+  } else if (act < 0) {
+    /* Mode 4: manual, but the module falls back to automatic selection
+     * by itself if that operator is ever gone. */
+    sprintf(cmd, "AT+COPS=4,2,\"%lu\"", plmn);
+  } else {
+    sprintf(cmd, "AT+COPS=4,2,\"%lu\",%d", plmn, act);
+  }
+  /* This only replies once the module is registered, or gave up. */
+  char rcvbuf[100];
   clearserialinputbuf();
-  do {
-    sprintf(buf, "AT+CGPADDR=1\r\n");
-    sendserialline(buf);
-    int res = waitforatreplywto(buf, sizeof(buf), 4);
-    if (res > 0) {
-      char * sp1;
-      char * st1 = strtok_r(buf, "\n", &sp1);
-      do {
-        ESP_LOGI(TAG, "CGPADDRrb: '%s'", st1);
-        if (strncmp(st1, "+CGPADDR: 1,", 12) == 0) {
-          /* This is the line containing the answer */
-          /* Documentation says the IP is enclosed in quotes, reality says it
-           * is not - so we better handle both cases. */
-          int bufpos = 12;
-          if (st1[bufpos] == '"') { bufpos++; }
-          while ((st1[bufpos] != 0) && (obufsize > 1)) {
-            if (st1[bufpos] == '"') { /* The " marks the end of the IP */
-              break;
-            }
-            /* Copy one char and advance to next */
-            *obuf = st1[bufpos];
-            obuf++;
-            obufsize--;
-            bufpos++;
-          }
-          *obuf = 0;
-          if (strcmp(ipbuf, "0.0.0.0") == 0) { /* Not really an IP. */
-            /* Reset parse buffer and try again. */
-            obuf = &ipbuf[0]; obufsize = sizeof(ipbuf);
-            break;
-          }
-          ESP_LOGI(TAG, "mobile network got an IP address: %s", ipbuf);
-          return;
-        }
-        st1 = strtok_r(NULL, "\n", &sp1);
-      } while (st1 != NULL);
-    }
-  } while ((time(NULL) - stts) < timeout);
+  sprintf(rcvbuf, "%s\r\n", cmd);
+  sendserialline(rcvbuf);
+  int res = waitforatreplywto(rcvbuf, sizeof(rcvbuf), timeout);
+  ESP_LOGI(TAG, "mn_selectoperator: '%s' -> %s", cmd, ((res < 0) ? "timeout" : rcvbuf));
+  if ((res < 0) || (strstr(rcvbuf, "ERROR") != NULL)) {
+    return 1;
+  }
+  return 0;
+}
+
+int mn_getoperator(unsigned long * plmn, int * act)
+{
+  char rcvbuf[150];
+  clearserialinputbuf();
+  /* Switch to numeric format first, then ask. */
+  sendserialline("AT+COPS=3,2;+COPS?\r\n");
+  int res = waitforatreplywto(rcvbuf, sizeof(rcvbuf), 2);
+  if (res <= 0) {
+    return 1;
+  }
+  /* +COPS: <mode>,<format>,"<oper>",<act> */
+  char * cops = strstr(rcvbuf, "+COPS: ");
+  if (cops == NULL) {
+    return 1;
+  }
+  int mode, format;
+  if (sscanf(cops + 7, "%d,%d,\"%lu\",%d", &mode, &format, plmn, act) < 4) {
+    return 1;
+  }
+  return 0;
+}
+
+int mn_getsignal(struct mnsignal * s)
+{
+  char rcvbuf[150];
+  s->rxlev = NAN;
+  s->rsrq = NAN;
+  s->rsrp = NAN;
+  clearserialinputbuf();
+  sendserialline("AT+CESQ\r\n");
+  int res = waitforatreplywto(rcvbuf, sizeof(rcvbuf), 2);
+  if (res <= 0) {
+    return 1;
+  }
+  /* +CESQ: <rxlev>,<ber>,<rscp>,<ecn0>,<rsrq>,<rsrp> - every value
+   * has a different encoding, and 99 or 255 for "unknown". */
+  char * cesq = strstr(rcvbuf, "+CESQ: ");
+  int rxlev, ber, rscp, ecno, rsrq, rsrp;
+  if ((cesq == NULL)
+   || (sscanf(cesq + 7, "%d,%d,%d,%d,%d,%d", &rxlev, &ber, &rscp, &ecno, &rsrq, &rsrp) < 6)) {
+    return 1;
+  }
+  if (rxlev <= 63) { s->rxlev = rxlev - 111; }       /* GSM, dBm */
+  if (rsrq <= 34) { s->rsrq = (rsrq * 0.5) - 20.0; } /* LTE, dB */
+  if (rsrp <= 97) { s->rsrp = rsrp - 141; }          /* LTE, dBm */
+  return 0;
 }
 
 /* Known problems:
@@ -608,32 +837,116 @@ int mn_readsock(int socket, char * buf, int bufsize, int timeout)
   return res;
 }
 
-void mn_getmninfo(char * obuf)
+int mn_getmninfo(struct mninfo * mi)
 {
-  char rdstr[500]; int rc;
-  strcpy(obuf, "");
-  sprintf(rdstr, "AT+COPS?\r\n");
-  strcat(obuf, "# AT+COPS?\n");
-  sendserialline(rdstr);
-  rc = waitforatreplywto(rdstr, sizeof(rdstr), 2);
-  if (rc > 0) {
-    strcat(obuf, rdstr);
-    ESP_LOGI(TAG, "mn_getmninfo: %s", rdstr);
-  } else {
-    strcat(obuf, "(no reply received)");
-    ESP_LOGI(TAG, "mn_getmninfo: AT+COPS? failed.");
-  }
-  sprintf(rdstr, "AT+CESQ\r\n");
-  strcat(obuf, "# AT+CESQ\n");
-  sendserialline(rdstr);
-  rc = waitforatreplywto(rdstr, sizeof(rdstr), 2);
-  if (rc > 0) {
-    strcat(obuf, rdstr);
-    ESP_LOGI(TAG, "mn_getmninfo: %s", rdstr);
+  struct mnsignal sig;
+  int res;
+  memset(mi, 0, sizeof(struct mninfo));
+  mi->ts = time(NULL);
+  res = mn_getoperator(&mi->plmn, &mi->act);
+  if (res != 0) {
+    mi->plmn = 0;
+    mi->act = netstate.act;
+  }
+  mi->tac = netstate.tac;
+  mi->ci = netstate.ci;
+  mi->attachms = netstate.attachms;
+  if (mn_getsignal(&sig) == 0) {
+    mi->rsrp = sig.rsrp;
+    mi->rsrq = sig.rsrq;
+    mi->rxlev = sig.rxlev;
   } else {
-    strcat(obuf, "(no reply received)");
-    ESP_LOGI(TAG, "mn_getmninfo: AT+CESQ failed.");
+    mi->rsrp = mi->rsrq = mi->rxlev = NAN;
+  }
+  ESP_LOGI(TAG, "mn_getmninfo: operator %lu act %d, TAC %lx CI %lx, RSRP %.0f RSRQ %.1f RxLev %.0f",
+                mi->plmn, mi->act, mi->tac, mi->ci, mi->rsrp, mi->rsrq, mi->rxlev);
+  infohist[infohistpos] = *mi;
+  infohistpos = (infohistpos + 1) % MN_INFOHISTLEN;
+  if (infohistcnt < MN_INFOHISTLEN) {
+    infohistcnt++;
+  }
+  return res;
+}
+
+const struct mninfo * mn_getmninfohist(int i)
+{
+  if ((i < 0) || (i >= infohistcnt)) {
+    return NULL;
+  }
+  return &infohist[(infohistpos + MN_INFOHISTLEN - 1 - i) % MN_INFOHISTLEN];
+}
+
+void mn_shifttimes(time_t delta)
+{
+  for (int i = 0; i < infohistcnt; i++) {
+    infohist[i].ts += delta;
+  }
+}
+
+/* Days since 1970-01-01 for a date in the proleptic gregorian calendar.
+ * We need this because newlib has no timegm(), and mktime() would
+ * apply the local timezone. */
+static long daysfromcivil(int y, int m, int d)
+{
+  y -= (m <= 2);
+  long era = ((y >= 0) ? y : (y - 399)) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (m + ((m > 2) ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+int mn_getnetworktime(time_t * t)
+{
+  char rdstr[200];
+  clearserialinputbuf();
+  sendserialline("AT+CCLK?\r\n");
+  int rc = waitforatreplywto(rdstr, sizeof(rdstr), 2);
+  if (rc <= 0) {
+    ESP_LOGI(TAG, "mn_getnetworktime: AT+CCLK? failed.");
+    return 1;
+  }
+  char * cclk = strstr(rdstr, "+CCLK: \"");
+  if (cclk == NULL) {
+    ESP_LOGI(TAG, "mn_getnetworktime: no +CCLK in reply: %s", rdstr);
+    return 1;
+  }
+  /* Format: +CCLK: "yy/MM/dd,hh:mm:ss+zz", zz is the offset of the
+   * local time from UTC in quarter hours. */
+  int yy, mo, dd, hh, mi, ss, tz = 0;
+  char tzsign = '+';
+  if (sscanf(cclk + 8, "%d/%d/%d,%d:%d:%d%c%d", &yy, &mo, &dd, &hh, &mi, &ss, &tzsign, &tz) < 6) {
+    ESP_LOGI(TAG, "mn_getnetworktime: could not parse: %s", cclk);
+    return 1;
+  }
+  if (yy < 23) {
+    /* The module did not get the time from the network (yet), that is
+     * just its default after power on. */
+    ESP_LOGI(TAG, "mn_getnetworktime: module clock is not set.");
+    return 1;
   }
+  if (tzsign == '-') { tz = -tz; }
+  *t = (time_t)daysfromcivil(2000 + yy, mo, dd) * 86400
+     + hh * 3600 + mi * 60 + ss - tz * 900;
+  return 0;
+}
+
+void mn_pwrpincycle(void)
+{
+  /* Holding the PWR pin for more than 1.5 seconds switches the module
+   * off (remember the pin is inverted on the click board). It needs a
+   * few seconds to shut down, then we switch it on again. */
+  gpio_set_level(LTEMPOWERPIN, 1);
+  sleep_ms(2000);
+  gpio_set_level(LTEMPOWERPIN, 0);
+  forgetstate();
+  sleep_ms(5000);
+  mn_wakeltemodule();
+}
+
+void mn_gethealth(struct mnhealth * h)
+{
+  *h = health;
 }
 
 void mn_powercycleltemodem(void)
@@ -648,6 +961,7 @@ void mn_powercycleltemodem(void)
   };
   ESP_ERROR_CHECK(gpio_config(&ltemrelaypingpioconf));
   ESP_ERROR_CHECK(gpio_set_level(LTEMRELAYPIN, 0));
+  forgetstate();
   /* Keep this for 5 seconds */
   sleep_ms(5000);
   ESP_ERROR_CHECK(gpio_set_level(LTEMRELAYPIN, 1));
@@ -696,6 +1010,68 @@ void mn_init(void)
   ESP_ERROR_CHECK(gpio_config(&ltemrelaypingpioconf));
 }
 
+/* Sends the volatile settings that are not (known to be) active in
+ * the module, and marks the ones that succeeded as active. */
+static void applycfg(void)
+{
+  if ((cfgvalid & MNCFG_ECHOOFF) == 0) {
+    // Do not echo back commands.
+    if (sendatcmdok("ATE0", 4) == 0) { cfgvalid |= MNCFG_ECHOOFF; }
+  }
+  if ((cfgvalid & MNCFG_CMEE) == 0) {
+    // Tell the module to send "verbose" error messages, even though
+    // they really aren't what anybody in his right mind would call
+    // verbose...
+    if (sendatcmdok("AT+CMEE=2", 4) == 0) { cfgvalid |= MNCFG_CMEE; }
+  }
+  if ((cfgvalid & MNCFG_HEXMODE) == 0) {
+    // Set in- and output of socket functions to hex-encoded, so we don't need
+    // to deal with escaping special characters.
+    if (sendatcmdok("AT+UDCONF=1,1", 4) == 0) { cfgvalid |= MNCFG_HEXMODE; }
+  }
+  if ((cfgvalid & MNCFG_PSDPROF) == 0) {
+    // select active profile
+    if (sendatcmdok("AT+UPSD=0,100,1", 61) == 0) { cfgvalid |= MNCFG_PSDPROF; }
+  }
+  // Have the module tell us about changes to the network registration
+  // (with cell info), and about PDP context activation, so that we
+  // don't have to keep asking.
+  if ((cfgvalid & MNCFG_CEREG) == 0) {
+    if (sendatcmdok("AT+CEREG=2", 4) == 0) { cfgvalid |= MNCFG_CEREG; }
+  }
+  if ((cfgvalid & MNCFG_CGREG) == 0) {
+    if (sendatcmdok("AT+CGREG=2", 4) == 0) { cfgvalid |= MNCFG_CGREG; }
+  }
+  if ((cfgvalid & MNCFG_CGEREP) == 0) {
+    if (sendatcmdok("AT+CGEREP=1", 4) == 0) { cfgvalid |= MNCFG_CGEREP; }
+  }
+}
+
+/* Asks the module for the current value of all volatile settings in one
+ * go, and clears the bits in cfgvalid for everything that was lost. */
+static void probecfg(void)
+{
+  char rcvbuf[350];
+  clearserialinputbuf();
+  sendserialline("AT+CMEE?;+UDCONF=1;+UPSD=0,100;+CEREG?;+CGREG?;+CGEREP?\r\n");
+  int res = waitforatreplywto(&rcvbuf[0], sizeof(rcvbuf), 4);
+  if ((res < 0) || (strstr(rcvbuf, "ERROR") != NULL)) {
+    /* Either no reply, or the module did not like one of the
+     * queries. Play it safe and resend everything. */
+    ESP_LOGI(TAG, "probecfg: no valid reply, resending all settings.");
+    cfgvalid = 0;
+    return;
+  }
+  /* If echo is on again, we get our own command back. */
+  if (strstr(rcvbuf, "AT+CMEE?") != NULL) { cfgvalid &= ~MNCFG_ECHOOFF; }
+  if (strstr(rcvbuf, "+CMEE: 2") == NULL) { cfgvalid &= ~MNCFG_CMEE; }
+  if (strstr(rcvbuf, "+UDCONF: 1,1") == NULL) { cfgvalid &= ~MNCFG_HEXMODE; }
+  if (strstr(rcvbuf, "+UPSD: 0,100,1") == NULL) { cfgvalid &= ~MNCFG_PSDPROF; }
+  if (strstr(rcvbuf, "+CEREG: 2,") == NULL) { cfgvalid &= ~MNCFG_CEREG; }
+  if (strstr(rcvbuf, "+CGREG: 2,") == NULL) { cfgvalid &= ~MNCFG_CGREG; }
+  if (strstr(rcvbuf, "+CGEREP: 1") == NULL) { cfgvalid &= ~MNCFG_CGEREP; }
+}
+
 void mn_configureltemodule(void)
 {
 #if (RUNONETIMEMODEMCONFIG == 1) /* one-off LTE module setup */
@@ -783,41 +1159,37 @@ void mn_configureltemodule(void)
 #endif /* (RUNONETIMEMODEMCONFIG == 1) - one-off LTE module setup */
   /* Wait until the LTE module signals that it is ready. */
   mn_waitforltemoduleready();
-  // Possibly useful for later: The module has a RTC - command AT+CCLK
   // Just send an "AT", so the module can see and set the correct baudrate.
   sendatcmd("AT", 4);
-  // Do not echo back commands.
-  sendatcmd("ATE0", 4);
-  // Tell the module to send "verbose" error messages, even though
-  // they really aren't what anybody in his right mind would call
-  // verbose...
-  sendatcmd("AT+CMEE=2", 4);
-  // Set in- and output of socket functions to hex-encoded, so we don't need
-  // to deal with escaping special characters.
-  sendatcmd("AT+UDCONF=1,1", 4);
   // Show a bunch of info about the mobile network module
   sendatcmd("ATI", 4);
-  // select active profile
-  sendatcmd("AT+UPSD=0,100,1", 61);
+  // We don't know what state the module is in, so send everything.
+  cfgvalid = 0;
+  applycfg();
 }
 
 void mn_repeatcfgcmds(void)
 {
-  // Do not echo back commands.
-  sendatcmd("ATE0", 4);
-  // "verbose" error messages
-  sendatcmd("AT+CMEE=2", 4);
-  // Set in- and output of socket functions to hex-encoded
-  sendatcmd("AT+UDCONF=1,1", 4);
-  // select active profile
-  sendatcmd("AT+UPSD=0,100,1", 61);
+  if (cfgvalid != 0) {
+    /* The module did not tell us it rebooted, but it may still have
+     * lost settings, so check instead of blindly resending. */
+    probecfg();
+  }
+  if (cfgvalid == MNCFG_ALL) {
+    ESP_LOGI(TAG, "Module configuration still active, nothing to resend.");
+    return;
+  }
+  ESP_LOGI(TAG, "Resending lost module configuration (have 0x%x)", cfgvalid);
+  applycfg();
 }
 
-void mn_rebootltemodule(void)
+int mn_rebootltemodule(void)
 {
   /* MT silent reset with detach from network, saving of NVM parameters,
    * and reset of SIM card. */
-  sendatcmd("AT+CFUN=16", 4);
+  int res = sendatcmd("AT+CFUN=16", 4);
+  forgetstate();
+  return ((res < 0) ? 1 : 0);
 }
 
 int mn_queuecommand(char * cmd)
@@ -2,6 +2,7 @@
 #ifndef _MOBILENET_H_
 #define _MOBILENET_H_
 
+#include <time.h>
 
 /* This wakes the LTE module (by pulling its "power" pin for a short while).
  * Note that this is a complete NOOP if the module already is awake. It
@@ -19,19 +20,52 @@ void mn_wakeltemodule(void);
  * or "1" otherwise. */
 int mn_waitforltemoduleready(void);
 
-/* Tries to wait until the mobile network has a data connection, with a timeout.
- * This will also automatically handle the case where the module did a
- * fallback to 2G, in which case we have to send an extra command to
- * enable the GPRS data connection.
- * Timeout is in seconds.
- */
-void mn_waitfornetworkconn(int timeout);
-
-/* Tries to wait until the mobile network connection has gotten an IP
- * address, with a timeout.
- * Timeout is in seconds.
- */
-void mn_waitforipaddr(int timeout);
+/* State of the network connection, as the module told us through
+ * URCs (+CEREG, +CGREG, +CGEV). */
+struct mnnetstate {
+  int epsreg;        /* LTE registration state (+CEREG), 1 and 5 mean registered */
+  int gprsreg;       /* GPRS registration state (+CGREG) */
+  int act;           /* access technology: 0 = GPRS, 7 = LTE-M, 9 = NB-IoT, -1 = unknown */
+  unsigned long tac; /* tracking / location area code */
+  unsigned long ci;  /* cell ID */
+  int pdpactive;     /* Is the PDP context active? */
+  char ipaddr[34];   /* our IP address, empty if we have none */
+  long attachms;     /* how long the last mn_waitforattach took, -1 if it failed */
+};
+
+/* Waits until the module is registered to the network and has an IP
+ * address. Registration is tracked through URCs, so we notice the
+ * moment it happens without polling. This also handles the case where
+ * the module did a fallback to 2G, in which case we have to send an
+ * extra command to enable the GPRS data connection.
+ * Timeout is in seconds. Returns 0 on success, 1 on timeout. */
+int mn_waitforattach(int timeout);
+
+void mn_getnetstate(struct mnnetstate * ns);
+/* Shortcuts: whether the module is registered (home or roaming) to
+ * LTE or GPRS, and whether it is searching for a network. */
+int mn_isregistered(void);
+int mn_issearching(void);
+
+/* Selects the mobile network operator (numeric, e.g. 26201) and access
+ * technology (-1 for any). plmn 0 means automatic selection. This
+ * waits up to timeout seconds for the module to register.
+ * Returns 0 on success. */
+int mn_selectoperator(unsigned long plmn, int act, int timeout);
+
+/* Gets the operator and access technology we're registered to.
+ * Returns 0 on success. */
+int mn_getoperator(unsigned long * plmn, int * act);
+
+/* Signal quality, NAN where the module does not know (or the access
+ * technology does not have) a value. */
+struct mnsignal {
+  float rxlev; /* GSM received signal level, dBm */
+  float rsrq;  /* LTE reference signal received quality, dB */
+  float rsrp;  /* LTE reference signal received power, dBm */
+};
+/* Gets the current signal quality (AT+CESQ). Returns 0 on success. */
+int mn_getsignal(struct mnsignal * s);
 
 /* Asks the LTE module to resolve a hostname.
  * Returns a string (!) with the result in obuf, e.g. "127.0.0.2".
@@ -63,6 +97,23 @@ int mn_writesock(int socket, char * buf, int bufsize, int timeout);
  */
 int mn_readsock(int socket, char * buf, int bufsize, int timeout);
 
+/* Gets the current time (UTC) from the clock of the LTE module, which
+ * the module sets from the network (NITZ).
+ * Returns 0 on success, or 1 if the module does not know the time. */
+int mn_getnetworktime(time_t * t);
+
+/* Switches the module off and on again via its PWR pin. This works
+ * as long as the module is not completely locked up. */
+void mn_pwrpincycle(void);
+
+/* Health signals, for deciding whether the module needs to be reset. */
+struct mnhealth {
+  unsigned int consecutivetimeouts; /* AT commands in a row that got no reply */
+  unsigned int timeouts;            /* total AT commands without reply */
+  unsigned int greetings;           /* unexpected greetings, i.e. reboots on its own */
+};
+void mn_gethealth(struct mnhealth * h);
+
 /* This causes a hard powercycle of the LTE module. Necessary
  * if that thing crashed yet again and is not software-recoverable,
  * as usual. */
@@ -77,15 +128,44 @@ void mn_init(void);
  * including one-time setup if that is enabled during compilation. */
 void mn_configureltemodule(void);
 
-/* This repeats the config commands that you seem to need to
- * repeat everytime the module wakes up from sleep. */
+/* This repeats the config commands that the module forgets when it
+ * reboots, e.g. everytime it wakes up from PSM deep sleep. Only the
+ * settings that were actually lost are resent: either the module
+ * greeted us after booting, or a query shows they are gone. */
 void mn_repeatcfgcmds(void);
 
-/* Tells the LTE module to reboot. */
-void mn_rebootltemodule(void);
-
-/* gets info about signal strength / used network from the LTE modem */
-void mn_getmninfo(char * obuf);
+/* Tells the LTE module to reboot.
+ * Returns 0 if the module acknowledged that, 1 otherwise. */
+int mn_rebootltemodule(void);
+
+/* Network and signal info, as parsed from the LTE module. Values that
+ * are unknown are NAN, -1 or 0 respectively. */
+struct mninfo {
+  time_t ts;          /* when this was fetched, 0 if never */
+  int act;            /* access technology, see struct mnnetstate */
+  unsigned long plmn; /* operator (numeric) */
+  unsigned long tac;  /* tracking / location area code */
+  unsigned long ci;   /* cell ID */
+  float rsrp;         /* see struct mnsignal */
+  float rsrq;
+  float rxlev;
+  long attachms;      /* how long the attach before this took */
+};
+/* How many of them we keep for the history */
+#define MN_INFOHISTLEN 16
+
+/* Gets info about signal strength / used network from the LTE modem,
+ * and adds it to the history. Returns 0 if we at least know the
+ * operator. */
+int mn_getmninfo(struct mninfo * mi);
+
+/* Returns an entry of the history, 0 being the newest, or NULL if
+ * there are not that many. */
+const struct mninfo * mn_getmninfohist(int i);
+
+/* Shifts the timestamps in the history by delta seconds, for when the
+ * clock was stepped. */
+void mn_shifttimes(time_t delta);
 
 /* Queues a command to be sent to the LTE module later.
  * This is meant to be used by e.g. the webserver to queue a command
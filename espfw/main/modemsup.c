@@ -0,0 +1,168 @@
+
+/* Modem supervisor */
+
+#include <esp_log.h>
+#include "mobilenet.h"
+#include "modemsup.h"
+#include "pcounters.h"
+
+/* If this many AT commands in a row went unanswered, the module is not
+ * listening at all, and there is no point in asking it nicely. */
+#define MNS_DEADAFTER 5
+/* Cutting the power is hard on the module, so we do that at most this
+ * often (seconds). In between, failures just wait. */
+#define MNS_RELAYMININTERVAL 900
+/* How long uploads need to have failed (seconds since the first
+ * failure) before we take each action. Without this, a few minutes
+ * without coverage would already end at the relay. While the module
+ * does not answer, only the relay waits. */
+static const time_t mindelay[MNS_NUMLEVELS] = {
+  [MNS_LVL_NONE]   = 0,
+  [MNS_LVL_PROBE]  = 0,
+  [MNS_LVL_CFUN]   = 300,
+  [MNS_LVL_PWRPIN] = 600,
+  [MNS_LVL_RELAY]  = 900,
+};
+
+static struct mnslevelstats stats[MNS_NUMLEVELS] = {
+  [MNS_LVL_NONE]   = { .name = "none" },
+  [MNS_LVL_PROBE]  = { .name = "AT probe" },
+  [MNS_LVL_CFUN]   = { .name = "AT+CFUN=16" },
+  [MNS_LVL_PWRPIN] = { .name = "PWR pin" },
+  [MNS_LVL_RELAY]  = { .name = "relay" },
+};
+static int level = MNS_LVL_NONE;
+static time_t failstart = 0;
+static time_t lastrelay = 0;
+
+void mns_success(void)
+{
+  if (failstart != 0) {
+    time_t ttr = time(NULL) - failstart;
+    struct mnslevelstats * s = &stats[level];
+    s->recoveries++;
+    s->lastttr = ttr;
+    if (ttr > s->maxttr) { s->maxttr = ttr; }
+    ESP_LOGI("modemsup.c", "Modem recovered after %lld seconds, last action: %s",
+                           (long long)ttr, s->name);
+  }
+  level = MNS_LVL_NONE;
+  failstart = 0;
+}
+
+/* Takes the action for lvl. Returns 0 if it looks like it worked, or 1
+ * if we should go on to the next level right away. */
+static int takeaction(int lvl)
+{
+  ESP_LOGW("modemsup.c", "Trying to recover the modem: %s", stats[lvl].name);
+  stats[lvl].actions++;
+  switch (lvl) {
+  case MNS_LVL_PROBE:
+    /* If it answers, the problem is probably the network and not the
+     * module, and the next attempt may well work. */
+    for (int i = 0; i < 3; i++) {
+      if (sendatcmd("AT", 2) >= 0) {
+        return 0;
+      }
+    }
+    return 1;
+  case MNS_LVL_CFUN:
+    pcounters_inc(PC_MODEMRESETS);
+    if (mn_rebootltemodule() != 0) {
+      return 1;
+    }
+    return mn_waitforltemoduleready();
+  case MNS_LVL_PWRPIN:
+    pcounters_inc(PC_MODEMRESETS);
+    mn_pwrpincycle();
+    return mn_waitforltemoduleready();
+  case MNS_LVL_RELAY:
+    pcounters_inc(PC_MODEMPOWERCYCLES);
+    pcounters_commit(1);
+    lastrelay = time(NULL);
+    mn_powercycleltemodem();
+    mn_wakeltemodule();
+    mn_waitforltemoduleready();
+    return 0;
+  }
+  return 0;
+}
+
+/* Whether we may take the action for lvl now. */
+static int mayescalateto(int lvl, time_t now, int answering)
+{
+  if (lvl == MNS_LVL_RELAY) {
+    if ((lastrelay != 0) && ((now - lastrelay) < MNS_RELAYMININTERVAL)) {
+      return 0;
+    }
+    return ((now - failstart) >= mindelay[lvl]);
+  }
+  /* A module that does not answer will not get better by waiting. */
+  return (!answering || ((now - failstart) >= mindelay[lvl]));
+}
+
+void mns_failure(void)
+{
+  time_t now = time(NULL);
+  if (failstart == 0) {
+    failstart = now;
+  }
+  struct mnhealth h;
+  mn_gethealth(&h);
+  struct mnnetstate ns;
+  mn_getnetstate(&ns);
+  int answering = (h.consecutivetimeouts < MNS_DEADAFTER);
+  int next;
+  if (!answering) {
+    ESP_LOGW("modemsup.c", "Modem did not answer %u commands in a row.", h.consecutivetimeouts);
+    next = (level < MNS_LVL_PWRPIN) ? MNS_LVL_PWRPIN : (level + 1);
+  } else if (mn_isregistered() && (ns.ipaddr[0] == 0)) {
+    /* Registered, but no IP address: something in the module is stuck. */
+    next = level + 1;
+  } else {
+    /* It answers, and is either searching for a network, or registered
+     * with an IP and the problem is further away. Resetting the module
+     * won't help with either, just check it is still there. */
+    if (mn_issearching()) {
+      ESP_LOGI("modemsup.c", "Modem is searching for a network, not resetting it.");
+    }
+    next = MNS_LVL_PROBE;
+  }
+  if (next >= MNS_NUMLEVELS) {
+    /* Even the relay did not help, all we can do is try that again. */
+    next = MNS_LVL_RELAY;
+  }
+  while (next < MNS_NUMLEVELS) {
+    if (!mayescalateto(next, now, answering)) {
+      ESP_LOGW("modemsup.c", "Not trying %s yet, %lld seconds since the first failure.",
+                             stats[next].name, (long long)(now - failstart));
+      return;
+    }
+    level = next;
+    if (takeaction(level) == 0) {
+      return;
+    }
+    /* The module did not react, so it is not answering. */
+    answering = 0;
+    next++;
+  }
+}
+
+int mns_getlevel(void)
+{
+  return level;
+}
+
+const struct mnslevelstats * mns_getstats(int lvl)
+{
+  if ((lvl < 0) || (lvl >= MNS_NUMLEVELS)) {
+    return NULL;
+  }
+  return &stats[lvl];
+}
+
+void mns_shifttimes(time_t delta)
+{
+  if (failstart != 0) { failstart += delta; }
+  if (lastrelay != 0) { lastrelay += delta; }
+}
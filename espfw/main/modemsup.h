@@ -0,0 +1,46 @@
+
+/* Modem supervisor: when uploads fail, it tries to get the LTE module
+ * working again, escalating from gentle to brutal:
+ * an AT probe, a soft reset by command, switching it off and on via
+ * its PWR pin, and finally cutting its power with the relay. */
+
+#ifndef _MODEMSUP_H_
+#define _MODEMSUP_H_
+
+#include <time.h>
+
+#define MNS_LVL_NONE   0
+#define MNS_LVL_PROBE  1  /* AT probe */
+#define MNS_LVL_CFUN   2  /* AT+CFUN=16 */
+#define MNS_LVL_PWRPIN 3  /* off and on via PWR pin */
+#define MNS_LVL_RELAY  4  /* power cycle via relay */
+#define MNS_NUMLEVELS  5
+
+struct mnslevelstats {
+  const char * name;
+  unsigned int actions;    /* how often we took this action */
+  unsigned int recoveries; /* how often that was the last action before it worked again */
+  time_t lastttr;          /* time to recover (from the first failure) the last time */
+  time_t maxttr;           /* maximum of that */
+};
+
+/* Report the result of an upload attempt. A failure triggers a
+ * recovery action, which may take a while. We only go beyond the AT
+ * probe if the module stops answering, or is registered but gets no IP
+ * address, and each action needs uploads to have failed for a minimum
+ * time first. */
+void mns_success(void);
+void mns_failure(void);
+
+/* The level of the last recovery action, MNS_LVL_NONE if the modem
+ * works. */
+int mns_getlevel(void);
+
+/* Shifts the remembered times by delta seconds, for when the clock
+ * was stepped. */
+void mns_shifttimes(time_t delta);
+
+/* For statistics */
+const struct mnslevelstats * mns_getstats(int level);
+
+#endif /* _MODEMSUP_H_ */
@@ -0,0 +1,203 @@
+
+/* Operator selection statistics */
+
+#include <math.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include "opsel.h"
+
+#define OPSNVSNAMESPACE "opsel"
+/* The blob key includes a version, change it when struct opstat
+ * changes. */
+#define OPSNVSKEY "stats2"
+#define OPS_MAXENTRIES 8
+/* NVS is written at most this often (seconds) unless forced. */
+#define OPS_COMMITINTERVAL 3600
+/* Weight of a new value in the moving averages */
+#define OPS_EWMA 0.2
+
+static struct opstat stats[OPS_MAXENTRIES];
+static int current = -1; /* entry we're attached with */
+static int manual = 0;
+static int dirty = 0;
+static int64_t lastcommit = 0;
+
+void ops_init(void)
+{
+  memset(stats, 0, sizeof(stats));
+  nvs_handle_t nvsh;
+  if (nvs_open(OPSNVSNAMESPACE, NVS_READONLY, &nvsh) != ESP_OK) {
+    return;
+  }
+  size_t len = sizeof(stats);
+  if (nvs_get_blob(nvsh, OPSNVSKEY, stats, &len) != ESP_OK) {
+    memset(stats, 0, sizeof(stats));
+  }
+  uint8_t u8;
+  if (nvs_get_u8(nvsh, "manual", &u8) == ESP_OK) {
+    manual = u8;
+  }
+  nvs_close(nvsh);
+  if (manual) {
+    ESP_LOGI("opsel.c", "Operator was selected manually, not interfering.");
+  }
+}
+
+/* Finds the entry for plmn/act, or creates it (replacing the one with
+ * the fewest attaches if the table is full). */
+static int getentry(unsigned long plmn, int act)
+{
+  int worst = -1;
+  for (int i = 0; i < OPS_MAXENTRIES; i++) {
+    if ((stats[i].plmn == plmn) && (stats[i].act == act)) {
+      return i;
+    }
+    if (stats[i].plmn == 0) {
+      if ((worst < 0) || (stats[worst].plmn != 0)) { worst = i; }
+    } else if ((worst < 0)
+            || ((stats[worst].plmn != 0) && (stats[i].attaches < stats[worst].attaches))) {
+      worst = i;
+    }
+  }
+  memset(&stats[worst], 0, sizeof(stats[worst]));
+  stats[worst].plmn = plmn;
+  stats[worst].act = act;
+  stats[worst].attachms = NAN;
+  stats[worst].signal = NAN;
+  return worst;
+}
+
+/* Higher is better: how likely attaching and submitting works, and
+ * how quickly we get attached. */
+static float score(const struct opstat * s)
+{
+  if ((s->attaches + s->preffails) == 0) {
+    return 0.0;
+  }
+  float attachratio = (float)s->attaches / (float)(s->attaches + s->preffails);
+  float submitratio = (float)(s->submitok + 1) / (float)(s->submitok + s->submitfail + 2);
+  float res = attachratio * submitratio;
+  if (!isnan(s->attachms)) {
+    res /= (1.0 + s->attachms / 60000.0);
+  }
+  return res;
+}
+
+int ops_getbest(unsigned long * plmn, int * act)
+{
+  int best = -1;
+  for (int i = 0; i < OPS_MAXENTRIES; i++) {
+    if ((stats[i].plmn == 0) || (stats[i].attaches == 0)) {
+      continue;
+    }
+    if ((best < 0) || (score(&stats[i]) > score(&stats[best]))) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    return 1;
+  }
+  *plmn = stats[best].plmn;
+  *act = stats[best].act;
+  return 0;
+}
+
+void ops_preffailed(unsigned long plmn, int act)
+{
+  int e = getentry(plmn, act);
+  stats[e].preffails++;
+  current = -1;
+  dirty = 1;
+}
+
+static float ewma(float old, float new)
+{
+  if (isnan(new)) { return old; }
+  if (isnan(old)) { return new; }
+  return old + OPS_EWMA * (new - old);
+}
+
+void ops_attached(unsigned long plmn, int act, long attachms, float signal)
+{
+  current = getentry(plmn, act);
+  struct opstat * s = &stats[current];
+  s->attaches++;
+  s->attachms = ewma(s->attachms, attachms);
+  s->signal = ewma(s->signal, signal);
+  dirty = 1;
+  ESP_LOGI("opsel.c", "Attached to %lu act %d after %ld ms (average %.0f ms, signal %.0f dBm)",
+                      plmn, act, attachms, s->attachms, s->signal);
+}
+
+void ops_submitresult(int ok)
+{
+  if (current < 0) {
+    return;
+  }
+  if (ok) {
+    stats[current].submitok++;
+  } else {
+    stats[current].submitfail++;
+  }
+  dirty = 1;
+  ops_commit(0);
+}
+
+void ops_setmanual(int m)
+{
+  manual = (m != 0);
+  /* This is rarely changed, so we save it right away. The admin may
+   * have stored the choice in the module (AT+COPS=1), and that must not
+   * be overridden after a reboot. */
+  nvs_handle_t nvsh;
+  if (nvs_open(OPSNVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+    ESP_LOGE("opsel.c", "Failed to open NVS for saving the selection mode.");
+    return;
+  }
+  esp_err_t e = nvs_set_u8(nvsh, "manual", manual);
+  if (e == ESP_OK) { e = nvs_commit(nvsh); }
+  nvs_close(nvsh);
+  if (e != ESP_OK) {
+    ESP_LOGE("opsel.c", "Failed to save the selection mode to NVS: %s", esp_err_to_name(e));
+  }
+}
+
+int ops_getmanual(void)
+{
+  return manual;
+}
+
+void ops_commit(int force)
+{
+  int64_t now = esp_timer_get_time();
+  if (!dirty) {
+    return;
+  }
+  if (!force && (lastcommit != 0) && ((now - lastcommit) < (OPS_COMMITINTERVAL * 1000000LL))) {
+    return;
+  }
+  nvs_handle_t nvsh;
+  if (nvs_open(OPSNVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+    ESP_LOGE("opsel.c", "Failed to open NVS for saving operator statistics.");
+    return;
+  }
+  esp_err_t e = nvs_set_blob(nvsh, OPSNVSKEY, stats, sizeof(stats));
+  if (e == ESP_OK) { e = nvs_commit(nvsh); }
+  nvs_close(nvsh);
+  if (e != ESP_OK) {
+    ESP_LOGE("opsel.c", "Failed to save operator statistics to NVS: %s", esp_err_to_name(e));
+    return;
+  }
+  dirty = 0;
+  lastcommit = now;
+}
+
+const struct opstat * ops_get(int i)
+{
+  if ((i < 0) || (i >= OPS_MAXENTRIES) || (stats[i].plmn == 0)) {
+    return NULL;
+  }
+  return &stats[i];
+}
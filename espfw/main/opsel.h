@@ -0,0 +1,52 @@
+
+/* Operator selection: remembers how well attaching and submitting
+ * worked with each mobile network operator and access technology, so
+ * that on a cold attach we can try the historically best one first,
+ * instead of waiting for the automatic selection. */
+
+#ifndef _OPSEL_H_
+#define _OPSEL_H_
+
+#include <stdint.h>
+
+struct opstat {
+  uint32_t plmn;        /* operator, e.g. 26201. 0 marks an unused entry. */
+  int8_t act;           /* access technology (see mnnetstate) */
+  uint32_t attaches;    /* successful attaches */
+  uint32_t preffails;   /* failed attempts when we tried it first */
+  uint32_t submitok;    /* successful submissions while on it */
+  uint32_t submitfail;  /* failed submissions while on it */
+  float attachms;       /* time to first IP, moving average */
+  float signal;         /* signal (RSRP, RxLev for GSM) in dBm, moving average */
+};
+
+/* Loads the statistics from NVS. */
+void ops_init(void);
+
+/* Returns 0 and the best operator / access technology if we know one
+ * that is worth trying first, 1 otherwise. */
+int ops_getbest(unsigned long * plmn, int * act);
+
+/* Records that trying plmn/act first did not get us attached. */
+void ops_preffailed(unsigned long plmn, int act);
+/* Records a successful attach from unregistered, with the time to the
+ * first IP (in ms) and the signal. Later submit results are attributed
+ * to this. Don't call this for uploads while still attached. */
+void ops_attached(unsigned long plmn, int act, long attachms, float signal);
+/* Records the result of a submission. */
+void ops_submitresult(int ok);
+
+/* Whether the operator was selected manually by the admin. If so, we
+ * do not interfere. This is kept in NVS, so it survives reboots. */
+void ops_setmanual(int manual);
+int ops_getmanual(void);
+
+/* Writes the statistics to NVS if they changed and the last write was
+ * long enough ago, or if force is set. */
+void ops_commit(int force);
+
+/* For statistics: Returns the i-th entry, or NULL if there are not
+ * that many. */
+const struct opstat * ops_get(int i);
+
+#endif /* _OPSEL_H_ */
@@ -0,0 +1,159 @@
+
+/* Persistent counters, kept in NVS so they survive resets. */
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include "pcounters.h"
+
+#define PCNVSNAMESPACE "pcounters"
+/* Write to NVS at most this often (in seconds), unless forced. With a
+ * blob of less than 100 bytes, this is less than 5 KB per day, which
+ * NVS wear leveling spreads over the whole partition. */
+#define PC_COMMITINTERVAL 1800
+
+static uint32_t counters[PC_NUMCOUNTERS];
+static const char * counternames[PC_NUMCOUNTERS] = {
+  [PC_BOOTS] = "boots",
+  [PC_RSTPOWERON] = "resets: power on",
+  [PC_RSTSW] = "resets: software",
+  [PC_RSTPANIC] = "resets: panic",
+  [PC_RSTWDT] = "resets: watchdog",
+  [PC_RSTBROWNOUT] = "resets: brownout",
+  [PC_RSTOTHER] = "resets: other",
+  [PC_LASTRESET] = "last reset reason",
+  [PC_SUBMITOK] = "successful submissions",
+  [PC_SUBMITFAIL] = "failed submissions",
+  [PC_MODEMPOWERCYCLES] = "modem power cycles",
+  [PC_UPTIME] = "total uptime (s)",
+  [PC_RAINUM] = "total rain (um)",
+  [PC_NVSWRITES] = "NVS writes",
+  [PC_MODEMRESETS] = "modem resets",
+};
+static int dirty = 0;
+static int64_t lastcommit = 0;  /* esp_timer time, in us */
+static int64_t lastuptimeupd = 0;
+
+static void loadcounters(void)
+{
+  nvs_handle_t nvsh;
+  memset(counters, 0, sizeof(counters));
+  if (nvs_open(PCNVSNAMESPACE, NVS_READONLY, &nvsh) != ESP_OK) {
+    /* Nothing stored yet - that is perfectly normal on first boot. */
+    return;
+  }
+  /* If a newer firmware added counters, the stored blob is shorter
+   * than our array. We just load what is there, the rest stays 0. */
+  size_t len = 0;
+  if (nvs_get_blob(nvsh, "ctrs", NULL, &len) == ESP_OK) {
+    if (len > sizeof(counters)) {
+      ESP_LOGW("pcounters.c", "Stored counters are larger than expected (%u bytes), ignoring them.", len);
+    } else if (nvs_get_blob(nvsh, "ctrs", counters, &len) != ESP_OK) {
+      memset(counters, 0, sizeof(counters));
+    }
+  }
+  nvs_close(nvsh);
+}
+
+void pcounters_init(void)
+{
+  loadcounters();
+  counters[PC_BOOTS]++;
+  esp_reset_reason_t rr = esp_reset_reason();
+  counters[PC_LASTRESET] = rr;
+  switch (rr) {
+  case ESP_RST_POWERON:  counters[PC_RSTPOWERON]++; break;
+  case ESP_RST_SW:       counters[PC_RSTSW]++; break;
+  case ESP_RST_PANIC:    counters[PC_RSTPANIC]++; break;
+  case ESP_RST_INT_WDT:
+  case ESP_RST_TASK_WDT:
+  case ESP_RST_WDT:      counters[PC_RSTWDT]++; break;
+  case ESP_RST_BROWNOUT: counters[PC_RSTBROWNOUT]++; break;
+  default:               counters[PC_RSTOTHER]++; break;
+  };
+  ESP_LOGI("pcounters.c", "Boot number %lu, reset reason %d, %lu successful submissions so far.",
+                          counters[PC_BOOTS], rr, counters[PC_SUBMITOK]);
+  /* Record the boot right away, so we do not lose it if we crash
+   * again before the next regular commit. */
+  dirty = 1;
+  pcounters_commit(1);
+}
+
+void pcounters_inc(enum pcounter c)
+{
+  pcounters_add(c, 1);
+}
+
+void pcounters_add(enum pcounter c, uint32_t n)
+{
+  if ((c < 0) || (c >= PC_NUMCOUNTERS) || (n == 0)) {
+    return;
+  }
+  counters[c] += n;
+  dirty = 1;
+}
+
+void pcounters_addrain(float mm)
+{
+  if (mm > 0.0) {
+    pcounters_add(PC_RAINUM, (uint32_t)(mm * 1000.0 + 0.5));
+  }
+}
+
+uint32_t pcounters_get(enum pcounter c)
+{
+  if ((c < 0) || (c >= PC_NUMCOUNTERS)) {
+    return 0;
+  }
+  if (c == PC_UPTIME) {
+    /* Include the part not yet added */
+    return counters[c] + (uint32_t)((esp_timer_get_time() - lastuptimeupd) / 1000000);
+  }
+  return counters[c];
+}
+
+const char * pcounters_getname(enum pcounter c)
+{
+  if ((c < 0) || (c >= PC_NUMCOUNTERS)) {
+    return "invalid";
+  }
+  return counternames[c];
+}
+
+void pcounters_commit(int force)
+{
+  int64_t now = esp_timer_get_time();
+  if (!force && ((now - lastcommit) < (PC_COMMITINTERVAL * 1000000LL))) {
+    return;
+  }
+  /* Uptime only gets added when we commit - it changes constantly,
+   * so it would otherwise make us write every time. */
+  int64_t upsecs = (now - lastuptimeupd) / 1000000;
+  if (upsecs > 0) {
+    counters[PC_UPTIME] += upsecs;
+    lastuptimeupd += upsecs * 1000000;
+    if (lastcommit > 0) { /* Don't write just for the uptime at boot */
+      dirty = 1;
+    }
+  }
+  if (!dirty) {
+    return;
+  }
+  nvs_handle_t nvsh;
+  if (nvs_open(PCNVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+    ESP_LOGE("pcounters.c", "Failed to open NVS for saving counters.");
+    return;
+  }
+  counters[PC_NVSWRITES]++;
+  esp_err_t e = nvs_set_blob(nvsh, "ctrs", counters, sizeof(counters));
+  if (e == ESP_OK) { e = nvs_commit(nvsh); }
+  nvs_close(nvsh);
+  if (e != ESP_OK) {
+    ESP_LOGE("pcounters.c", "Failed to save counters to NVS: %s", esp_err_to_name(e));
+    return;
+  }
+  dirty = 0;
+  lastcommit = now;
+}
@@ -0,0 +1,49 @@
+
+/* Persistent counters, kept in NVS so they survive resets.
+ * The counters live in RAM and are written to NVS in batches, not on
+ * every change, to limit flash wear. */
+
+#ifndef _PCOUNTERS_H_
+#define _PCOUNTERS_H_
+
+#include <stdint.h>
+
+enum pcounter {
+  PC_BOOTS = 0,         /* Number of boots */
+  PC_RSTPOWERON,        /* Reset reasons: power on */
+  PC_RSTSW,             /* software reset (esp_restart) */
+  PC_RSTPANIC,          /* crash */
+  PC_RSTWDT,            /* any of the watchdogs */
+  PC_RSTBROWNOUT,       /* brownout */
+  PC_RSTOTHER,          /* anything else */
+  PC_LASTRESET,         /* esp_reset_reason() of the last boot */
+  PC_SUBMITOK,          /* successful submissions */
+  PC_SUBMITFAIL,        /* failed submissions */
+  PC_MODEMPOWERCYCLES,  /* LTE modem power cycles */
+  PC_UPTIME,            /* total uptime over all boots, in seconds */
+  PC_RAINUM,            /* total rain in micrometers (1/1000 mm) */
+  PC_NVSWRITES,         /* how often we wrote the counters to NVS */
+  PC_MODEMRESETS,       /* LTE modem resets by command or power pin */
+  PC_NUMCOUNTERS        /* must be last */
+};
+
+/* Loads the counters from NVS, and records the boot and its reset
+ * reason. Needs to be called after nvs_flash_init(). */
+void pcounters_init(void);
+
+/* Increment a counter by one / by n. */
+void pcounters_inc(enum pcounter c);
+void pcounters_add(enum pcounter c, uint32_t n);
+/* Adds rain (in mm) to the rain total. */
+void pcounters_addrain(float mm);
+
+uint32_t pcounters_get(enum pcounter c);
+const char * pcounters_getname(enum pcounter c);
+
+/* Writes the counters to NVS if they changed, but only if the last
+ * write was at least 30 minutes ago - unless force is set. Call
+ * this with force = 0 regularly, and with force = 1 before a
+ * planned reset. */
+void pcounters_commit(int force);
+
+#endif /* _PCOUNTERS_H_ */
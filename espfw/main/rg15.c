@@ -1,13 +1,33 @@
+
 /* mobilews rg15.c
  * routines for the RG15 rain sensor */
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <esp_log.h>
 #include "rg15.h"
 #include "wk2132.h"
 
 #define RG15SERPORT 0
 
+/* Serial input is collected here until we have complete lines.
+ * Whatever is left after the last newline (a line that was split
+ * across reads) stays in the buffer for the next time. */
+#define RG15_LINEBUFSIZE 256
+static char linebuf[RG15_LINEBUFSIZE];
+static int linebuflen = 0;
+
+/* After how many seconds without any increase of TotalAcc we consider
+ * a rain event to be over. */
+#define RG15_EVENTGAP 900
+
+static struct rg15state state;
+static int havetotal = 0;      /* Did we ever get a TotalAcc? */
+static float pendingrain = 0.0; /* Rain since the last rg15_readraincount() */
+static int newreply = 0;       /* Set when a reply was parsed since then */
+static time_t lastincrease = 0;
+
 void rg15_init(void)
 {
     /* The RG15 communicates at 9600 baud by default unless we
@@ -15,63 +35,199 @@ void rg15_init(void)
      * It's connected on wk2132 port 0 (define RG15SERPORT). */
     wk2132_serialportinit(RG15SERPORT, 9600);
     /* Tell the rainsensor we want polling mode, a.k.a. "shut up until you're spoken to".
-     * Also, use high res mode and metrical output, disable 
+     * Also, use high res mode and metrical output, disable
      * tipping-bucket-output, and reset counters. */
     wk2132_write_serial(RG15SERPORT, "P\nH\nM\nY\nO\n", 10);
+    memset(&state, 0, sizeof(state));
+    /* We just reset the counters, so TotalAcc is known to be 0. */
+    havetotal = 1;
 }
 
 void rg15_requestread(void)
 {
     /* Request a new reading.
-     * Since we're only interested in changes, "A" should fit us well,
-     * but we could also get summed up data with "R". */
-    wk2132_write_serial(RG15SERPORT, "A\n", 2);
+     * We use "R", which gives us all the values (Acc, EventAcc,
+     * TotalAcc, RInt). We calculate the rain since the last reading
+     * from TotalAcc ourselves, so that a lost reply does not lose
+     * the rain in it. */
+    wk2132_claim(RG15SERPORT, -1);
+    wk2132_write_serial(RG15SERPORT, "R\n", 2);
     /* Flush output */
     wk2132_flush(RG15SERPORT);
+    wk2132_release(RG15SERPORT);
+}
+
+/* Parses one field like "TotalAcc  1.23 mm". Returns 1 on success. */
+static int parsefield(char * f, const char * key, float * v)
+{
+    char unit[16];
+    size_t kl = strlen(key);
+    while (*f == ' ') { f++; }
+    if ((strncmp(f, key, kl) != 0) || (f[kl] != ' ')) {
+      return 0;
+    }
+    if (sscanf(f + kl, "%f %15s", v, unit) < 2) {
+      return 0;
+    }
+    if (strncmp(unit, "mm", 2) != 0) { /* "mm" or "mmph" */
+      ESP_LOGW("rg15.c", "unexpected unit %s in field %s", unit, key);
+      return 0;
+    }
+    return 1;
+}
+
+static void updatetotal(float total)
+{
+    time_t now = time(NULL);
+    float delta;
+    if (!havetotal) {
+      /* First reading - we can't know what happened before. */
+      delta = 0.0;
+      havetotal = 1;
+    } else if (total < state.totalacc) {
+      /* The sensor has been reset in the meantime */
+      delta = total;
+    } else {
+      delta = total - state.totalacc;
+    }
+    if ((delta > 0.0) && (state.lastreply > 0)) {
+      /* Our own rain rate, from the increase since the last reply */
+      time_t dt = now - state.lastreply;
+      if (dt > 0) {
+        state.rainrate = delta * 3600.0 / (float)dt;
+      }
+    } else {
+      state.rainrate = 0.0;
+    }
+    if (delta > 0.0) {
+      if (!state.raining) {
+        state.raining = 1;
+        state.rainstart = now;
+        state.eventrain = 0.0;
+        ESP_LOGI("rg15.c", "Rain event started.");
+      }
+      state.eventrain += delta;
+      lastincrease = now;
+    } else if (state.raining && ((now - lastincrease) >= RG15_EVENTGAP)) {
+      state.raining = 0;
+      state.rainstop = lastincrease;
+      ESP_LOGI("rg15.c", "Rain event ended after %lld seconds, %.2f mm.",
+                         (long long)(state.rainstop - state.rainstart), state.eventrain);
+    }
+    pendingrain += delta;
+    state.totalacc = total;
+    state.lastreply = now;
+    newreply = 1;
+}
+
+static void parseline(char * l)
+{
+    /* Strip trailing \r */
+    size_t len = strlen(l);
+    while ((len > 0) && (l[len - 1] == '\r')) {
+      l[--len] = 0;
+    }
+    if (len == 0) {
+      return;
+    }
+    ESP_LOGI("rg15.c", "Parsing: %s", l);
+    /* Attempt to parse the line. There are a few things we can safely ignore. */
+    /* Lines starting with ";" are comments. */
+    if (l[0] == ';') return;
+    /* Single letters (maybe followed by a few characters) are
+     * acknowledgements of our commands: "p" polling mode, "h" high
+     * resolution, "m" metric units, "y" tipping bucket output
+     * disabled, "o" counters reset. */
+    if ((len <= 3) && (strchr("phmyo", l[0]) != NULL)) return;
+    if (strncmp(l, "Acc ", 4) != 0) {
+      ESP_LOGW("rg15.c", "...ignoring unknown line.");
+      return;
+    }
+    /* Acc  0.00 mm, EventAcc  0.00 mm, TotalAcc  0.00 mm, RInt  0.00 mmph */
+    float v;
+    int gottotal = 0;
+    char * stsp;
+    char * f = strtok_r(l, ",", &stsp);
+    while (f != NULL) {
+      if (parsefield(f, "Acc", &v)) {
+        state.acc = v;
+      } else if (parsefield(f, "EventAcc", &v)) {
+        state.eventacc = v;
+      } else if (parsefield(f, "TotalAcc", &v)) {
+        gottotal = 1;
+      } else if (parsefield(f, "RInt", &v)) {
+        state.rint = v;
+      } else {
+        ESP_LOGW("rg15.c", "...failed to parse field: %s", f);
+      }
+      if (gottotal == 1) {
+        updatetotal(v);
+        gottotal = 2;
+      }
+      f = strtok_r(NULL, ",", &stsp);
+    }
+    if (gottotal == 0) {
+      ESP_LOGW("rg15.c", "...no TotalAcc in reply.");
+    }
+}
+
+void rg15_poll(void)
+{
+    wk2132_claim(RG15SERPORT, -1);
+    int avail;
+    while ((avail = wk2132_get_available_to_read(RG15SERPORT)) > 0) {
+      if (linebuflen >= (RG15_LINEBUFSIZE - 1)) {
+        /* A "line" this long is garbage, throw it away. */
+        ESP_LOGW("rg15.c", "line buffer overflow, discarding %d bytes.", linebuflen);
+        linebuflen = 0;
+      }
+      int space = RG15_LINEBUFSIZE - 1 - linebuflen;
+      if (avail > space) { avail = space; }
+      int got = wk2132_read_serial(RG15SERPORT, &linebuf[linebuflen], avail);
+      if (got <= 0) {
+        break;
+      }
+      linebuflen += got;
+    }
+    wk2132_release(RG15SERPORT);
+    /* Parse all complete lines, and keep the rest. */
+    int start = 0;
+    for (int i = 0; i < linebuflen; i++) {
+      if (linebuf[i] == '\n') {
+        linebuf[i] = 0;
+        parseline(&linebuf[start]);
+        start = i + 1;
+      }
+    }
+    if (start > 0) {
+      memmove(&linebuf[0], &linebuf[start], linebuflen - start);
+      linebuflen -= start;
+    }
 }
 
 float rg15_readraincount(void)
 {
-    char rcvdata[128];
-    int length = 0;
-    float res = -99999.9;
-    if ((length = wk2132_get_available_to_read(RG15SERPORT)) < 1/* FIXME 10 */) {
-      ESP_LOGW("rg15.c", "No or not enough data available on serial port.");
+    rg15_poll();
+    if (!newreply) {
+      ESP_LOGW("rg15.c", "No reply from RG15 since the last reading.");
       return -99999.9;
     }
-    length = wk2132_read_serial(RG15SERPORT, rcvdata, ((length > 100) ? 100 : length));
-    if (length > 0) {
-      char * stsp; char * spp;
-      rcvdata[length] = 0;
-      ESP_LOGI("rg15.c", "Serial received %d bytes: %s", length, rcvdata);
-      /* Split into lines */
-      spp = strtok_r(&rcvdata[0], "\n", &stsp);
-      do {
-        ESP_LOGI("rg15.c", "Parsing: %s", spp);
-        /* Attempt to parse the line. There are a few things we can safely ignore. */
-        /* Lines starting with ";" are comments. */
-        if (strncmp(spp, ";", 1) == 0) continue;
-        /* "h" is acknowledgement of the "H" command that sets high resolution. */
-        if ((strncmp(spp, "h", 1) == 0) && (strlen(spp) <= 3)) continue;
-        /* "m" is acknowledgement of the "M" command that sets metric units. */
-        if ((strncmp(spp, "m", 1) == 0) && (strlen(spp) <= 3)) continue;
-        /* "y" is acknowledgement of the "Y" command that disables tipping bucket output. */
-        if ((strncmp(spp, "m", 1) == 0) && (strlen(spp) <= 3)) continue;
-        if (strncmp(spp, "Acc ", 4) == 0) {
-          /* Acc  0.00 mm\r\n */
-          char rcv1[128];
-          if (sscanf(spp+4, "%f %s", &res, rcv1) < 2) {
-            ESP_LOGW("rg15.c", "...failed to parse serial input (1).");
-            return -99999.9;
-          }
-          if (strncmp(rcv1, "mm", 2) != 0) {
-            ESP_LOGW("rg15.c", "...failed to parse serial input (2).");
-            return -99999.9;
-          }
-          ESP_LOGI("rg15.c", "Successfully parsed raingauge value: %.3f", res);
-        }
-      } while ((spp = strtok_r(NULL, "\n", &stsp)) != NULL);
-    }
+    float res = pendingrain;
+    pendingrain = 0.0;
+    newreply = 0;
     return res;
 }
 
+void rg15_getstate(struct rg15state * st)
+{
+    *st = state;
+}
+
+void rg15_shifttimes(time_t delta)
+{
+    /* 0 means "never", and stays that way. */
+    if (state.lastreply != 0) { state.lastreply += delta; }
+    if (state.rainstart != 0) { state.rainstart += delta; }
+    if (state.rainstop != 0) { state.rainstop += delta; }
+    if (lastincrease != 0) { lastincrease += delta; }
+}
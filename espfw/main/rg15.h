@@ -2,6 +2,21 @@
 #ifndef _RG15_H_
 #define _RG15_H_
 
+#include <time.h>
+
+struct rg15state {
+  float acc;        /* last "Acc" the sensor reported */
+  float eventacc;   /* last "EventAcc" the sensor reported */
+  float totalacc;   /* last "TotalAcc" the sensor reported */
+  float rint;       /* last "RInt" (rain intensity, mm/h) the sensor reported */
+  float rainrate;   /* our own rain rate (mm/h) from TotalAcc increases */
+  time_t lastreply; /* when we last parsed a reply */
+  int raining;      /* Is there a rain event going on? */
+  time_t rainstart; /* start of the current / last rain event */
+  time_t rainstop;  /* end of the last rain event */
+  float eventrain;  /* rain in the current / last rain event (mm) */
+};
+
 /* This needs to be called AFTER wk2132_init() */
 void rg15_init(void);
 
@@ -10,8 +25,21 @@ void rg15_init(void);
  * tell when a reply is ready. */
 void rg15_requestread(void);
 
-/* Reads rain count. */
+/* Reads whatever the sensor has sent so far, and parses all
+ * complete lines. Incomplete lines are kept until the rest arrives. */
+void rg15_poll(void);
+
+/* Reads rain count: The rain in mm since the last call.
+ * Returns a negative value if the sensor did not reply since the
+ * last call - the rain is then not lost, but included in the result
+ * of the next call. */
 float rg15_readraincount(void);
 
-#endif /* _RG15_H_ */
+/* Gets the current state (raw values, rain rate and rain event) */
+void rg15_getstate(struct rg15state * st);
+
+/* Shifts all remembered times by delta seconds, for when the clock
+ * was stepped. */
+void rg15_shifttimes(time_t delta);
 
+#endif /* _RG15_H_ */
@@ -0,0 +1,99 @@
+
+/* Scheduler for periodic jobs */
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "sched.h"
+
+/* A job that catches up runs at most this many missed deadlines, the
+ * rest is skipped. Otherwise a job that was blocked for a long time
+ * would monopolize everything afterwards. */
+#define SCHED_MAXCATCHUP 10
+
+#define SCHED_MAXJOBS 12
+
+static struct schedjob * jobs[SCHED_MAXJOBS];
+static int njobs = 0;
+
+void sched_add(struct schedjob * j, const char * name, uint32_t periodms, int policy)
+{
+  j->name = name;
+  j->period = (int64_t)periodms * 1000LL;
+  j->next = esp_timer_get_time() + j->period;
+  j->policy = policy;
+  j->wakes = 1;
+  j->runs = 0;
+  j->missed = 0;
+  j->lastjitter = 0;
+  j->maxjitter = 0;
+  j->avgjitter = 0;
+  if (njobs < SCHED_MAXJOBS) {
+    jobs[njobs] = j;
+    njobs++;
+  } else {
+    ESP_LOGE("sched.c", "Too many jobs, %s will not be shown in statistics.", name);
+  }
+}
+
+int sched_due(struct schedjob * j)
+{
+  int64_t now = esp_timer_get_time();
+  if (now < j->next) {
+    return 0;
+  }
+  int64_t late = now - j->next;
+  j->lastjitter = late;
+  if (late > j->maxjitter) { j->maxjitter = late; }
+  /* Moving average over roughly the last 16 runs */
+  j->avgjitter += (late - j->avgjitter) / 16;
+  j->runs++;
+  int64_t missed = late / j->period;
+  if ((j->policy == SCHED_CATCHUP) && (missed <= SCHED_MAXCATCHUP)) {
+    /* The next deadline(s) are in the past, so we will be due again
+     * immediately until we have caught up. */
+    j->next += j->period;
+  } else {
+    if (missed > 0) {
+      ESP_LOGW("sched.c", "%s is %lld ms late, skipping %lld deadlines.",
+                          j->name, late / 1000, missed);
+      j->missed += missed;
+    }
+    j->next += (missed + 1) * j->period;
+  }
+  return 1;
+}
+
+void sched_setperiod(struct schedjob * j, uint32_t periodms)
+{
+  int64_t np = (int64_t)periodms * 1000LL;
+  /* The deadline after the last run moves along. */
+  j->next += np - j->period;
+  j->period = np;
+}
+
+void sched_setnext(struct schedjob * j, int64_t next)
+{
+  j->next = next;
+}
+
+void sched_setwakes(struct schedjob * j, int wakes)
+{
+  j->wakes = wakes;
+}
+
+int64_t sched_nextdeadline(void)
+{
+  int64_t res = INT64_MAX;
+  for (int i = 0; i < njobs; i++) {
+    if (jobs[i]->wakes && (jobs[i]->next < res)) { res = jobs[i]->next; }
+  }
+  return res;
+}
+
+struct schedjob * sched_get(int i)
+{
+  if ((i < 0) || (i >= njobs)) {
+    return NULL;
+  }
+  return jobs[i];
+}
@@ -0,0 +1,56 @@
+
+/* Scheduler for periodic jobs. Deadlines are absolute and on the
+ * monotonic esp_timer clock (microseconds since boot), so they neither
+ * drift with the time a job takes to run, nor jump when the wall clock
+ * is set. */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+/* What happens when a job ran so late that it missed whole periods: */
+#define SCHED_SKIP    0  /* run once, and skip the missed deadlines */
+#define SCHED_CATCHUP 1  /* run once for every missed deadline */
+
+struct schedjob {
+  const char * name;
+  int64_t period;       /* in us */
+  int64_t next;         /* next deadline (esp_timer time in us) */
+  uint8_t policy;       /* SCHED_SKIP or SCHED_CATCHUP */
+  uint8_t wakes;        /* whether sched_nextdeadline() considers it */
+  uint32_t runs;        /* how often the job was due */
+  uint32_t missed;      /* deadlines that were skipped */
+  int64_t lastjitter;   /* how late the last run started, in us */
+  int64_t maxjitter;    /* maximum of that */
+  int64_t avgjitter;    /* moving average of that */
+};
+
+/* Registers a job (for reporting) with its period in milliseconds. The
+ * first deadline is one period from now. */
+void sched_add(struct schedjob * j, const char * name, uint32_t periodms, int policy);
+
+/* Returns 1 if the job is due, and then advances its deadline. */
+int sched_due(struct schedjob * j);
+
+/* Changes the period of a job, effective from the next deadline on. */
+void sched_setperiod(struct schedjob * j, uint32_t periodms);
+
+/* Moves the next deadline of a job, e.g. to align it with the
+ * wall clock. */
+void sched_setnext(struct schedjob * j, int64_t next);
+
+/* Jobs that are only checked while another job runs (e.g. channels
+ * that are sampled in the measurement cycle) must not wake us up: if
+ * their deadline is earlier than that of the other job, we would
+ * otherwise spin until that one is due. By default, all jobs do. */
+void sched_setwakes(struct schedjob * j, int wakes);
+
+/* Returns the earliest deadline of all registered jobs that wake us. */
+int64_t sched_nextdeadline(void);
+
+/* For statistics: Returns the i-th registered job, or NULL if there
+ * are not that many. */
+struct schedjob * sched_get(int i);
+
+#endif /* _SCHED_H_ */
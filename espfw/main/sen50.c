@@ -1,31 +1,74 @@
 /* Talking to SEN50 particulate matter sensors */
 
+#include <math.h>
 #include "esp_log.h"
+#include "i2c.h"
 #include "sen50.h"
 #include "sdkconfig.h"
 
 
 #define SEN50ADDR 0x69
 
-#define I2C_MASTER_TIMEOUT_MS 100  /* Timeout for I2C communication */
+/* Duty cycling: The sensor is started SEN50_WARMUP seconds before a
+ * reading is due (the datasheet says values are stable after about
+ * 30 seconds), and stopped again right after the reading. The time
+ * between readings adapts between SEN50_MININTERVAL and
+ * SEN50_MAXINTERVAL, depending on how fast PM2.5 is changing. */
+#define SEN50_WARMUP 30
+#define SEN50_MININTERVAL 120
+#define SEN50_MAXINTERVAL 900
+/* A change of more than this (in ug/m3, or 20 percent, whatever is
+ * larger) counts as "changing quickly" */
+#define SEN50_MINCHANGE 2.0
+/* The sensor only cleans its fan automatically after running for a
+ * week non-stop, which it never does anymore. So we do it ourselves
+ * every SEN50_CLEANINTERVAL seconds. Cleaning takes 10 seconds, which
+ * fits into the warm-up period. */
+#define SEN50_CLEANINTERVAL (7 * 24 * 3600)
 
-static i2c_port_t sen50i2cport;
+static struct sen50sched {
+    uint8_t enabled;
+    uint8_t running;
+    time_t startedat;
+    time_t nextread;
+    time_t lastcleaning;
+    int interval;
+    float lastpm025;
+} sched = {
+    .enabled = 1,
+    .running = 0,
+    .startedat = 0,
+    .nextread = 0,
+    .lastcleaning = 0,
+    .interval = SEN50_MININTERVAL,
+    .lastpm025 = NAN,
+};
+
+static struct i2cdev sen50dev = {
+    .addr = SEN50ADDR,
+    .name = "SEN50",
+    .maxclk = 100000, /* The SEN5x only supports standard mode */
+    .timeoutms = 50,
+};
 
 void sen50_init(i2c_port_t port)
 {
-    sen50i2cport = port;
+    i2c_dev_init(&sen50dev, port);
 
     /* The default power-on-config of the sensor should
      * be perfectly fine for us, so there is nothing to
      * configure here. */
 }
 
+int sen50_probe(void)
+{
+    return (i2c_dev_probe(&sen50dev) == ESP_OK);
+}
+
 void sen50_startmeas(void)
 {
     uint8_t cmd[2] = { 0x00, 0x21 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2c_dev_write(&sen50dev, cmd, sizeof(cmd));
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
@@ -33,13 +76,120 @@ void sen50_startmeas(void)
 void sen50_stopmeas(void)
 {
     uint8_t cmd[2] = { 0x01, 0x04 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2c_dev_write(&sen50dev, cmd, sizeof(cmd));
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
 
+void sen50_startfancleaning(void)
+{
+    uint8_t cmd[2] = { 0x56, 0x07 };
+    i2c_dev_write(&sen50dev, cmd, sizeof(cmd));
+}
+
+void sen50_sched_tick(time_t now)
+{
+    if (sched.running || !sched.enabled) {
+      return;
+    }
+    if (now < (sched.nextread - SEN50_WARMUP)) {
+      return;
+    }
+    ESP_LOGI("sen50.c", "Starting SEN50 for warm-up.");
+    sen50_startmeas();
+    sched.running = 1;
+    sched.startedat = now;
+    if (sched.lastcleaning == 0) {
+      /* Don't clean right after boot, start counting now. */
+      sched.lastcleaning = now;
+    } else if ((now - sched.lastcleaning) >= SEN50_CLEANINTERVAL) {
+      ESP_LOGI("sen50.c", "Starting SEN50 fan cleaning.");
+      /* Give the sensor a moment to enter measurement mode first. */
+      vTaskDelay(pdMS_TO_TICKS(50));
+      sen50_startfancleaning();
+      sched.lastcleaning = now;
+    }
+}
+
+time_t sen50_sched_nextwake(void)
+{
+    if (!sched.enabled) {
+      return (time_t)0x7fffffff;
+    }
+    if (sched.running) {
+      /* The reading is taken in the measurement cycle, which wakes us
+       * up anyway - and once nextread has passed, returning it would
+       * keep the main loop from sleeping at all until then. */
+      return (time_t)0x7fffffff;
+    }
+    return sched.nextread - SEN50_WARMUP;
+}
+
+int sen50_sched_due(time_t now)
+{
+    if (!sched.running) {
+      return 0;
+    }
+    return ((now >= sched.nextread) && ((now - sched.startedat) >= SEN50_WARMUP));
+}
+
+void sen50_sched_done(time_t now, struct sen50data * d)
+{
+    sen50_stopmeas();
+    sched.running = 0;
+    if ((d != NULL) && (d->valid)) {
+      if (!isnan(sched.lastpm025)) {
+        float change = fabsf(d->pm025 - sched.lastpm025);
+        float thres = fmaxf(SEN50_MINCHANGE, sched.lastpm025 * 0.2);
+        if (change > thres) {
+          sched.interval /= 2;
+        } else {
+          sched.interval = (sched.interval * 3) / 2;
+        }
+        if (sched.interval < SEN50_MININTERVAL) { sched.interval = SEN50_MININTERVAL; }
+        if (sched.interval > SEN50_MAXINTERVAL) { sched.interval = SEN50_MAXINTERVAL; }
+      }
+      sched.lastpm025 = d->pm025;
+    }
+    sched.nextread = now + sched.interval;
+    ESP_LOGI("sen50.c", "SEN50 stopped, next reading in %d seconds.", sched.interval);
+}
+
+void sen50_sched_skip(time_t now)
+{
+    if (sched.running) {
+      return;
+    }
+    sched.nextread = now + sched.interval;
+    ESP_LOGI("sen50.c", "Skipping SEN50 reading, next one in %d seconds.", sched.interval);
+}
+
+void sen50_sched_enable(int en)
+{
+    if (en == sched.enabled) {
+      return;
+    }
+    if (!en && sched.running) {
+      sen50_stopmeas();
+      sched.running = 0;
+    }
+    sched.enabled = en;
+    ESP_LOGI("sen50.c", "SEN50 scheduling %s.", (en ? "enabled" : "disabled"));
+}
+
+void sen50_sched_shifttimes(time_t delta)
+{
+    /* 0 means "not yet", and stays that way. */
+    if (sched.startedat != 0) { sched.startedat += delta; }
+    if (sched.nextread != 0) { sched.nextread += delta; }
+    if (sched.lastcleaning != 0) { sched.lastcleaning += delta; }
+}
+
+int sen50_sched_getinterval(void)
+{
+    return sched.interval;
+}
+
 /* This function is based on Sensirons example code and datasheet
  * for the SHT3x and was written for that. CRC-calculation is
  * exactly the same for the SEN50, so we reuse it. */
@@ -70,18 +220,14 @@ void sen50_read(struct sen50data * d)
 {
     uint8_t readbuf[23];
     uint8_t cmd[2] = { 0x03, 0xc4 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2c_dev_write(&sen50dev, cmd, sizeof(cmd));
     d->valid = 0;
     d->pm010raw = 0xffff;  d->pm025raw = 0xffff; d->pm040raw = 0xffff; d->pm100raw = 0xffff;
     d->pm010 = -999.99; d->pm025 = -999.9; d->pm040 = -999.99; d->pm100 = -999.9;
     /* Datasheet says we need to give the sensor at least 20 ms time before
      * we can read the data so that it can fill its internal buffers */
     vTaskDelay(pdMS_TO_TICKS(22));
-    int res = i2c_master_read_from_device(sen50i2cport, SEN50ADDR,
-                                          readbuf, sizeof(readbuf),
-                                          I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    int res = i2c_dev_read(&sen50dev, readbuf, sizeof(readbuf));
     if (res != ESP_OK) {
       ESP_LOGE("sen50.c", "ERROR: I2C-read from SEN50 failed.");
       return;
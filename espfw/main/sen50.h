@@ -4,6 +4,7 @@
 #ifndef _SEN50_H_
 #define _SEN50_H_
 
+#include <time.h>
 #include "driver/i2c.h" /* Needed for i2c_port_t */
 
 struct sen50data {
@@ -21,10 +22,45 @@ struct sen50data {
 /* Initialize the SEN50 */
 void sen50_init(i2c_port_t port);
 
+/* Checks whether the sensor is there. Returns 1 if it is. */
+int sen50_probe(void);
+
 /* Start measurements on the SEN50. */
 void sen50_startmeas(void);
 /* Stop measurements */
 void sen50_stopmeas(void);
+/* Start the fan cleaning. Only works while measuring, and takes
+ * 10 seconds during which there are no valid measurements. */
+void sen50_startfancleaning(void);
+
+/* The scheduler for duty cycling the sensor. Running the SEN50
+ * non-stop costs 63-70 mA, so we only start it a while before we
+ * actually want to read it, and stop it again afterwards.
+ * sen50_sched_tick needs to be called every time the main loop wakes
+ * up, and will start the sensor (and, when due, the fan cleaning)
+ * when its warm-up period begins.
+ * sen50_sched_nextwake returns when the main loop needs to wake up
+ * next for the sensor, i.e. to start the warm-up. The reading itself
+ * happens in the next measurement cycle after the warm-up.
+ * sen50_sched_due returns 1 if the sensor is warmed up and a reading
+ * is due. After reading, call sen50_sched_done with the result (or
+ * NULL if you didn't read) to stop the sensor and schedule the next
+ * reading. The interval gets shorter when PM values change quickly. */
+void sen50_sched_tick(time_t now);
+time_t sen50_sched_nextwake(void);
+int sen50_sched_due(time_t now);
+void sen50_sched_done(time_t now, struct sen50data * d);
+/* Skips the reading whose warm-up is due without starting the sensor,
+ * e.g. because we know it is failing, and schedules the next one. */
+void sen50_sched_skip(time_t now);
+/* The current (adaptive) interval between readings, in seconds */
+int sen50_sched_getinterval(void);
+/* Enables or disables the scheduler. While disabled, the sensor is
+ * stopped and never started. */
+void sen50_sched_enable(int en);
+/* Shifts all times the scheduler remembers by delta seconds, for when
+ * the clock was stepped. */
+void sen50_sched_shifttimes(time_t delta);
 
 /* Read measurement data (particulate matter)
  * from the sensor. */
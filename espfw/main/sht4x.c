@@ -1,6 +1,8 @@
 /* Talking to SHT4x (SHT40, SHT41, SHT45) temperature / humidity sensors */
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "i2c.h"
 #include "sht4x.h"
 #include "sdkconfig.h"
 
@@ -12,25 +14,49 @@
 /* Turn on heater with medium power (110 mW) for 1 second */
 #define SHT4X_CMD_HEAT_MID_LONG 0x2F
 
-#define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication */
+/* Heater scheduling: If humidity stays at or above SHT4X_HEATRH percent
+ * for SHT4X_HEATAFTER readings in a row, we run a heater cycle, but at
+ * most once every SHT4X_HEATMININTERVAL seconds (the datasheet wants
+ * the heater duty cycle to stay below 10 percent, we stay far below
+ * that). Readings within SHT4X_BLANKTIME seconds after a heater cycle
+ * are thrown away, because the sensor is still warmer than its
+ * surroundings then. */
+#define SHT4X_HEATRH 95.0
+#define SHT4X_HEATAFTER 3
+#define SHT4X_HEATMININTERVAL 300
+#define SHT4X_BLANKTIME 30
+/* We only heat if the next reading is at least this much later than
+ * the blank time, so jitter cannot make it fall into it. */
+#define SHT4X_BLANKMARGIN 10
 
-static i2c_port_t sht4xi2cport;
+static struct i2cdev sht4xdev = {
+    .addr = SHT4XADDR,
+    .name = "SHT4x",
+    .maxclk = 1000000,
+    .timeoutms = 50,
+};
+
+static struct sht4xheatstats heatstats;
+static int highrhinrow = 0;
 
 void sht4x_init(i2c_port_t port)
 {
-    sht4xi2cport = port;
+    i2c_dev_init(&sht4xdev, port);
 
     /* The default power-on-config of the sensor should
      * be perfectly fine for us, so there is nothing to
      * configure here. */
 }
 
+int sht4x_probe(void)
+{
+    return (i2c_dev_probe(&sht4xdev) == ESP_OK);
+}
+
 void sht4x_startmeas(void)
 {
     uint8_t cmd[1] = { SHT4X_CMD_MEASURE_HIGH };
-    i2c_master_write_to_device(sht4xi2cport, SHT4XADDR,
-                               cmd, sizeof(cmd),
-                               pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    i2c_dev_write(&sht4xdev, cmd, sizeof(cmd));
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
@@ -64,11 +90,9 @@ static uint8_t sht4x_crc(uint8_t b1, uint8_t b2)
 void sht4x_read(struct sht4xdata * d)
 {
     uint8_t readbuf[6];
-    d->valid = 0; d->tempraw = 0xffff;  d->humraw = 0xffff;
+    d->valid = 0; d->blanked = 0; d->tempraw = 0xffff;  d->humraw = 0xffff;
     d->temp = -999.99; d->hum = 200.0;
-    int res = i2c_master_read_from_device(sht4xi2cport, SHT4XADDR,
-                                          readbuf, sizeof(readbuf),
-                                          pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    int res = i2c_dev_read(&sht4xdev, readbuf, sizeof(readbuf));
     if (res != ESP_OK) {
       ESP_LOGI("sht4x.c", "ERROR: I2C-read from SHT4x failed.");
       return;
@@ -91,6 +115,16 @@ void sht4x_read(struct sht4xdata * d)
      * that are slightly outside that range */
     if (d->hum < 0.0) { d->hum = 0.0; }
     if (d->hum > 100.0) { d->hum = 100.0; }
+    if ((heatstats.ncycles > 0)
+     && ((esp_timer_get_time() - heatstats.lastcycle) < (SHT4X_BLANKTIME * 1000000LL))) {
+      /* The sensor has not cooled down from the last heater cycle,
+       * both temperature and (relative!) humidity are off. */
+      ESP_LOGI("sht4x.c", "Discarding reading taken %lld ms after heater cycle.",
+                          (esp_timer_get_time() - heatstats.lastcycle) / 1000);
+      heatstats.blanked++;
+      d->blanked = 1;
+      return;
+    }
     /* Mark the result as valid. */
     d->valid = 1;
 }
@@ -98,8 +132,41 @@ void sht4x_read(struct sht4xdata * d)
 void sht4x_heatercycle(void)
 {
     uint8_t cmd[1] = { SHT4X_CMD_HEAT_MID_LONG };
-    i2c_master_write_to_device(sht4xi2cport, SHT4XADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    if (i2c_dev_write(&sht4xdev, cmd, sizeof(cmd)) == ESP_OK) {
+      heatstats.ncycles++;
+      heatstats.heatms += 1000;
+      heatstats.lastcycle = esp_timer_get_time();
+    }
+}
+
+void sht4x_heatersched(struct sht4xdata * d, int intervalms)
+{
+    if (!d->valid) {
+      return;
+    }
+    if (d->hum < SHT4X_HEATRH) {
+      highrhinrow = 0;
+      return;
+    }
+    highrhinrow++;
+    if (highrhinrow < SHT4X_HEATAFTER) {
+      return;
+    }
+    if ((heatstats.ncycles > 0)
+     && ((esp_timer_get_time() - heatstats.lastcycle) < (SHT4X_HEATMININTERVAL * 1000000LL))) {
+      return;
+    }
+    if (intervalms < ((SHT4X_BLANKTIME + SHT4X_BLANKMARGIN) * 1000)) {
+      /* E.g. while boosted: the next reading would be blanked. */
+      return;
+    }
+    ESP_LOGI("sht4x.c", "Humidity at %.1f%% for %d readings, running heater cycle.",
+                        d->hum, highrhinrow);
+    sht4x_heatercycle();
+}
+
+void sht4x_getheatstats(struct sht4xheatstats * st)
+{
+    *st = heatstats;
 }
 
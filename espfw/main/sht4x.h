@@ -8,21 +8,33 @@
 
 struct sht4xdata {
   uint8_t valid;
+  uint8_t blanked; /* set if the reading was discarded after a heater cycle */
   uint16_t tempraw;
   uint16_t humraw;
   float temp;
   float hum;
 };
 
+struct sht4xheatstats {
+  uint32_t ncycles;   /* Number of heater cycles run since boot */
+  uint32_t heatms;    /* Total heater on-time since boot in ms */
+  int64_t lastcycle;  /* esp_timer time of the last heater cycle */
+  uint32_t blanked;   /* Readings discarded because they were too soon after heating */
+};
+
 /* Initialize the SHT4x */
 void sht4x_init(i2c_port_t port);
 
+/* Checks whether the sensor is there. Returns 1 if it is. */
+int sht4x_probe(void);
+
 /* Request a oneshot-measurement from the SHT4x */
 void sht4x_startmeas(void);
 
 /* Read temperature / humidity data from the sensor.
  * You need to request a oneshot-measurement before reading,
- * and you can only read every measurement at most once! */
+ * and you can only read every measurement at most once!
+ * Readings taken shortly after a heater cycle are marked invalid. */
 void sht4x_read(struct sht4xdata * d);
 
 /* Run a long (==1 second) heater cycle at medium power.
@@ -32,5 +44,15 @@ void sht4x_read(struct sht4xdata * d);
  * keyword: creep mitigation). */
 void sht4x_heatercycle(void);
 
+/* Decides whether a heater cycle is needed, based on the reading that
+ * was just made (humidity staying very high), and runs it.
+ * Call this right after sht4x_read(), so that the sensor has a whole
+ * measurement interval (intervalms) to cool down again. If that is
+ * too short for it to cool down, the heater is not used. */
+void sht4x_heatersched(struct sht4xdata * d, int intervalms);
+
+/* Returns statistics about the heater usage. */
+void sht4x_getheatstats(struct sht4xheatstats * st);
+
 #endif /* _SHT4X_H_ */
 
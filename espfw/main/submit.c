@@ -3,15 +3,54 @@
 #include <stdio.h>
 #include <string.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include "batsens.h"
 #include "mobilenet.h"
 #include "submit.h"
+#include "timesync.h"
 #include "sdkconfig.h"
 #include "secrets.h"
 
 static const char *TAG = "submit.c";
 
+/* How long we wait for the server to reply (seconds) */
+#define WPD_REPLYTIMEOUT 30
+
+/* Waits for the status line of the HTTP reply. mn_readsock does not
+ * wait for data, so we poll. Returns the HTTP status code, or -1 if
+ * no (parseable) status line arrived in time. */
+static int readhttpstatus(int sock)
+{
+    char buf[200];
+    int len = 0;
+    int64_t giveupat = esp_timer_get_time() + (WPD_REPLYTIMEOUT * 1000000LL);
+    while (esp_timer_get_time() < giveupat) {
+      int br = mn_readsock(sock, &buf[len], sizeof(buf) - 1 - len, 5);
+      if (br <= 0) {
+        vTaskDelay(pdMS_TO_TICKS(250));
+        continue;
+      }
+      len += br;
+      buf[len] = 0;
+      char * eol = strstr(buf, "\r\n");
+      if ((eol == NULL) && (len < (sizeof(buf) - 1))) {
+        continue; /* Status line not complete yet */
+      }
+      if (eol != NULL) { *eol = 0; }
+      ESP_LOGI(TAG, "Received HTTP reply: %s", buf);
+      int status;
+      if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) {
+        ESP_LOGW(TAG, "Could not parse the HTTP status line.");
+        return -1;
+      }
+      return status;
+    }
+    ESP_LOGW(TAG, "No HTTP reply within %d seconds.", WPD_REPLYTIMEOUT);
+    return -1;
+}
+
 int submit_to_wpd_multi(int arraysize, struct wpd * aowpd)
 {
     int res = 1;
@@ -22,7 +61,7 @@ int submit_to_wpd_multi(int arraysize, struct wpd * aowpd)
     }
     int sock = mn_opentcpconn("wetter.poempelfox.de", 80, 61);
     if (sock >= 0) {
-      char tmpstr[700];
+      char tmpstr[1200];
       strcpy(tmpstr, "POST /api/pushmeasurement/ HTTP/1.1\r\n");
       strcat(tmpstr, "Host: wetter.poempelfox.de\r\n");
       strcat(tmpstr, "Connection: close\r\n");
@@ -57,19 +96,101 @@ int submit_to_wpd_multi(int arraysize, struct wpd * aowpd)
       if (res != 0) {
         return res;
       }
-      vTaskDelay(pdMS_TO_TICKS(3000)); // FIXME - instead wait for reply.
-      int br;
-      while ((br = mn_readsock(sock, tmpstr, sizeof(tmpstr) - 1, 30)) > 0) {
-        tmpstr[br] = 0;
-        ESP_LOGI(TAG, "Received HTTP reply: %s", tmpstr);
-      }
+      int status = readhttpstatus(sock);
       mn_closesocket(sock);
-      /* FIXME set res depending on the reply. */
-      res = 0;
+      res = ((status >= 200) && (status <= 299)) ? 0 : 1;
     }
     return res;
 }
 
+/* Formats one value for submit_to_wpd_batch. With buf == NULL, this
+ * only calculates the length. */
+static int formatbatchvalue(char * buf, size_t bufsize, struct wpd * v, time_t ts, time_t now, int first)
+{
+    if (ts_isrealtime(ts)) {
+      struct tm tm;
+      char tsstr[24];
+      gmtime_r(&ts, &tm);
+      strftime(tsstr, sizeof(tsstr), "%Y-%m-%dT%H:%M:%SZ", &tm);
+      return snprintf(buf, bufsize, "%s{\"value_type\":\"%s\",\"value\":\"%.3f\",\"timestamp\":\"%s\"}",
+                      (first ? "" : ","), v->sensorid, v->value, tsstr);
+    }
+    return snprintf(buf, bufsize, "%s{\"value_type\":\"%s\",\"value\":\"%.3f\",\"age\":\"%ld\"}",
+                    (first ? "" : ","), v->sensorid, v->value, (long)(now - ts));
+}
+
+int submit_to_wpd_batch(int nsamples, struct wpdsample * samples, time_t now)
+{
+    int res = 1;
+    const char * prefix = "{\"software_version\":\"mws0.1\",\"sensordatavalues\":[";
+    const char * suffix = "]}\n";
+    if ((strcmp(WPDTOKEN, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLM123456789") == 0)
+     || (strcmp(WPDTOKEN, "") == 0)) {
+      ESP_LOGI(TAG, "Not sending data to wetter.poempelfox.de because no valid token has been set.");
+      return res;
+    }
+    /* The request can get far larger than any buffer we want to have,
+     * so we calculate the content length first, and then send it in
+     * pieces. */
+    int contentlen = strlen(prefix) + strlen(suffix);
+    int nvals = 0;
+    for (int s = 0; s < nsamples; s++) {
+      for (int i = 0; i < samples[s].nvals; i++) {
+        contentlen += formatbatchvalue(NULL, 0, &samples[s].vals[i], samples[s].ts, now, (nvals == 0));
+        nvals++;
+      }
+    }
+    if (nvals == 0) {
+      return 0;
+    }
+    int sock = mn_opentcpconn("wetter.poempelfox.de", 80, 61);
+    if (sock < 0) {
+      return res;
+    }
+    char tmpstr[1200];
+    sprintf(tmpstr, "POST /api/pushmeasurement/ HTTP/1.1\r\n"
+                    "Host: wetter.poempelfox.de\r\n"
+                    "Connection: close\r\n"
+                    "Content-type: application/json\r\n"
+                    "X-Sensor: %s\r\nContent-length: %d\r\n\r\n%s",
+                    WPDTOKEN, contentlen, prefix);
+    int pos = strlen(tmpstr);
+    nvals = 0;
+    for (int s = 0; s < nsamples; s++) {
+      for (int i = 0; i < samples[s].nvals; i++) {
+        if (pos > (sizeof(tmpstr) - 100)) {
+          res = mn_writesock(sock, tmpstr, pos, 61);
+          if (res != 0) {
+            mn_closesocket(sock);
+            return res;
+          }
+          pos = 0;
+        }
+        pos += formatbatchvalue(&tmpstr[pos], sizeof(tmpstr) - pos,
+                                &samples[s].vals[i], samples[s].ts, now, (nvals == 0));
+        nvals++;
+      }
+    }
+    strcpy(&tmpstr[pos], suffix);
+    res = mn_writesock(sock, tmpstr, strlen(tmpstr), 61);
+    if (res != 0) {
+      mn_closesocket(sock);
+      return res;
+    }
+    ESP_LOGI(TAG, "Sent %d values from %d samples in %d bytes.", nvals, nsamples, contentlen);
+    /* The modem is still transmitting the request and then waits for
+     * the reply with the radio on, so this is when to measure the
+     * battery under load. The reply just waits in the modem's buffer. */
+    batsens_sample(BS_LOADED);
+    int status = readhttpstatus(sock);
+    mn_closesocket(sock);
+    if ((status < 200) || (status > 299)) {
+      ESP_LOGW(TAG, "Server did not accept the values (HTTP status %d).", status);
+      return 1;
+    }
+    return 0;
+}
+
 int submit_to_wpd(char * sensorid, float value)
 {
   struct wpd aowpd[1];
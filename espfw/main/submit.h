@@ -2,6 +2,63 @@
 #ifndef _SUBMIT_H_
 #define _SUBMIT_H_
 
+#include <time.h>
+#include "secrets.h"
+
+/* Sensor IDs for the health telemetry, see secrets.h.template.
+ * Empty unless set there, and empty IDs are not sent at all. */
+#ifndef WPDID_I2CERRORS
+#define WPDID_I2CERRORS ""
+#endif
+#ifndef WPDID_I2CRECOVERIES
+#define WPDID_I2CRECOVERIES ""
+#endif
+#ifndef WPDID_RAINTOTAL
+#define WPDID_RAINTOTAL ""
+#endif
+#ifndef WPDID_BOOTS
+#define WPDID_BOOTS ""
+#endif
+#ifndef WPDID_SUBMITFAILS
+#define WPDID_SUBMITFAILS ""
+#endif
+#ifndef WPDID_MODEMPOWERCYCLES
+#define WPDID_MODEMPOWERCYCLES ""
+#endif
+#ifndef WPDID_BATSAG
+#define WPDID_BATSAG ""
+#endif
+#ifndef WPDID_ENERGYPROFILE
+#define WPDID_ENERGYPROFILE ""
+#endif
+#ifndef WPDID_SCHEDJITTER
+#define WPDID_SCHEDJITTER ""
+#endif
+#ifndef WPDID_WINDGUST
+#define WPDID_WINDGUST ""
+#endif
+#ifndef WPDID_BOOSTTRIGGERS
+#define WPDID_BOOSTTRIGGERS ""
+#endif
+#ifndef WPDID_TTFIP
+#define WPDID_TTFIP ""
+#endif
+#ifndef WPDID_ACT
+#define WPDID_ACT ""
+#endif
+#ifndef WPDID_RSRP
+#define WPDID_RSRP ""
+#endif
+#ifndef WPDID_RSRQ
+#define WPDID_RSRQ ""
+#endif
+#ifndef WPDID_RXLEV
+#define WPDID_RXLEV ""
+#endif
+#ifndef WPDID_PLMN
+#define WPDID_PLMN ""
+#endif
+
 /* An array of the following structs is handed to the
  * submit_to_wpd_multi function. */
 struct wpd {
@@ -9,10 +66,32 @@ struct wpd {
   float value;
 };
 
+/* Whether wetter.poempelfox.de is known to honour the per-value
+ * "timestamp" / "age" that submit_to_wpd_batch sends. This has not
+ * been confirmed yet. If it ignores them, every value is stamped with
+ * the time it arrived, so as long as this is 0, the uplink uploads
+ * every cycle, whatever the batch size and energy profile say. */
+#define WPD_HONOURSTIMESTAMPS 0
+
+/* A set of values measured at the same time, for
+ * submit_to_wpd_batch. */
+#define WPD_MAXVALS 32
+struct wpdsample {
+  time_t ts;
+  int nvals;
+  struct wpd vals[WPD_MAXVALS];
+};
+
 /* Submits multiple values to wetter.poempelfox.de.
  * Returns 0 on success. */
 int submit_to_wpd_multi(int arraysize, struct wpd * arrayofwpd);
 
+/* Submits the values of multiple samples in one request. Each value
+ * carries the UTC timestamp of its sample, or if the sample was taken
+ * before our clock was ever synced, its age (in seconds before now).
+ * Returns 0 on success. */
+int submit_to_wpd_batch(int nsamples, struct wpdsample * samples, time_t now);
+
 /* This is a convenience function, calling submit_to_wpd_multi
  * with a size 1 array internally. */
 int submit_to_wpd(char * sensorid, float value);
@@ -0,0 +1,119 @@
+
+/* Time synchronization and drift compensation */
+
+#include <esp_log.h>
+#include <math.h>
+#include <sys/time.h>
+#include "timesync.h"
+
+/* Offsets larger than this (in seconds) are stepped, smaller ones
+ * are slewed with adjtime(). */
+#define TS_STEPABOVE 2.0
+/* How often we sync. The network time only has a resolution of one
+ * second, so syncing much more often would make the drift estimate
+ * useless. */
+#define TS_SYNCEVERY 3600
+/* ...and we ignore intervals that are so short that the resolution
+ * dominates the drift estimate. */
+#define TS_MINDRIFTINTERVAL 1800
+/* The RC oscillator our clock runs on in light sleep is not great,
+ * but anything beyond this is not drift, that is something broken. */
+#define TS_MAXDRIFT 50000.0
+
+static struct tsstate state = {
+  .synced = 0, .lastsync = 0, .lastoffset = 0.0, .drift = 0.0, .nsyncs = 0, .nsteps = 0
+};
+static time_t lastcomp = 0;
+
+/* Returns how much of the last adjtime() correction is still
+ * outstanding, in seconds. */
+static double outstanding(void)
+{
+  struct timeval old;
+  if (adjtime(NULL, &old) != 0) {
+    return 0.0;
+  }
+  return (double)old.tv_sec + (double)old.tv_usec / 1000000.0;
+}
+
+/* Starts slewing the clock by secs. Note that adjtime() cancels
+ * whatever correction is still in progress. */
+static void slew(double secs)
+{
+  struct timeval adj;
+  adj.tv_sec = (long)secs;
+  adj.tv_usec = (long)((secs - (double)adj.tv_sec) * 1000000.0);
+  adjtime(&adj, NULL);
+}
+
+time_t ts_sync(time_t nettime)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  double offset = (double)nettime - ((double)tv.tv_sec + (double)tv.tv_usec / 1000000.0);
+  /* Part of the offset may still be in the process of being slewed
+   * away. That part is not an error of the drift estimate. */
+  double pending = outstanding();
+  time_t step = 0;
+  if (fabs(offset) > TS_STEPABOVE) {
+    /* Our clock is way off (or was never set), so jump. */
+    step = nettime - tv.tv_sec;
+    tv.tv_sec += step;
+    settimeofday(&tv, NULL);
+    state.nsteps++;
+    ESP_LOGI("timesync.c", "Stepped clock by %lld seconds.", (long long)step);
+  } else {
+    /* This replaces the pending correction, which offset includes. */
+    slew(offset);
+  }
+  /* Whatever offset remains although we compensated the drift since
+   * the last sync means our estimate is off. We only trust that if we
+   * were synced before and did not need to step. */
+  if (state.synced && (step == 0)) {
+    time_t interval = nettime - state.lastsync;
+    if (interval >= TS_MINDRIFTINTERVAL) {
+      state.drift += (float)((offset - pending) * 1000000.0 / (double)interval);
+      if (state.drift > TS_MAXDRIFT) { state.drift = TS_MAXDRIFT; }
+      if (state.drift < -TS_MAXDRIFT) { state.drift = -TS_MAXDRIFT; }
+    }
+  }
+  state.lastsync = nettime;
+  ESP_LOGI("timesync.c", "Synced to network time, offset was %.1f s, drift estimate %.0f ppm.",
+                         offset, state.drift);
+  state.lastoffset = (float)offset;
+  state.synced = 1;
+  state.nsyncs++;
+  lastcomp = nettime;
+  return step;
+}
+
+int ts_syncdue(void)
+{
+  if (state.synced == 0) {
+    return 1;
+  }
+  return ((time(NULL) - state.lastsync) >= TS_SYNCEVERY);
+}
+
+void ts_compensate(void)
+{
+  time_t now = time(NULL);
+  if ((state.synced == 0) || (lastcomp == 0) || (now <= lastcomp)) {
+    return;
+  }
+  /* Positive drift means our clock is too slow, so we need to add time. */
+  /* Add this to what is still outstanding, e.g. from the last sync,
+   * instead of cutting that off. */
+  slew(outstanding() + (double)state.drift * (double)(now - lastcomp) / 1000000.0);
+  lastcomp = now;
+}
+
+int ts_isrealtime(time_t t)
+{
+  return (t >= TS_MINVALID);
+}
+
+void ts_getstate(struct tsstate * st)
+{
+  *st = state;
+}
@@ -0,0 +1,42 @@
+
+/* Time synchronization: sets our clock from the network time the LTE
+ * module gives us, and compensates the drift of our own clock between
+ * syncs. Until the first sync, time(NULL) is just seconds since boot. */
+
+#ifndef _TIMESYNC_H_
+#define _TIMESYNC_H_
+
+#include <time.h>
+
+/* Anything before this (2023-01-01) cannot be a real timestamp, so it
+ * must be seconds since boot. */
+#define TS_MINVALID 1672531200
+
+struct tsstate {
+  int synced;          /* Did we sync at least once since boot? */
+  time_t lastsync;     /* when we last synced */
+  float lastoffset;    /* how far off we were at the last sync (seconds) */
+  float drift;         /* estimated drift of our clock, in ppm */
+  unsigned int nsyncs; /* number of syncs since boot */
+  unsigned int nsteps; /* how many of them needed a step */
+};
+
+/* Sets our clock from nettime (UTC). Small offsets are slewed, large
+ * ones are stepped. Returns by how many seconds the clock was stepped
+ * (0 if it wasn't), so that the caller can fix up timestamps it keeps. */
+time_t ts_sync(time_t nettime);
+
+/* Returns 1 if we should sync again: We never did since boot, or
+ * the last sync was long enough ago. */
+int ts_syncdue(void);
+
+/* Applies the drift compensation for the time since the last call.
+ * Should be called once per measurement cycle. */
+void ts_compensate(void);
+
+/* Returns 1 if t is a real (UTC) timestamp, and not seconds since boot. */
+int ts_isrealtime(time_t t);
+
+void ts_getstate(struct tsstate * st);
+
+#endif /* _TIMESYNC_H_ */
@@ -0,0 +1,163 @@
+
+/* Batched uplink: queueing timestamped measurements, and sending them
+ * out every few cycles. */
+
+#include <string.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include "submit.h"
+#include "uplink.h"
+
+#define UPLNVSNAMESPACE "uplink"
+/* Default batch size: upload every cycle, like we always did. */
+#define UPL_DEFBATCH 1
+#define UPL_MAXBATCH 60
+/* Samples per HTTP request. Every value is about 50 bytes, and the
+ * modem takes them 128 bytes at a time, so we don't want to make
+ * a single request too large. */
+#define UPL_MAXPERREQ 15
+/* Upload early once the queue is this full */
+#define UPL_FLUSHAT (UPL_QUEUELEN - 4)
+
+/* The queue is a ring buffer. It's static and not on the stack,
+ * because it's rather large. */
+static struct wpdsample queue[UPL_QUEUELEN];
+static int qhead = 0;  /* oldest sample */
+static int qcount = 0;
+static struct wpdsample * cursample = NULL;
+static int batchsize = UPL_DEFBATCH;
+static unsigned int dropped = 0;
+
+void upl_init(void)
+{
+  nvs_handle_t nvsh;
+  if (nvs_open(UPLNVSNAMESPACE, NVS_READONLY, &nvsh) != ESP_OK) {
+    /* Nothing stored yet - that is perfectly normal, use the default. */
+    return;
+  }
+  uint8_t u8;
+  if (nvs_get_u8(nvsh, "batch", &u8) == ESP_OK) {
+    if ((u8 >= 1) && (u8 <= UPL_MAXBATCH)) { batchsize = u8; }
+  }
+  nvs_close(nvsh);
+#if WPD_HONOURSTIMESTAMPS
+  ESP_LOGI("uplink.c", "Uploading every %d cycles.", batchsize);
+#else
+  ESP_LOGW("uplink.c", "Server timestamps not confirmed, uploading every cycle (configured: %d).", batchsize);
+#endif
+}
+
+void upl_begin(time_t ts)
+{
+  if (qcount >= UPL_QUEUELEN) {
+    /* Queue is full, drop the oldest sample. */
+    qhead = (qhead + 1) % UPL_QUEUELEN;
+    qcount--;
+    dropped++;
+    ESP_LOGW("uplink.c", "Queue full, dropped oldest sample (%u dropped so far).", dropped);
+  }
+  cursample = &queue[(qhead + qcount) % UPL_QUEUELEN];
+  cursample->ts = ts;
+  cursample->nvals = 0;
+}
+
+void upl_add(char * sensorid, float value)
+{
+  if (strcmp(sensorid, "") == 0) { /* sensor not configured */
+    return;
+  }
+  if ((cursample == NULL) || (cursample->nvals >= WPD_MAXVALS)) {
+    ESP_LOGE("uplink.c", "Cannot add value for %s to sample.", sensorid);
+    return;
+  }
+  cursample->vals[cursample->nvals].sensorid = sensorid;
+  cursample->vals[cursample->nvals].value = value;
+  cursample->nvals++;
+}
+
+void upl_commit(void)
+{
+  if (cursample == NULL) {
+    return;
+  }
+  if (cursample->nvals > 0) {
+    qcount++;
+  }
+  cursample = NULL;
+}
+
+int upl_count(void)
+{
+  return qcount;
+}
+
+int upl_due(int bs)
+{
+#if !WPD_HONOURSTIMESTAMPS
+  /* Batched values would be stamped with the time they arrive, so
+   * upload every cycle. Only samples left over from a failed upload
+   * go out late. */
+  bs = 1;
+#endif
+  return ((qcount >= bs) || (qcount >= UPL_FLUSHAT));
+}
+
+int upl_flush(void)
+{
+  time_t now = time(NULL);
+  while (qcount > 0) {
+    /* The samples for one request need to be contiguous in memory,
+     * so we stop at the end of the ring buffer. */
+    int n = qcount;
+    if (n > UPL_MAXPERREQ) { n = UPL_MAXPERREQ; }
+    if (n > (UPL_QUEUELEN - qhead)) { n = UPL_QUEUELEN - qhead; }
+    if (submit_to_wpd_batch(n, &queue[qhead], now) != 0) {
+      ESP_LOGW("uplink.c", "Submitting %d samples failed, %d stay queued.", n, qcount);
+      return 1;
+    }
+    qhead = (qhead + n) % UPL_QUEUELEN;
+    qcount -= n;
+  }
+  return 0;
+}
+
+void upl_shifttimes(time_t delta)
+{
+  for (int i = 0; i < qcount; i++) {
+    queue[(qhead + i) % UPL_QUEUELEN].ts += delta;
+  }
+  if (cursample != NULL) {
+    cursample->ts += delta;
+  }
+}
+
+int upl_getbatchsize(void)
+{
+  return batchsize;
+}
+
+int upl_setbatchsize(int n)
+{
+  if ((n < 1) || (n > UPL_MAXBATCH)) {
+    return 1;
+  }
+  batchsize = n;
+  nvs_handle_t nvsh;
+  if (nvs_open(UPLNVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+    ESP_LOGE("uplink.c", "Failed to open NVS for saving settings.");
+    return 1;
+  }
+  esp_err_t e = nvs_set_u8(nvsh, "batch", batchsize);
+  if (e == ESP_OK) { e = nvs_commit(nvsh); }
+  nvs_close(nvsh);
+  if (e != ESP_OK) {
+    ESP_LOGE("uplink.c", "Failed to save settings to NVS: %s", esp_err_to_name(e));
+    return 1;
+  }
+  return 0;
+}
+
+unsigned int upl_getdropped(void)
+{
+  return dropped;
+}
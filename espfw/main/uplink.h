@@ -0,0 +1,51 @@
+
+/* Batched uplink: Measurements are timestamped and queued here, and
+ * only sent out every few cycles, all in one go. Waking the modem and
+ * attaching to the network costs far more energy than the data. */
+
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include <time.h>
+
+/* Number of samples (= measurement cycles) we can queue. */
+#define UPL_QUEUELEN 64
+
+/* Loads the configured batch size from NVS. */
+void upl_init(void);
+
+/* Starts a new sample with the given timestamp. If the queue is full,
+ * the oldest sample is dropped. */
+void upl_begin(time_t ts);
+/* Adds a value to the sample started with upl_begin. sensorid needs
+ * to be a string constant, it is not copied. Values for an empty
+ * sensorid (not configured) are ignored. */
+void upl_add(char * sensorid, float value);
+/* Finishes the sample. Samples without values are discarded. */
+void upl_commit(void);
+
+/* Returns the number of queued samples. */
+int upl_count(void);
+/* Returns 1 if an upload is due: we have at least batchsize samples,
+ * or the queue is almost full. Unless WPD_HONOURSTIMESTAMPS is set
+ * (see submit.h), batchsize is ignored and every cycle uploads. */
+int upl_due(int batchsize);
+
+/* Sends all queued samples. The modem needs to be online. Returns 0
+ * on success, i.e. if the server replied with a 2xx status. Samples
+ * that could not be sent stay queued. */
+int upl_flush(void);
+
+/* Shifts the timestamps of all queued samples by delta seconds. This
+ * is needed when the clock was stepped, e.g. on the first time sync. */
+void upl_shifttimes(time_t delta);
+
+/* The configured batch size (upload every N cycles), settable in the
+ * admin interface and stored in NVS. */
+int upl_getbatchsize(void);
+int upl_setbatchsize(int n);
+
+/* For statistics */
+unsigned int upl_getdropped(void);
+
+#endif /* _UPLINK_H_ */
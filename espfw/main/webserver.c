@@ -1,11 +1,27 @@
 
 #include <esp_http_server.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <math.h>
+#include <stdlib.h>
 #include <time.h>
 #include "webserver.h"
+#include "boost.h"
+#include "breaker.h"
+#include "energy.h"
+#include "i2c.h"
+#include "ltr390.h"
 #include "mobilenet.h"
+#include "modemsup.h"
+#include "opsel.h"
+#include "pcounters.h"
+#include "sched.h"
 #include "secrets.h"
+#include "sen50.h"
+#include "sht4x.h"
+#include "timesync.h"
+#include "uplink.h"
+#include "windsens.h"
 
 /* These are in main.c */
 extern struct ev evs[2];
@@ -28,6 +44,7 @@ This is the debug interface for Foxis Mobile Weather station.<br>
 <a href="/sensorshtml">Current sensor values as HTML table</a><br>
 <a href="/json">Current sensor values as JSON</a><br>
 <a href="/mobilestate">Mobile network state</a><br>
+<a href="/diag">Diagnostics</a><br>
 <br>
 Log in to Admin Interface:<br>
 <form action="/adminmenu" method="POST">
@@ -78,6 +95,21 @@ static const char mobstahtml_p2[] = R"EOMSHTP2(
 </body></html>
 )EOMSHTP2";
 
+static const char diaghtml_p1[] = R"EODIAGHTP1(
+<!DOCTYPE html>
+
+<html><head><title>Foxis Mobile Weather station - diagnostics</title>
+<link rel="stylesheet" type="text/css" href="/css">
+</head><body>
+<h1>Foxis Mobile WS - diagnostics</h1>
+Please note that this page does not update automatically - you need to
+hit the reload button in your browser.<br>
+)EODIAGHTP1";
+
+static const char diaghtml_p2[] = R"EODIAGHTP2(
+</body></html>
+)EODIAGHTP2";
+
 static const char admmenhtml_p1[] = R"EOADMMHTP1(
 <!DOCTYPE html>
 
@@ -114,12 +146,37 @@ static const char admmenhtml_p3[] = R"EOADMMHTP3(
 <option value="1">Reset LTE modem and reboot ESP32</option>
 <option value="2">Reboot ESP32 without resetting LTE modem</option>
 <option value="3">Turn off WiFi</option>
+<option value="4">Upload every value cycles (batch size, 1-60)</option>
+<option value="5">LTR390 profile (value 0 = fast, 1 = normal, 2 = precise)</option>
 </select>
+value: <input type="text" name="value" size="5">
 <input type="submit" name="su" value="Execute">
 </form></br>
-</body></html>
+<h2>Wind sensor modbus configuration</h2>
+Note that changes to address or baudrate of a sensor only take effect after
+the sensor has been power-cycled. Scanning takes about 150 ms per address.<br>
+<form action="/adminmodbus" method="POST">
 )EOADMMHTP3";
 
+static const char admmenhtml_p4[] = R"EOADMMHTP4(
+<select name="op">
+<option value="scan">Scan bus (addr to addr2)</option>
+<option value="readreg">Read register reg at addr</option>
+<option value="writereg">Write value to register reg at addr</option>
+<option value="setaddr">Change address of sensor addr to value</option>
+<option value="sensorbaud">Change baudrate of sensor addr to value</option>
+<option value="localbaud">Change our baudrate on the bus to value</option>
+<option value="assign">Use addr for direction and addr2 for speed sensor</option>
+</select><br>
+addr: <input type="text" name="addr" size="5">
+addr2: <input type="text" name="addr2" size="5">
+reg: <input type="text" name="reg" size="7">
+value: <input type="text" name="value" size="7">
+<input type="submit" name="su" value="Execute">
+</form></br>
+</body></html>
+)EOADMMHTP4";
+
 /* *******************************************************************
    ****** end   string definition, mostly for embedded webpages ******
    ******************************************************************* */
@@ -190,10 +247,13 @@ static char * printallsensors(int t, char * pfp)
   pfp = printonefloatsensor(t, pfp, "temp",      "%.2f", evs[e].temp);
   pfp = printonefloatsensor(t, pfp, "hum",       "%.1f", evs[e].hum);
   pfp = printonefloatsensor(t, pfp, "press",     "%.3f", evs[e].press);
+  pfp = printonefloatsensor(t, pfp, "pressvar",  "%.5f", evs[e].pressvar);
   pfp = printonefloatsensor(t, pfp, "windspeed", "%.1f", evs[e].windspeed);
   pfp = printonefloatsensor(t, pfp, "winddir",   "%.1f", evs[e].winddirdeg);
   pfp = printonefloatsensor(t, pfp, "batvolt",   "%.2f", evs[e].batvolt);
+  pfp = printonefloatsensor(t, pfp, "batsag",    "%.3f", evs[e].batsag);
   pfp = printonefloatsensor(t, pfp, "raingc",    "%.3f", evs[e].raingc);
+  pfp = printonefloatsensor(t, pfp, "rainrate",  "%.2f", evs[e].rainrate);
   pfp = printonefloatsensor(t, pfp, "pm010",     "%.1f", evs[e].pm010);
   pfp = printonefloatsensor(t, pfp, "pm025",     "%.1f", evs[e].pm025);
   pfp = printonefloatsensor(t, pfp, "pm040",     "%.1f", evs[e].pm040);
@@ -252,22 +312,64 @@ static httpd_uri_t uri_getjson = {
   .user_ctx = NULL
 };
 
+static const char * actname(int act)
+{
+  switch (act) {
+    case 0: return "GSM";
+    case 3: return "EDGE";
+    case 7: return "LTE-M";
+    case 9: return "NB-IoT";
+    default: return "unknown";
+  }
+}
+
+static char * printmninfo(char * pfp, const struct mninfo * mi)
+{
+  pfp += sprintf(pfp, "<tr><td>%lld</td><td>%lu</td><td>%s</td><td>%lx</td><td>%lx</td>",
+                      (long long)mi->ts, mi->plmn, actname(mi->act), mi->tac, mi->ci);
+  pfp += sprintf(pfp, "<td>%.0f dBm</td><td>%.1f dB</td><td>%.0f dBm</td><td>%ld ms</td></tr>",
+                      mi->rsrp, mi->rsrq, mi->rxlev, mi->attachms);
+  return pfp;
+}
+
 esp_err_t get_mobilestate_handler(httpd_req_t * req)
 {
-  char myresponse[sizeof(mobstahtml_p1) + sizeof(mobstahtml_p2) + MOSTLEN + 500];
+  /* With the history, this no longer fits on the stack. */
+  char * myresponse = malloc(sizeof(mobstahtml_p1) + sizeof(mobstahtml_p2) + 600 + (MN_INFOHISTLEN * 150));
+  if (myresponse == NULL) {
+    httpd_resp_set_status(req, "500 Internal Server Error");
+    httpd_resp_send(req, "Out of memory.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
   char * pfp; /* Pointer for (s)printf */
   int e = activeevs;
   strcpy(myresponse, mobstahtml_p1);
   pfp = myresponse + strlen(myresponse);
   pfp += sprintf(pfp, "lastupdate TS: %lld (%lld seconds ago)<br>",
                       evs[e].lastupd, (time(NULL) - evs[e].lastupd));
-  pfp += sprintf(pfp, "status:<br><pre>%s</pre>", evs[e].modemstatus);
+  const struct mninfo * mi = &evs[e].mninfo;
+  if (mi->ts == 0) {
+    pfp += sprintf(pfp, "No upload since boot.<br>");
+  } else {
+    pfp += sprintf(pfp, "At the last upload (%lld): operator %lu, %s, TAC %lx, cell ID %lx<br>",
+                        (long long)mi->ts, mi->plmn, actname(mi->act), mi->tac, mi->ci);
+    pfp += sprintf(pfp, "RSRP %.0f dBm, RSRQ %.1f dB, RxLev %.0f dBm, attach took %ld ms<br>",
+                        mi->rsrp, mi->rsrq, mi->rxlev, mi->attachms);
+  }
+  pfp += sprintf(pfp, "<h2>History</h2>");
+  pfp += sprintf(pfp, "<table><tr><th>TS</th><th>Operator</th><th>act</th><th>TAC</th>");
+  pfp += sprintf(pfp, "<th>Cell ID</th><th>RSRP</th><th>RSRQ</th><th>RxLev</th><th>Attach took</th></tr>");
+  for (int i = 0; mn_getmninfohist(i) != NULL; i++) {
+    pfp = printmninfo(pfp, mn_getmninfohist(i));
+  }
+  pfp += sprintf(pfp, "</table>");
   strcpy(pfp, mobstahtml_p2);
   /* The following two lines are the default und thus redundant. */
   httpd_resp_set_status(req, "200 OK");
   httpd_resp_set_type(req, "text/html");
   httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
   httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+  free(myresponse);
   return ESP_OK;
 }
 
@@ -278,6 +380,252 @@ static httpd_uri_t uri_getmobilestate = {
   .user_ctx = NULL
 };
 
+static char * printi2cstats(char * pfp)
+{
+  const uint32_t lathistlimits[I2C_LATHISTBUCKETS - 1] = I2C_LATHISTLIMITS;
+  pfp += sprintf(pfp, "<h2>I2C</h2>");
+  pfp += sprintf(pfp, "Bus recoveries since boot: port 0: %lu, port 1: %lu<br>",
+                      i2c_getrecoveries(I2C_NUM_0), i2c_getrecoveries(I2C_NUM_1));
+  pfp += sprintf(pfp, "<table><tr><th>device</th><th>port</th><th>addr</th>"
+                      "<th>transactions</th><th>errors</th><th>timeouts</th>"
+                      "<th>fails in a row</th>");
+  for (int b = 0; b < I2C_LATHISTBUCKETS; b++) {
+    if (b < (I2C_LATHISTBUCKETS - 1)) {
+      pfp += sprintf(pfp, "<th>&lt;%lu us</th>", lathistlimits[b]);
+    } else {
+      pfp += sprintf(pfp, "<th>slower</th>");
+    }
+  }
+  pfp += sprintf(pfp, "</tr>");
+  struct i2cdev * d;
+  for (int i = 0; (d = i2c_getdev(i)) != NULL; i++) {
+    pfp += sprintf(pfp, "<tr><th>%s</th><td>%d</td><td>0x%02x</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td>",
+                        d->name, d->port, d->addr, d->ntrans, d->nerr, d->ntimeout, d->consecfails);
+    for (int b = 0; b < I2C_LATHISTBUCKETS; b++) {
+      pfp += sprintf(pfp, "<td>%lu</td>", d->lathist[b]);
+    }
+    pfp += sprintf(pfp, "</tr>");
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+static char * printbreakers(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Sensor circuit breakers</h2>");
+  pfp += sprintf(pfp, "<table><tr><th>sensor</th><th>found at startup</th>"
+                      "<th>state</th><th>fails in a row</th><th>trips</th>"
+                      "<th>skipped reads</th></tr>");
+  struct breaker * b;
+  for (int i = 0; (b = brk_get(i)) != NULL; i++) {
+    pfp += sprintf(pfp, "<tr><th>%s</th><td>%s</td>", b->name, (b->present ? "yes" : "no"));
+    if (b->backoff > 0) {
+      pfp += sprintf(pfp, "<td>open (%lu s)</td>", b->backoff);
+    } else {
+      pfp += sprintf(pfp, "<td>closed</td>");
+    }
+    pfp += sprintf(pfp, "<td>%lu</td><td>%lu</td><td>%lu</td></tr>",
+                        b->failsinrow, b->trips, b->skipped);
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+static char * printsched(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Scheduler</h2><table><tr><th>Job</th><th>Period</th>");
+  pfp += sprintf(pfp, "<th>Runs</th><th>Missed</th><th>Jitter last/avg/max</th></tr>");
+  struct schedjob * j;
+  for (int i = 0; (j = sched_get(i)) != NULL; i++) {
+    pfp += sprintf(pfp, "<tr><td>%s</td><td>%lld ms</td><td>%lu</td><td>%lu</td>",
+                        j->name, j->period / 1000, j->runs, j->missed);
+    pfp += sprintf(pfp, "<td>%lld / %lld / %lld ms</td></tr>",
+                        j->lastjitter / 1000, j->avgjitter / 1000, j->maxjitter / 1000);
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+static char * printsht4xstats(char * pfp)
+{
+  struct sht4xheatstats st;
+  sht4x_getheatstats(&st);
+  int64_t uptime = esp_timer_get_time() / 1000;
+  pfp += sprintf(pfp, "<h2>SHT4x heater</h2>");
+  pfp += sprintf(pfp, "Heater cycles since boot: %lu, total on-time: %lu ms, duty cycle: %.4f%%<br>",
+                      st.ncycles, st.heatms,
+                      ((uptime > 0) ? ((double)st.heatms * 100.0 / (double)uptime) : 0.0));
+  if (st.ncycles > 0) {
+    pfp += sprintf(pfp, "Last heater cycle: %lld seconds ago<br>",
+                        (esp_timer_get_time() - st.lastcycle) / 1000000);
+  }
+  pfp += sprintf(pfp, "Readings discarded during cool-down: %lu<br>", st.blanked);
+  return pfp;
+}
+
+static char * printsensorcfg(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Sensor settings</h2>");
+  pfp += sprintf(pfp, "LTR390 profile: %s<br>", ltr390_getprofilename(ltr390_getprofile()));
+  pfp += sprintf(pfp, "SEN50 reading interval: %d s<br>", sen50_sched_getinterval());
+  return pfp;
+}
+
+static char * printenergy(char * pfp)
+{
+  struct enstate st;
+  en_getstate(&st);
+  const struct enprofile * p = en_getprofile();
+  pfp += sprintf(pfp, "<h2>Energy governor</h2>");
+  pfp += sprintf(pfp, "Profile: %s (since %lld, %u changes since boot)<br>",
+                      p->name, st.since, st.transitions);
+  pfp += sprintf(pfp, "Upload every %d cycles, SEN50 %s<br>",
+                      p->uploadevery, (p->sen50on ? "on" : "off"));
+  pfp += sprintf(pfp, "Battery: %.2f V, trend %+.3f V/h<br>", st.voltage, st.trend);
+  return pfp;
+}
+
+static char * printmodemsup(char * pfp)
+{
+  struct mnhealth h;
+  mn_gethealth(&h);
+  pfp += sprintf(pfp, "<h2>Modem recovery</h2>");
+  pfp += sprintf(pfp, "Current level: %s<br>", mns_getstats(mns_getlevel())->name);
+  pfp += sprintf(pfp, "AT timeouts: %u (%u in a row), unexpected reboots: %u<br>",
+                      h.timeouts, h.consecutivetimeouts, h.greetings);
+  struct mnnetstate ns;
+  mn_getnetstate(&ns);
+  pfp += sprintf(pfp, "Registration: LTE %d, GPRS %d, act %d, PDP %s, IP '%s', last attach took %ld ms<br>",
+                      ns.epsreg, ns.gprsreg, ns.act, (ns.pdpactive ? "active" : "inactive"),
+                      ns.ipaddr, ns.attachms);
+  pfp += sprintf(pfp, "<table><tr><th>Action</th><th>Taken</th><th>Recovered</th>");
+  pfp += sprintf(pfp, "<th>Time to recover last/max</th></tr>");
+  for (int i = MNS_LVL_PROBE; i < MNS_NUMLEVELS; i++) {
+    const struct mnslevelstats * s = mns_getstats(i);
+    pfp += sprintf(pfp, "<tr><td>%s</td><td>%u</td><td>%u</td><td>%lld / %lld s</td></tr>",
+                        s->name, s->actions, s->recoveries,
+                        (long long)s->lastttr, (long long)s->maxttr);
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+static char * printopsel(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Operators</h2>");
+  pfp += sprintf(pfp, "Selection: %s<br>", (ops_getmanual() ? "manual (admin)" : "automatic"));
+  pfp += sprintf(pfp, "<table><tr><th>Operator</th><th>act</th><th>Attaches</th>");
+  pfp += sprintf(pfp, "<th>Failed first tries</th><th>Submits ok/failed</th>");
+  pfp += sprintf(pfp, "<th>Avg. time to IP</th><th>Avg. signal</th></tr>");
+  for (int i = 0; ops_get(i) != NULL; i++) {
+    const struct opstat * o = ops_get(i);
+    pfp += sprintf(pfp, "<tr><td>%lu</td><td>%d</td><td>%lu</td><td>%lu</td><td>%lu / %lu</td>",
+                        (unsigned long)o->plmn, o->act, (unsigned long)o->attaches,
+                        (unsigned long)o->preffails, (unsigned long)o->submitok,
+                        (unsigned long)o->submitfail);
+    pfp += sprintf(pfp, "<td>%.1f s</td><td>%.0f dBm</td></tr>",
+                        o->attachms / 1000.0, o->signal);
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+static char * printboost(char * pfp)
+{
+  struct bststate st;
+  bst_getstate(&st);
+  pfp += sprintf(pfp, "<h2>Sampling boost</h2>");
+  pfp += sprintf(pfp, "%s, %u boosts since boot<br>",
+                      (st.active ? "Boosted" : "Normal rates"), st.nboosts);
+  if (st.nboosts > 0) {
+    pfp += sprintf(pfp, "Last boost since %lld, triggers:%s%s%s%s, last trigger %lld<br>",
+                        (long long)st.since,
+                        ((st.triggers & BST_RAINSTART) ? " rain" : ""),
+                        ((st.triggers & BST_PRESSDROP) ? " pressure" : ""),
+                        ((st.triggers & BST_GUST) ? " gust" : ""),
+                        ((st.triggers & BST_TEMPSWING) ? " temperature" : ""),
+                        (long long)st.lasttrigger);
+  }
+  pfp += sprintf(pfp, "Pressure tendency %+.2f hPa/h, temperature swing %.1f degC<br>",
+                      st.pressrate, st.tempswing);
+  return pfp;
+}
+
+static char * printtimesync(char * pfp)
+{
+  struct tsstate st;
+  ts_getstate(&st);
+  pfp += sprintf(pfp, "<h2>Time</h2>");
+  if (!st.synced) {
+    pfp += sprintf(pfp, "Not synced since boot, clock is at %lld<br>", (long long)time(NULL));
+    return pfp;
+  }
+  pfp += sprintf(pfp, "Last sync: %lld, offset was %.1f s<br>", (long long)st.lastsync, st.lastoffset);
+  pfp += sprintf(pfp, "Drift estimate: %.0f ppm, %u syncs (%u steps) since boot<br>",
+                      st.drift, st.nsyncs, st.nsteps);
+  return pfp;
+}
+
+static char * printuplink(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Uplink</h2>");
+  pfp += sprintf(pfp, "Batch size: %d, queued samples: %d of %d, dropped: %u<br>",
+                      upl_getbatchsize(), upl_count(), UPL_QUEUELEN, upl_getdropped());
+  return pfp;
+}
+
+static char * printpcounters(char * pfp)
+{
+  pfp += sprintf(pfp, "<h2>Persistent counters</h2><table>");
+  for (int i = 0; i < PC_NUMCOUNTERS; i++) {
+    pfp += sprintf(pfp, "<tr><th>%s</th><td>%lu</td></tr>",
+                        pcounters_getname(i), pcounters_get(i));
+  }
+  pfp += sprintf(pfp, "</table>");
+  return pfp;
+}
+
+esp_err_t get_diag_handler(httpd_req_t * req)
+{
+  /* This page keeps growing, so it no longer fits on the stack. */
+  char * myresponse = malloc(sizeof(diaghtml_p1) + sizeof(diaghtml_p2) + 12000);
+  if (myresponse == NULL) {
+    httpd_resp_set_status(req, "500 Internal Server Error");
+    httpd_resp_send(req, "Out of memory.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  char * pfp; /* Pointer for (s)printf */
+  strcpy(myresponse, diaghtml_p1);
+  pfp = myresponse + strlen(myresponse);
+  pfp = printi2cstats(pfp);
+  pfp = printbreakers(pfp);
+  pfp = printsched(pfp);
+  pfp = printsht4xstats(pfp);
+  pfp = printsensorcfg(pfp);
+  pfp = printenergy(pfp);
+  pfp = printboost(pfp);
+  pfp = printmodemsup(pfp);
+  pfp = printopsel(pfp);
+  pfp = printtimesync(pfp);
+  pfp = printuplink(pfp);
+  pfp = printpcounters(pfp);
+  strcpy(pfp, diaghtml_p2);
+  /* The following two lines are the default und thus redundant. */
+  httpd_resp_set_status(req, "200 OK");
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
+  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+  free(myresponse);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_getdiag = {
+  .uri      = "/diag",
+  .method   = HTTP_GET,
+  .handler  = get_diag_handler,
+  .user_ctx = NULL
+};
+
 /* Unescapes a x-www-form-urlencoded string.
  * Modifies the string inplace! */
 void unescapeuestring(char * s) {
@@ -337,7 +685,7 @@ int parsepostandcheckauth(httpd_req_t * req, char * postcontent)
 
 esp_err_t post_adminmenu(httpd_req_t * req) {
   char postcontent[POSTCONTMAXLEN];
-  char myresponse[3000];
+  char myresponse[4500];
   char * pfp; /* Pointer for (s)printf */
   if (parsepostandcheckauth(req, postcontent) != 0) {
     return ESP_OK;
@@ -349,6 +697,13 @@ esp_err_t post_adminmenu(httpd_req_t * req) {
   pfp = myresponse + strlen(myresponse);
   pfp += sprintf(pfp, "<input type=\"hidden\" name=\"adminpw\" value=\"%s\">", MOBILEWS_WEBIFADMINPW);
   strcpy(pfp, admmenhtml_p3);
+  pfp = myresponse + strlen(myresponse);
+  uint8_t wdad; uint8_t wsad; long wsbaud;
+  windsens_getsettings(&wdad, &wsad, &wsbaud);
+  pfp += sprintf(pfp, "Current settings: direction sensor at %u (0x%02x), speed sensor at %u (0x%02x), %ld baud<br>",
+                      wdad, wdad, wsad, wsad, wsbaud);
+  pfp += sprintf(pfp, "<input type=\"hidden\" name=\"adminpw\" value=\"%s\">", MOBILEWS_WEBIFADMINPW);
+  strcpy(pfp, admmenhtml_p4);
   /* The following two lines are the default und thus redundant. */
   httpd_resp_set_status(req, "200 OK");
   httpd_resp_set_type(req, "text/html");
@@ -387,6 +742,7 @@ esp_err_t post_adminqueuecmd(httpd_req_t * req) {
     }
     if (strcmp(operator, "NULL") == 0) {
       res = mn_queuecommand("AT+COPS=0,0\r\n");
+      if (res == 0) { ops_setmanual(0); }
     } else {
       char permanent[20];
       char cmdtoq[40];
@@ -396,6 +752,8 @@ esp_err_t post_adminqueuecmd(httpd_req_t * req) {
       sprintf(cmdtoq, "AT+COPS=%d,2,\"%s\"\r\n",
                       (strcmp(permanent, "1") == 0) ? 1 : 4, operator);
       res = mn_queuecommand(cmdtoq);
+      /* Don't let the automatic operator selection undo this. */
+      if (res == 0) { ops_setmanual(1); }
     }
     httpd_resp_set_status(req, "200 OK");
     httpd_resp_set_type(req, "text/html");
@@ -423,6 +781,23 @@ static httpd_uri_t uri_postadminqueuecmd = {
   .user_ctx = NULL
 };
 
+/* Helper for the admin POST handlers: fetches a numeric parameter from the
+ * POST content. Accepts decimal and (with 0x prefix) hex.
+ * Returns 0 on success. */
+static int getnumparam(char * postcontent, char * name, long * val)
+{
+  char tmp[20];
+  char * ep;
+  if (httpd_query_key_value(postcontent, name, tmp, sizeof(tmp)) != ESP_OK) {
+    return 1;
+  }
+  *val = strtol(tmp, &ep, 0);
+  if ((ep == tmp) || (*ep != 0)) {
+    return 1;
+  }
+  return 0;
+}
+
 esp_err_t post_adminmisccmd(httpd_req_t * req) {
   char postcontent[POSTCONTMAXLEN];
   char cmd[20];
@@ -441,7 +816,9 @@ esp_err_t post_adminmisccmd(httpd_req_t * req) {
     if (strcmp(cmd, "1") == 0) {
       ESP_LOGE("webserver.c", "powercycling modem...");
       mn_powercycleltemodem();
+      pcounters_inc(PC_MODEMPOWERCYCLES);
     }
+    pcounters_commit(1);
     ESP_LOGE("webserver.c", "Now rebooting the ESP32...");
     esp_restart();
     /* This should not be reached. */
@@ -457,6 +834,34 @@ esp_err_t post_adminmisccmd(httpd_req_t * req) {
     const char myresponse[] = "OK, WiFi will turn off on next main loop iteration.";
     httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
+  } else if (strcmp(cmd, "4") == 0) { /* Set upload batch size */
+    long value = -1;
+    if ((getnumparam(postcontent, "value", &value) != 0)
+     || (upl_setbatchsize(value) != 0)) {
+      httpd_resp_set_status(req, "400 Bad Request");
+      const char myresponse[] = "Invalid or unsaveable batch size.";
+      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
+    httpd_resp_set_status(req, "200 OK");
+    httpd_resp_set_type(req, "text/html");
+    const char myresponse[] = "OK, batch size saved.";
+    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  } else if (strcmp(cmd, "5") == 0) { /* Set LTR390 measurement profile */
+    long value = -1;
+    if ((getnumparam(postcontent, "value", &value) != 0)
+     || (ltr390_setprofile(value) != 0)) {
+      httpd_resp_set_status(req, "400 Bad Request");
+      const char myresponse[] = "Invalid or unsaveable LTR390 profile.";
+      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
+    httpd_resp_set_status(req, "200 OK");
+    httpd_resp_set_type(req, "text/html");
+    const char myresponse[] = "OK, LTR390 profile saved.";
+    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
   } else {
     httpd_resp_set_status(req, "400 Bad Request");
     const char myresponse[] = "No valid mode selected.";
@@ -473,6 +878,75 @@ static httpd_uri_t uri_postadminmisccmd = {
   .user_ctx = NULL
 };
 
+esp_err_t post_adminmodbus(httpd_req_t * req) {
+  char postcontent[POSTCONTMAXLEN];
+  char op[20];
+  char resbuf[1500];
+  char * pfp = resbuf;
+  long addr = -1; long addr2 = -1; long reg = -1; long value = -1;
+  int res = -1;
+  if (parsepostandcheckauth(req, postcontent) != 0) {
+    return ESP_OK;
+  }
+  if (httpd_query_key_value(postcontent, "op", op, sizeof(op)) != ESP_OK) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    const char myresponse[] = "No operation selected.";
+    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  getnumparam(postcontent, "addr", &addr);
+  getnumparam(postcontent, "addr2", &addr2);
+  getnumparam(postcontent, "reg", &reg);
+  getnumparam(postcontent, "value", &value);
+  if (strcmp(op, "scan") == 0) {
+    uint8_t found[32];
+    if (addr < 1) { addr = 1; }
+    if ((addr2 < addr) || (addr2 > 247)) { addr2 = 247; }
+    res = windsens_scanbus(addr, addr2, found, sizeof(found));
+    pfp += sprintf(pfp, "Scanned addresses %ld to %ld, %d device(s) replied:", addr, addr2, res);
+    for (int i = 0; (i < res) && (i < sizeof(found)); i++) {
+      pfp += sprintf(pfp, " %u (0x%02x)", found[i], found[i]);
+    }
+    res = 0;
+  } else if ((strcmp(op, "readreg") == 0) && (addr >= 0) && (addr <= 247) && (reg >= 0) && (reg <= 0xffff)) {
+    uint16_t v;
+    res = windsens_readreg(addr, reg, &v);
+    if (res == 0) {
+      pfp += sprintf(pfp, "Register 0x%04lx at device %ld contains %u (0x%04x).", reg, addr, v, v);
+    }
+  } else if ((strcmp(op, "writereg") == 0) && (addr >= 0) && (addr <= 247) && (reg >= 0) && (reg <= 0xffff)
+          && (value >= 0) && (value <= 0xffff)) {
+    res = windsens_writereg(addr, reg, value);
+  } else if ((strcmp(op, "setaddr") == 0) && (addr >= 0) && (addr <= 247) && (value >= 0) && (value <= 247)) {
+    res = windsens_setsensoraddr(addr, value);
+  } else if ((strcmp(op, "sensorbaud") == 0) && (addr >= 0) && (addr <= 247)) {
+    res = windsens_setsensorbaud(addr, value);
+  } else if (strcmp(op, "localbaud") == 0) {
+    res = windsens_setlocalbaud(value);
+  } else if ((strcmp(op, "assign") == 0) && (addr >= 0) && (addr <= 247) && (addr2 >= 0) && (addr2 <= 247)) {
+    res = windsens_setaddrs(addr, addr2);
+  } else {
+    httpd_resp_set_status(req, "400 Bad Request");
+    const char myresponse[] = "No valid operation or parameters selected.";
+    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  if (pfp == resbuf) {
+    pfp += sprintf(pfp, "%s", ((res == 0) ? "Operation succeeded." : "Operation failed."));
+  }
+  httpd_resp_set_status(req, "200 OK");
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_send(req, resbuf, HTTPD_RESP_USE_STRLEN);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_postadminmodbus = {
+  .uri      = "/adminmodbus",
+  .method   = HTTP_POST,
+  .handler  = post_adminmodbus,
+  .user_ctx = NULL
+};
+
 
 void webserver_start(void)
 {
@@ -482,6 +956,8 @@ void webserver_start(void)
   config.server_port = 80;
   /* The default is undocumented, but seems to be only 4k. */
   config.stack_size = 10000;
+  /* The default of 8 is not enough for all our pages. */
+  config.max_uri_handlers = 16;
   ESP_LOGI("webserver.c", "Starting webserver on port %d", config.server_port);
   if (httpd_start(&server, &config) != ESP_OK) {
     ESP_LOGE("webserver.c", "Failed to start HTTP server.");
@@ -489,11 +965,13 @@ void webserver_start(void)
   }
   httpd_register_uri_handler(server, &uri_startpage);
   httpd_register_uri_handler(server, &uri_getcss);
+  httpd_register_uri_handler(server, &uri_getdiag);
   httpd_register_uri_handler(server, &uri_getjson);
   httpd_register_uri_handler(server, &uri_getmobilestate);
   httpd_register_uri_handler(server, &uri_getsensorshtml);
   httpd_register_uri_handler(server, &uri_postadminmenu);
   httpd_register_uri_handler(server, &uri_postadminqueuecmd);
   httpd_register_uri_handler(server, &uri_postadminmisccmd);
+  httpd_register_uri_handler(server, &uri_postadminmodbus);
 }
 
@@ -4,8 +4,8 @@
 #ifndef _WEBSERVER_H_
 #define _WEBSERVER_H_
 
-/* How much memory we reserve for the reported modem status */
-#define MOSTLEN 2048
+#include <time.h>
+#include "mobilenet.h"
 
 /* This struct is used to provide data to us.
  * "ev" as in _E_xported _V_alues */
@@ -13,9 +13,12 @@ struct ev {
   time_t lastupd;
   float amblight; /* Ambient Light */
   float batvolt;
+  float batsag; /* How much the battery voltage drops while the modem is active */
   float hum;
   float press;
+  float pressvar; /* Variance of the pressure samples within the last cycle */
   float raingc; /* Rain Gauge Counter */
+  float rainrate; /* mm/h */
   float pm010;  /* Particulate matter 1.0 */
   float pm025;
   float pm040;
@@ -24,7 +27,7 @@ struct ev {
   float uvind;  /* UV Index */
   float windspeed;
   float winddirdeg;
-  char modemstatus[MOSTLEN];
+  struct mninfo mninfo; /* mobile network state at the last upload */
 };
 
 /* Initialize and start the Webserver. */
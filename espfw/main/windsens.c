@@ -5,6 +5,9 @@
 
 #include <driver/gpio.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <nvs.h>
 #include <time.h>
 #include "windsens.h"
 #include "wk2132.h"
@@ -21,14 +24,42 @@ static uint8_t windsensport;
  * and the wind speed sensor unfortunately is 0x02, meaning they
  * cannot coexist on the RS485-Modbus in factory config. At least
  * one of them will need to be reprogrammed before they can be
- * used together. See windsens_init() for one ugly way to do that. */
+ * used together. This can be done through the admin webinterface
+ * (see windsens_setsensoraddr()). */
 
-/* What modbus-address does the wind direction sensor use? */
+/* What modbus-address does the wind direction sensor use by default?
+ * This can be overridden at runtime, the setting is stored in NVS. */
 #define WDAD 0x23
 
-/* What modbus-address does the wind speed sensor use? */
+/* What modbus-address does the wind speed sensor use by default? */
 #define WSAD 0x02
 
+/* Baudrate that is used on the modbus unless something else has been
+ * configured. 9600 is the factory default of both sensors. */
+#define WSDEFBAUD 9600
+
+/* Holding registers in the sensors that contain their config.
+ * Changes to these only take effect after the sensor has been
+ * power-cycled. */
+#define WSREG_SLAVEADDR 0x1000
+#define WSREG_BAUDRATE  0x1001
+
+/* How long do we wait for a reply from a sensor during normal
+ * operation, and how long during a bus scan (in milliseconds). */
+#define WSREPLYTIMEOUT 3000
+#define WSSCANTIMEOUT  150
+
+/* The NVS namespace we store our settings in */
+#define WSNVSNAMESPACE "windsens"
+
+static uint8_t wdad = WDAD;
+static uint8_t wsad = WSAD;
+static long windsensbaud = WSDEFBAUD;
+
+/* Translation table between baudrate and the value that needs to be
+ * written into WSREG_BAUDRATE, according to the DFRobot docs. */
+static const long sensorbaudrates[] = { 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+
 static void switchtoRX(void)
 {
   /* Set to input */
@@ -62,6 +93,41 @@ static uint16_t crc16_mb(uint8_t * buf, int len)
   return crc;
 }
 
+static void loadsettings(void)
+{
+  nvs_handle_t nvsh;
+  if (nvs_open(WSNVSNAMESPACE, NVS_READONLY, &nvsh) != ESP_OK) {
+    /* Nothing stored yet - that is perfectly normal, use the defaults. */
+    return;
+  }
+  uint8_t u8; int32_t i32;
+  if (nvs_get_u8(nvsh, "wdad", &u8) == ESP_OK) { wdad = u8; }
+  if (nvs_get_u8(nvsh, "wsad", &u8) == ESP_OK) { wsad = u8; }
+  if (nvs_get_i32(nvsh, "baud", &i32) == ESP_OK) { windsensbaud = i32; }
+  nvs_close(nvsh);
+  ESP_LOGI("windsens.c", "Settings: direction sensor at 0x%02x, speed sensor at 0x%02x, %ld baud",
+                         wdad, wsad, windsensbaud);
+}
+
+static int savesettings(void)
+{
+  nvs_handle_t nvsh;
+  if (nvs_open(WSNVSNAMESPACE, NVS_READWRITE, &nvsh) != ESP_OK) {
+    ESP_LOGE("windsens.c", "Failed to open NVS for saving settings.");
+    return 1;
+  }
+  esp_err_t e = nvs_set_u8(nvsh, "wdad", wdad);
+  if (e == ESP_OK) { e = nvs_set_u8(nvsh, "wsad", wsad); }
+  if (e == ESP_OK) { e = nvs_set_i32(nvsh, "baud", windsensbaud); }
+  if (e == ESP_OK) { e = nvs_commit(nvsh); }
+  nvs_close(nvsh);
+  if (e != ESP_OK) {
+    ESP_LOGE("windsens.c", "Failed to save settings to NVS: %s", esp_err_to_name(e));
+    return 1;
+  }
+  return 0;
+}
+
 void windsens_init(uint8_t wsp)
 {
   windsensport = wsp;
@@ -74,150 +140,233 @@ void windsens_init(uint8_t wsp)
   };
   ESP_ERROR_CHECK(gpio_config(&diswpi));
   switchtoRX();
-  wk2132_serialportinit(windsensport, 9600); /* Wind sensors run at 9600 baud */
-#if 0
-  /* This bit here reprograms everything that is currently on the modbus to
-   * a different address. For very obvious reasons, this should NOT normally
-   * be compiled in. You need to
-   * - make absolutely sure there is ONLY ONE device connected on the modbus
-   * - set the "#if 0" above to 1, recompile and reflash
-   * - wait till it says it is done
-   * - set the "#if 1" back to 0, recompile and reflash
-   * - power-cycle the sensor.
-   */
-  ESP_LOGI("wk2132.c", "=================================================================");
-  ESP_LOGI("wk2132.c", "= REPROGRAMMING MODBUS ADDRESS - THIS IS NOT A NORMAL FIRMWARE  =");
-  ESP_LOGI("wk2132.c", "=================================================================");
-  uint8_t newad = 0x23;
-  uint8_t reprogrammsg[] = { 0x00,        /* Slave Address, 0 == broadcast to all devices */
-                             0x10,        /* Function code: write multiple registers */
-                             0x10, 0x00,  /* Register start address: 0x1000 (which contains
-                                           * the slave address) */
-                             0x00, 0x01,  /* Length of the write (1x 16 bit) */
-                             0x02,        /* Number of bytes */
-                             0x00, newad, /* The new value to be written - new address in LSB */
-                             0x00, 0x00   /* the CRC (will be filled below) */
-                           };
-  uint16_t crc = crc16_mb(reprogrammsg, 9);
-  reprogrammsg[9] = crc >> 8;
-  reprogrammsg[10] = crc & 0xff;
-  vTaskDelay(pdMS_TO_TICKS(1333)); /* The bus needs to have been idle for a while before we can send */
-  switchtoTX();
-  wk2132_write_serial(windsensport, (const char *)reprogrammsg, sizeof(reprogrammsg));
-  wk2132_flush(windsensport);
-  switchtoRX();
-  int bav;
-  time_t stts = time(NULL);
-  do {
-    vTaskDelay(pdMS_TO_TICKS(333));
-    bav = wk2132_get_available_to_read(windsensport);
-  } while ((bav < 7) && ((time(NULL) - stts) < 10));
-  if (bav >= 7) {
-    uint8_t rbuf[bav];
-    wk2132_read_serial(windsensport, (char *)rbuf, bav);
-    ESP_LOGI("wk2132.c", "Received %u bytes:", bav);
-    for (int i = 0; i < bav; i++) {
-      ESP_LOGI("wk2132.c", " 0x%02x", rbuf[i]);
-    }
-  }
-  ESP_LOGI("wk2132.c", "=== END OF MODBUS ADDRESS REPROGRAMMING ===");
-  ESP_LOGI("wk2132.c", "This will now go into an endless loop. You need to");
-  ESP_LOGI("wk2132.c", "flash proper firmware to the ESP32 again, and then");
-  ESP_LOGI("wk2132.c", "also powercycle the sensor whose address was just changed.");
-  for (int i = 0; i < 999999; i++) {
-    vTaskDelay(pdMS_TO_TICKS(5000));
-  }
-#endif
+  loadsettings();
+  wk2132_serialportinit(windsensport, windsensbaud);
 }
 
-float windsens_getwinddir(void)
+/* Sends a modbus request and waits for a reply of exactly replen bytes.
+ * The CRC is appended to the request by this function, so req needs to
+ * have space for 2 more bytes than reqlen.
+ * Returns the number of bytes received (== replen) if a reply with a valid
+ * CRC was received, or <0 on error / timeout.
+ * The webserver may talk to the modbus while the main loop is querying
+ * the sensors, so this needs to be called with our wk2132 port claimed. */
+static int modbus_transact(uint8_t * req, int reqlen, uint8_t * rep, int replen, int timeoutms)
 {
-  /*                 Addr  Func  RegisterAd  Length____  CRC_______ */
-  uint8_t wsq[8] = { WDAD, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00 };
-  uint16_t crc = crc16_mb(wsq, 6);
-  wsq[6] = (crc >> 8);   /* MSB */
-  wsq[7] = (crc & 0xff); /* LSB */
-  uint8_t rcvbuf[10];
+  uint16_t crc = crc16_mb(req, reqlen);
+  req[reqlen + 0] = (crc >> 8);   /* MSB */
+  req[reqlen + 1] = (crc & 0xff); /* LSB */
   /* First clear anything that is still in the input buffer */
   while (wk2132_get_available_to_read(windsensport) > 0) {
-    wk2132_read_serial(windsensport, (char *)rcvbuf, 1);
+    wk2132_read_serial(windsensport, (char *)rep, 1);
   }
   switchtoTX();
-  wk2132_write_serial(windsensport, (const char *)wsq, sizeof(wsq));
+  wk2132_write_serial(windsensport, (const char *)req, reqlen + 2);
   wk2132_flush(windsensport);
   switchtoRX();
-  /* We expect a reply of exactly 7 bytes, so wait for that with timeout */
-  time_t stts = time(NULL);
+  if (req[0] == 0x00) { /* Broadcast - nobody will reply to that. */
+    return 0;
+  }
+  /* Wait for the reply. We poll in intervals that are roughly what the
+   * reply needs on the wire (10 bits per byte), so at higher baudrates
+   * we also notice the reply sooner. */
+  int pollms = (replen * 10 * 1000) / windsensbaud;
+  if (pollms < 10) { pollms = 10; }
+  int waited = 0;
   int bav;
   do {
-    vTaskDelay(pdMS_TO_TICKS(333));
+    vTaskDelay(pdMS_TO_TICKS(pollms));
+    waited += pollms;
     bav = wk2132_get_available_to_read(windsensport);
-  } while ((bav < 7) && ((time(NULL) - stts) < 3));
-  if (bav == 7) {
-    wk2132_read_serial(windsensport, (char *)rcvbuf, 7);
-    /* check received data */
-    uint16_t crc = crc16_mb(rcvbuf, 5);
-    if ((rcvbuf[0] != WDAD) || (rcvbuf[1] != 0x03)
-     || (rcvbuf[2] != 0x02)
-     || ((crc >> 8) != rcvbuf[5]) || ((crc & 0xff) != rcvbuf[6])) {
-      ESP_LOGE("windsens.c", "Invalid reply from wind-direction-sensor received:");
-      ESP_LOGE("windsens.c", " `- %02x %02x %02x %02x %02x %02x %02x",
-                           rcvbuf[0], rcvbuf[1], rcvbuf[2], rcvbuf[3],
-                           rcvbuf[4], rcvbuf[5], rcvbuf[6]);
-      ESP_LOGE("windsens.c", " `- calculated CRC: %04x", crc);
-      return -1;
-    }
-    int calcdir = (rcvbuf[3] * 256) + rcvbuf[4];
-    if (calcdir <= 3600) {
-      return ((float)calcdir / 10.0);
-    }
+  } while ((bav < replen) && (waited < timeoutms));
+  if (bav != replen) {
+    return -1;
+  }
+  wk2132_read_serial(windsensport, (char *)rep, replen);
+  crc = crc16_mb(rep, replen - 2);
+  if ((rep[0] != req[0]) || (rep[1] != req[1])
+   || ((crc >> 8) != rep[replen - 2]) || ((crc & 0xff) != rep[replen - 1])) {
+    ESP_LOGE("windsens.c", "Invalid reply from modbus device 0x%02x received:", req[0]);
+    ESP_LOGE("windsens.c", " `- %02x %02x %02x %02x %02x %02x %02x",
+                         rep[0], rep[1], rep[2], rep[3],
+                         rep[4], rep[5], rep[6]);
+    ESP_LOGE("windsens.c", " `- calculated CRC: %04x", crc);
+    return -2;
+  }
+  return replen;
+}
+
+/* Reads one holding register. Needs to be called with our wk2132 port claimed. */
+static int modbus_readreg(uint8_t addr, uint16_t reg, uint16_t * val, int timeoutms)
+{
+  /*                 Addr  Func  RegisterAd____________  Length____  CRC_______ */
+  uint8_t req[8] = { addr, 0x03, (reg >> 8), (reg & 0xff), 0x00, 0x01, 0x00, 0x00 };
+  uint8_t rep[7];
+  /* We expect a reply of exactly 7 bytes */
+  if (modbus_transact(req, 6, rep, sizeof(rep), timeoutms) != sizeof(rep)) {
+    return -1;
+  }
+  if (rep[2] != 0x02) { /* Byte count */
+    return -2;
+  }
+  *val = (rep[3] << 8) | rep[4];
+  return 0;
+}
+
+/* Writes one holding register through function code 0x10 (write multiple
+ * registers), because that is what the sensor documentation uses.
+ * Needs to be called with our wk2132 port claimed. */
+static int modbus_writereg(uint8_t addr, uint16_t reg, uint16_t val)
+{
+  uint8_t req[11] = { addr,
+                      0x10,        /* Function code: write multiple registers */
+                      (reg >> 8), (reg & 0xff), /* Register start address */
+                      0x00, 0x01,  /* Length of the write (1x 16 bit) */
+                      0x02,        /* Number of bytes */
+                      (val >> 8), (val & 0xff), /* The new value to be written */
+                      0x00, 0x00   /* the CRC (will be filled in modbus_transact) */
+                    };
+  /* The reply echoes address, function, register and length. */
+  uint8_t rep[8];
+  int res = modbus_transact(req, 9, rep, sizeof(rep), WSREPLYTIMEOUT);
+  if (addr == 0x00) { /* Broadcast, there is no reply to check. */
+    return (res == 0) ? 0 : -1;
+  }
+  return (res == sizeof(rep)) ? 0 : -1;
+}
+
+int windsens_probe(void)
+{
+  int res = 0;
+  uint16_t v;
+  wk2132_claim(windsensport, -1);
+  if (modbus_readreg(wdad, 0x0000, &v, WSSCANTIMEOUT) == 0) { res |= WINDSENS_DIR; }
+  if (modbus_readreg(wsad, 0x0000, &v, WSSCANTIMEOUT) == 0) { res |= WINDSENS_SPEED; }
+  wk2132_release(windsensport);
+  return res;
+}
+
+float windsens_getwinddir(void)
+{
+  uint16_t v;
+  int res;
+  wk2132_claim(windsensport, -1);
+  res = modbus_readreg(wdad, 0x0000, &v, WSREPLYTIMEOUT);
+  wk2132_release(windsensport);
+  if ((res == 0) && (v <= 3600)) {
+    return ((float)v / 10.0);
   }
-  ESP_LOGE("windsens.c", "No (valid) reply received from wind-direction-sensor (%d bytes)", bav);
+  ESP_LOGE("windsens.c", "No (valid) reply received from wind-direction-sensor (%d)", res);
   return -1.0;
 }
 
 float windsens_getwindspeed(void)
 {
-  /*                 Addr  Func  RegisterAd  Length____  CRC_______ */
-  uint8_t wsq[8] = { WSAD, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00 };
-  uint16_t crc = crc16_mb(wsq, 6);
-  wsq[6] = (crc >> 8);   /* MSB */
-  wsq[7] = (crc & 0xff); /* LSB */
-  uint8_t rcvbuf[10];
-  /* First clear anything that is still in the input buffer */
-  while (wk2132_get_available_to_read(windsensport) > 0) {
-    wk2132_read_serial(windsensport, (char *)rcvbuf, 1);
+  uint16_t v;
+  int res;
+  wk2132_claim(windsensport, -1);
+  res = modbus_readreg(wsad, 0x0000, &v, WSREPLYTIMEOUT);
+  wk2132_release(windsensport);
+  if (res == 0) {
+    return ((float)v / 10.0);
   }
-  switchtoTX();
-  wk2132_write_serial(windsensport, (const char *)wsq, sizeof(wsq));
-  wk2132_flush(windsensport);
-  switchtoRX();
-  /* We expect a reply of exactly 7 bytes, so wait for that with timeout */
-  time_t stts = time(NULL);
-  int bav;
-  do {
-    vTaskDelay(pdMS_TO_TICKS(333));
-    bav = wk2132_get_available_to_read(windsensport);
-  } while ((bav < 7) && ((time(NULL) - stts) < 3));
-  if (bav == 7) {
-    wk2132_read_serial(windsensport, (char *)rcvbuf, 7);
-    /* check received data */
-    uint16_t crc = crc16_mb(rcvbuf, 5);
-    if ((rcvbuf[0] != WSAD) || (rcvbuf[1] != 0x03)
-     || (rcvbuf[2] != 0x02)
-     || ((crc >> 8) != rcvbuf[5]) || ((crc & 0xff) != rcvbuf[6])) {
-      ESP_LOGE("windsens.c", "Invalid reply from wind-speed-sensor received:");
-      ESP_LOGE("windsens.c", " `- %02x %02x %02x %02x %02x %02x %02x",
-                           rcvbuf[0], rcvbuf[1], rcvbuf[2], rcvbuf[3],
-                           rcvbuf[4], rcvbuf[5], rcvbuf[6]);
-      ESP_LOGE("windsens.c", " `- calculated CRC: %04x", crc);
-      return -1.0;
+  ESP_LOGE("windsens.c", "No (valid) reply received from wind-speed-sensor (%d)", res);
+  return -1.0;
+}
+
+int windsens_scanbus(uint8_t from, uint8_t to, uint8_t * found, int maxfound)
+{
+  int nfound = 0;
+  if (from < 1) { from = 1; }
+  if (to > 247) { to = 247; }
+  for (int a = from; a <= to; a++) {
+    uint16_t v;
+    wk2132_claim(windsensport, -1);
+    int res = modbus_readreg(a, 0x0000, &v, WSSCANTIMEOUT);
+    wk2132_release(windsensport);
+    if (res == 0) {
+      ESP_LOGI("windsens.c", "modbus scan: device 0x%02x replied (register 0 = %u)", a, v);
+      if (nfound < maxfound) {
+        found[nfound] = a;
+      }
+      nfound++;
     }
-    int calcsp = (rcvbuf[3] * 256) + rcvbuf[4];
-    return ((float)calcsp / 10.0);
   }
-  ESP_LOGE("windsens.c", "No (valid) reply received from wind-speed-sensor (%d bytes)", bav);
-  return -1.0;
+  return nfound;
+}
+
+int windsens_readreg(uint8_t addr, uint16_t reg, uint16_t * val)
+{
+  int res;
+  wk2132_claim(windsensport, -1);
+  res = modbus_readreg(addr, reg, val, WSREPLYTIMEOUT);
+  wk2132_release(windsensport);
+  return res;
+}
+
+int windsens_writereg(uint8_t addr, uint16_t reg, uint16_t val)
+{
+  int res;
+  ESP_LOGI("windsens.c", "writing 0x%04x to register 0x%04x of modbus device 0x%02x", val, reg, addr);
+  wk2132_claim(windsensport, -1);
+  res = modbus_writereg(addr, reg, val);
+  wk2132_release(windsensport);
+  return res;
+}
+
+int windsens_setsensoraddr(uint8_t addr, uint8_t newaddr)
+{
+  if ((newaddr < 1) || (newaddr > 247)) {
+    return -1;
+  }
+  return windsens_writereg(addr, WSREG_SLAVEADDR, newaddr);
+}
+
+int windsens_setsensorbaud(uint8_t addr, long baudrate)
+{
+  for (int i = 0; i < (sizeof(sensorbaudrates) / sizeof(sensorbaudrates[0])); i++) {
+    if (sensorbaudrates[i] == baudrate) {
+      return windsens_writereg(addr, WSREG_BAUDRATE, i);
+    }
+  }
+  ESP_LOGE("windsens.c", "baudrate %ld is not supported by the sensors", baudrate);
+  return -1;
+}
+
+int windsens_setlocalbaud(long baudrate)
+{
+  int supported = 0;
+  for (int i = 0; i < (sizeof(sensorbaudrates) / sizeof(sensorbaudrates[0])); i++) {
+    if (sensorbaudrates[i] == baudrate) { supported = 1; }
+  }
+  if (supported == 0) {
+    return -1;
+  }
+  wk2132_claim(windsensport, -1);
+  windsensbaud = baudrate;
+  wk2132_serialportinit(windsensport, windsensbaud);
+  wk2132_release(windsensport);
+  ESP_LOGI("windsens.c", "modbus now running at %ld baud", windsensbaud);
+  return savesettings();
+}
+
+int windsens_setaddrs(uint8_t diraddr, uint8_t speedaddr)
+{
+  if ((diraddr < 1) || (diraddr > 247) || (speedaddr < 1) || (speedaddr > 247)) {
+    return -1;
+  }
+  wk2132_claim(windsensport, -1);
+  wdad = diraddr;
+  wsad = speedaddr;
+  wk2132_release(windsensport);
+  return savesettings();
+}
+
+void windsens_getsettings(uint8_t * diraddr, uint8_t * speedaddr, long * baudrate)
+{
+  *diraddr = wdad;
+  *speedaddr = wsad;
+  *baudrate = windsensbaud;
 }
 
 float windsens_getwindsp_multisample(long timeout)
@@ -12,6 +12,13 @@
 /* Initializes the wind sensors (mostly the ports they're connected to) */
 void windsens_init(uint8_t wsp);
 
+/* Checks which of the sensors reply on the modbus.
+ * Returns a bitmask: bit 0 set if the wind direction sensor replied,
+ * bit 1 set if the wind speed sensor replied. */
+#define WINDSENS_DIR   0x01
+#define WINDSENS_SPEED 0x02
+int windsens_probe(void);
+
 /* Returns the wind direction - in degrees (0.0 - 360.0).
  * Returns <0.0 on error.
  * This communicates with and waits for reply from the sensor, so
@@ -32,5 +39,40 @@ float windsens_getwindspeed(void);
  */
 float windsens_getwindsp_multisample(long timeout);
 
+/* The following are for (re)configuring the sensors on the modbus, and
+ * are meant to be used from the admin webinterface. Changes to the
+ * address or baudrate of a sensor only take effect after the sensor
+ * has been power-cycled. All of these return 0 on success. */
+
+/* Scans the modbus for devices in the address range from - to (inclusive),
+ * by trying to read register 0 from every address.
+ * Up to maxfound addresses that replied are stored in found.
+ * Returns the number of devices that replied. Note that this takes
+ * roughly 150 ms per address. */
+int windsens_scanbus(uint8_t from, uint8_t to, uint8_t * found, int maxfound);
+
+/* Read / Write a single holding register on a modbus device.
+ * Writing to address 0 is a broadcast to all devices. */
+int windsens_readreg(uint8_t addr, uint16_t reg, uint16_t * val);
+int windsens_writereg(uint8_t addr, uint16_t reg, uint16_t val);
+
+/* Changes the modbus address of the sensor at addr to newaddr. */
+int windsens_setsensoraddr(uint8_t addr, uint8_t newaddr);
+
+/* Changes the baudrate of the sensor at addr. Supported are
+ * 2400, 4800, 9600, 19200, 38400, 57600 and 115200. */
+int windsens_setsensorbaud(uint8_t addr, long baudrate);
+
+/* Changes the baudrate we use on the modbus (i.e. of the wk2132 port).
+ * This is saved to NVS and used from then on. */
+int windsens_setlocalbaud(long baudrate);
+
+/* Sets which modbus addresses the wind direction and wind speed
+ * sensors are at. This is saved to NVS. */
+int windsens_setaddrs(uint8_t diraddr, uint8_t speedaddr);
+
+/* Returns the current settings */
+void windsens_getsettings(uint8_t * diraddr, uint8_t * speedaddr, long * baudrate);
+
 #endif /* _WINDSENS_H_ */
 
@@ -5,12 +5,14 @@
  * is available in English... Who doesn't love a little challenge? */
 
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <time.h>
+#include "i2c.h"
 #include "wk2132.h"
 #include "sdkconfig.h"
 
-#define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication */
-
 #define WK2132DEBUG 0   /* Logs practically all I2C communication when set to 1 */
 
 /* The following is the BASE address of the chip. Because the chip
@@ -77,39 +79,71 @@ static uint8_t lastselectedpage[2] = { 99, 99 };
 #define GETI2CAD(type, sub_uart) \
   (WK2132BASEADDR | type | ((sub_uart == 1) ? WK2132_CHAN1 : WK2132_CHAN0))
 
+/* Because the chip abuses address bits for function selection, it
+ * looks like 4 different devices to the I2C bus: register and FIFO
+ * access for each of the two channels. */
+#define WK2132DEV(type, sub_uart) { \
+  .addr = GETI2CAD(type, sub_uart), \
+  .name = "WK2132", \
+  .maxclk = 400000, \
+  .timeoutms = 50, \
+}
+static struct i2cdev wk2132devs[WK2132_NUM_CHANS][2] = {
+  { WK2132DEV(WK2132_REGS, 0), WK2132DEV(WK2132_FIFO, 0) },
+  { WK2132DEV(WK2132_REGS, 1), WK2132DEV(WK2132_FIFO, 1) },
+};
+
+/* Locking:
+ * Everything that talks to the chip holds the (recursive) I2C bus lock,
+ * most importantly the page selection (and our cache of it in
+ * lastselectedpage) together with the register access that follows it.
+ * The public functions can hold it over a whole sequence of register
+ * accesses, e.g. a read-modify-write of a global register.
+ * wk2132chanmutex is for the users of the channels: whoever needs
+ * a sequence of operations on one channel to not be interleaved with
+ * somebody elses (e.g. send a request, then wait for and read the
+ * reply) claims the channel with wk2132_claim() first. The two channels
+ * can be used independently from each other. */
+static SemaphoreHandle_t wk2132chanmutex[2] = { NULL, NULL };
+
+#define LOCKBUS()   i2c_bus_lock(wk2132i2cport)
+#define UNLOCKBUS() i2c_bus_unlock(wk2132i2cport)
+
 static esp_err_t wk2132_register_read_byte(uint8_t reg_addr, uint8_t sub_uart, uint8_t page, uint8_t * data)
 {
     int ret;
     uint8_t write_buf[2];
-    uint8_t i2caddr = GETI2CAD(WK2132_REGS, sub_uart);
     page = page & 0x01; // Only one bit allowed.
     if (sub_uart >= WK2132_NUM_CHANS) {
       ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+      return ESP_ERR_INVALID_ARG;
     }
+    LOCKBUS();
     if (page != lastselectedpage[sub_uart]) { /* Switch page */
 #if (WK2132DEBUG > 0)
       ESP_LOGI("wk2132.c", "switching page to %u on UART %u", page, sub_uart);
 #endif /* WK2132DEBUG */
       write_buf[0] = REG_WK2132_SPAGE;
       write_buf[1] = page;
-      ret = i2c_master_write_to_device(wk2132i2cport, i2caddr, write_buf, 2,
-                                       pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+      ret = i2c_dev_write(&wk2132devs[sub_uart][WK2132_REGS], write_buf, 2);
       if (ret != ESP_OK) { /* that did not work */
         ESP_LOGE("wk2132.c", "could not select page %02x on WK2132.", page);
+        lastselectedpage[sub_uart] = 99; /* We no longer know which page is selected */
+        UNLOCKBUS();
         return ret;
       }
       lastselectedpage[sub_uart] = page;
     }
     write_buf[0] = reg_addr;
-    ret = i2c_master_write_read_device(wk2132i2cport, i2caddr,
-                                       write_buf, 1, /* What we write */
-                                       data, 1,      /* What we read */
-                                       pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    ret = i2c_dev_writeread(&wk2132devs[sub_uart][WK2132_REGS],
+                            write_buf, 1, /* What we write */
+                            data, 1);     /* What we read */
+    UNLOCKBUS();
     if (ret != ESP_OK) { /* that did not work */
       ESP_LOGE("wk2132.c", "could not read register %02x on WK2132.", reg_addr);
     } else {
 #if (WK2132DEBUG > 0)
-      ESP_LOGI("wk2132.c", "read %02x from register %02x on UART %u, I2C %02x", *data, reg_addr, sub_uart, i2caddr);
+      ESP_LOGI("wk2132.c", "read %02x from register %02x on UART %u, I2C %02x", *data, reg_addr, sub_uart, GETI2CAD(WK2132_REGS, sub_uart));
 #endif /* WK2132DEBUG */
     }
     return ret;
@@ -119,30 +153,32 @@ static esp_err_t wk2132_register_write_byte(uint8_t reg_addr, uint8_t sub_uart,
 {
     int ret;
     uint8_t write_buf[2];
-    uint8_t i2caddr = GETI2CAD(WK2132_REGS, sub_uart);
     page = page & 0x01; // Only one bit allowed.
     if (sub_uart >= WK2132_NUM_CHANS) {
       ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+      return ESP_ERR_INVALID_ARG;
     }
+    LOCKBUS();
     if (page != lastselectedpage[sub_uart]) { /* Switch page */
       //ESP_LOGI("wk2132.c", "switching page to %u on UART %u", page, sub_uart);
       write_buf[0] = REG_WK2132_SPAGE;
       write_buf[1] = page;
-      ret = i2c_master_write_to_device(wk2132i2cport, i2caddr, write_buf, 2,
-                                       pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+      ret = i2c_dev_write(&wk2132devs[sub_uart][WK2132_REGS], write_buf, 2);
       if (ret != ESP_OK) { /* that did not work */
         ESP_LOGE("wk2132.c", "could not select page %02x on WK2132.\n", page);
+        lastselectedpage[sub_uart] = 99; /* We no longer know which page is selected */
+        UNLOCKBUS();
         return ret;
       }
       lastselectedpage[sub_uart] = page;
     }
 #if (WK2132DEBUG > 0)
-    ESP_LOGI("wk2132.c", "writing %02x to register %02x on UART %u, I2C %02x", data, reg_addr, sub_uart, i2caddr);
+    ESP_LOGI("wk2132.c", "writing %02x to register %02x on UART %u, I2C %02x", data, reg_addr, sub_uart, GETI2CAD(WK2132_REGS, sub_uart));
 #endif /* WK2132DEBUG */
     write_buf[0] = reg_addr;
     write_buf[1] = data;
-    ret = i2c_master_write_to_device(wk2132i2cport, i2caddr, write_buf, 2,
-                                       pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    ret = i2c_dev_write(&wk2132devs[sub_uart][WK2132_REGS], write_buf, 2);
+    UNLOCKBUS();
     if (ret != ESP_OK) { /* that did not work */
       ESP_LOGE("wk2132.c", "could not write register %02x on WK2132.\n", reg_addr);
     }
@@ -153,6 +189,11 @@ void wk2132_init(i2c_port_t port)
 {
     uint8_t d;
     wk2132i2cport = port;
+    for (int i = 0; i < WK2132_NUM_CHANS; i++) {
+      wk2132chanmutex[i] = xSemaphoreCreateMutex();
+      i2c_dev_init(&wk2132devs[i][WK2132_REGS], port);
+      i2c_dev_init(&wk2132devs[i][WK2132_FIFO], port);
+    }
     /* Configure the WK2132 */
     /* shut down all UARTs */
     wk2132_register_read_byte(REG_WK2132_GENA, 0, 0, &d);
@@ -165,12 +206,21 @@ void wk2132_init(i2c_port_t port)
     /* We do NOT configure the UARTs here - they have specific init functions. */
 }
 
+int wk2132_probe(void)
+{
+    return (i2c_dev_probe(&wk2132devs[0][WK2132_REGS]) == ESP_OK);
+}
+
 void wk2132_serialportinit(uint8_t sub_uart, long baudrate)
 {
     uint8_t d;
     if (sub_uart >= WK2132_NUM_CHANS) {
       ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+      return;
     }
+    /* The global registers are shared between both channels, so the
+     * read-modify-write sequences on them must not be interrupted. */
+    LOCKBUS();
     /* First enable the clock for the port. */
     wk2132_register_read_byte(REG_WK2132_GENA, 0, 0, &d); // Global register!
     d = d | (1 << sub_uart);
@@ -208,6 +258,30 @@ void wk2132_serialportinit(uint8_t sub_uart, long baudrate)
     wk2132_register_write_byte(REG_WK2132_LCR, sub_uart, 0, 0x00);
     /* enable RX and TX on the port */
     wk2132_register_write_byte(REG_WK2132_SCR, sub_uart, 0, 0x03);
+    UNLOCKBUS();
+}
+
+int wk2132_claim(uint8_t sub_uart, int timeoutms)
+{
+  if (sub_uart >= WK2132_NUM_CHANS) {
+    ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return 1;
+  }
+  TickType_t to = (timeoutms < 0) ? portMAX_DELAY : pdMS_TO_TICKS(timeoutms);
+  if (xSemaphoreTake(wk2132chanmutex[sub_uart], to) != pdTRUE) {
+    ESP_LOGW("wk2132.c", "timeout waiting to claim UART %u", sub_uart);
+    return 1;
+  }
+  return 0;
+}
+
+void wk2132_release(uint8_t sub_uart)
+{
+  if (sub_uart >= WK2132_NUM_CHANS) {
+    ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return;
+  }
+  xSemaphoreGive(wk2132chanmutex[sub_uart]);
 }
 
 uint8_t wk2132_get_available_to_read(uint8_t sub_uart)
@@ -215,6 +289,7 @@ uint8_t wk2132_get_available_to_read(uint8_t sub_uart)
   uint8_t bc;
   if (sub_uart >= WK2132_NUM_CHANS) {
     ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return 0;
   }
   if (wk2132_register_read_byte(REG_WK2132_RFCNT, sub_uart, 0, &bc) != ESP_OK) {
     return 0;
@@ -224,61 +299,74 @@ uint8_t wk2132_get_available_to_read(uint8_t sub_uart)
 
 uint8_t wk2132_read_serial(uint8_t sub_uart, char * buf, uint8_t len)
 {
-  uint8_t res = 0;
   uint8_t bc;
-  uint8_t i2caddr = GETI2CAD(WK2132_FIFO, sub_uart);
+  esp_err_t e;
   if (sub_uart >= WK2132_NUM_CHANS) {
     ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return 0;
   }
+  LOCKBUS();
   /* Find out how many bytes are available in the RX FIFO, and read at most that. */
-  wk2132_register_read_byte(REG_WK2132_RFCNT, sub_uart, 0, &bc);
+  e = wk2132_register_read_byte(REG_WK2132_RFCNT, sub_uart, 0, &bc);
+  if (e != ESP_OK) {
+    UNLOCKBUS();
+    return 0;
+  }
   if (bc > len) { bc = len; }
-  for (int i = 0; i < bc; i++) {
-    esp_err_t e;
-    e = i2c_master_read_from_device(wk2132i2cport,
-                                    i2caddr, (uint8_t *)&buf[i], 1,
-                                    pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-    if (e != ESP_OK) {
-      ESP_LOGE("wk2132.c", "Failed to read from FIFO on sub_uart %02x", sub_uart);
-      break;
-    } else {
+  if (bc == 0) {
+    UNLOCKBUS();
+    return 0;
+  }
+  /* The FIFO address can be read in one burst, there is no need to
+   * do one I2C transaction per byte. */
+  e = i2c_dev_read(&wk2132devs[sub_uart][WK2132_FIFO], (uint8_t *)buf, bc);
+  UNLOCKBUS();
+  if (e != ESP_OK) {
+    ESP_LOGE("wk2132.c", "Failed to read from FIFO on sub_uart %02x", sub_uart);
+    return 0;
+  }
 #if WK2132DEBUG > 0
-      ESP_LOGI("wk2132.c", "read %02x from FIFO on UART %d, I2C %02x", buf[i], sub_uart, i2caddr);
-#endif /* WK2132DEBUG */
-    }
-    res++;
+  for (int i = 0; i < bc; i++) {
+    ESP_LOGI("wk2132.c", "read %02x from FIFO on UART %d, I2C %02x", buf[i], sub_uart, GETI2CAD(WK2132_FIFO, sub_uart));
   }
-  return res;
+#endif /* WK2132DEBUG */
+  return bc;
 }
 
 uint8_t wk2132_write_serial(uint8_t sub_uart, const char * buf, uint8_t len)
 {
-  uint8_t res = 0;
   uint8_t bc;
-  uint8_t i2caddr = GETI2CAD(WK2132_FIFO, sub_uart);
+  esp_err_t e;
   if (sub_uart >= WK2132_NUM_CHANS) {
     ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return 0;
   }
+  LOCKBUS();
   /* Find out how much space is available in the TX FIFO, and write at most that. */
-  wk2132_register_read_byte(REG_WK2132_TFCNT, sub_uart, 0, &bc);
+  e = wk2132_register_read_byte(REG_WK2132_TFCNT, sub_uart, 0, &bc);
+  if (e != ESP_OK) {
+    UNLOCKBUS();
+    return 0;
+  }
   bc = 0xff - bc;
   if (bc > len) { bc = len; }
-  for (int i = 0; i < bc; i++) {
-    esp_err_t e;
-    e = i2c_master_write_to_device(wk2132i2cport,
-                                   i2caddr, (const uint8_t *)&buf[i], 1,
-                                   pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-    if (e != ESP_OK) {
-      ESP_LOGE("wk2132.c", "Failed to write to FIFO on sub_uart %02x", sub_uart);
-      break;
-    } else {
+  if (bc == 0) {
+    UNLOCKBUS();
+    return 0;
+  }
+  /* Like reading, writing to the FIFO works in one burst. */
+  e = i2c_dev_write(&wk2132devs[sub_uart][WK2132_FIFO], (const uint8_t *)buf, bc);
+  UNLOCKBUS();
+  if (e != ESP_OK) {
+    ESP_LOGE("wk2132.c", "Failed to write to FIFO on sub_uart %02x", sub_uart);
+    return 0;
+  }
 #if (WK2132DEBUG > 0)
-      ESP_LOGI("wk2132.c", "wrote %02x to FIFO on UART %d, I2C %02x", buf[i], sub_uart, i2caddr);
-#endif /* WK2132DEBUG */
-    }
-    res++;
+  for (int i = 0; i < bc; i++) {
+    ESP_LOGI("wk2132.c", "wrote %02x to FIFO on UART %d, I2C %02x", buf[i], sub_uart, GETI2CAD(WK2132_FIFO, sub_uart));
   }
-  return res;
+#endif /* WK2132DEBUG */
+  return bc;
 }
 
 void wk2132_flush(uint8_t sub_uart)
@@ -288,11 +376,16 @@ void wk2132_flush(uint8_t sub_uart)
   time_t stati = time(NULL);
   if (sub_uart >= WK2132_NUM_CHANS) {
     ESP_LOGE("wk2132.c", "non-existant UART %u addressed", sub_uart);
+    return;
   }
   do {
     e = wk2132_register_read_byte(REG_WK2132_FSR, sub_uart, 0, &d);
     if (e != ESP_OK) break;
     if ((time(NULL) - stati) > 2) break; /* Timeout, abort */
     /* Bits in FSR-register: Bit 0 - TX Busy, Bit 2 - TX FIFO not empty */
+    if ((d & 0x05) != 0) {
+      /* Give the other channel a chance to use the bus while we wait. */
+      vTaskDelay(1);
+    }
   } while ((d & 0x05) != 0);
 }
@@ -7,10 +7,24 @@
 /* General initialization of the I2C-to-Serial-adapter */
 void wk2132_init(i2c_port_t port);
 
+/* Checks whether the chip is there. Returns 1 if it is. */
+int wk2132_probe(void);
+
 /* Initialize one of the two sub_uarts.
  * Enables the serial port and sets the baudrate. */
 void wk2132_serialportinit(uint8_t sub_uart, long baudrate);
 
+/* All of the functions here can be called from multiple tasks, every
+ * single one of them is atomic. If you need a whole sequence of them on
+ * one sub_uart to not be interleaved with other tasks using the same
+ * sub_uart (e.g. write a request and then read the reply), claim the
+ * sub_uart first, and release it afterwards. The two sub_uarts can be
+ * claimed and used independently from each other.
+ * timeoutms < 0 means wait forever.
+ * wk2132_claim returns 0 on success. */
+int wk2132_claim(uint8_t sub_uart, int timeoutms);
+void wk2132_release(uint8_t sub_uart);
+
 /* Get the number of bytes available to read in the FIFO */
 uint8_t wk2132_get_available_to_read(uint8_t sub_uart);
 